@@ -0,0 +1,339 @@
+#include "gbn.h"
+#include<sys/resource.h>
+#include<sys/time.h>
+#include<sys/wait.h>
+
+/*----- Throughput benchmark over loopback -----*/
+/* Every combination of the swept parameters is one run: a receiver and a  */
+/* sender process connect over 127.0.0.1 and move size bytes from memory   */
+/* to memory. Loss is applied to the DATA packets the receiver gets, and   */
+/* the RTT is split as a delay on both sides (see GBN_IMPAIR). One line    */
+/* per run is printed as CSV, or one object per run as JSON (-j).          */
+
+#define MAXVALUES   32			/* Most values per swept parameter 				 */
+#define CHUNK  (1 << 20)		/* Bytes handed to gbn_send at a time 			 */
+#define RUN_TIMEOUT 120			/* Default seconds before a run is abandoned 		 */
+
+/*----- Result of a run, written by the sender process to a pipe -----*/
+typedef struct result {
+	double seconds;				/* From gbn_connect to the end of gbn_close 		 */
+	gbn_stats stats;			/* Sender's counters once everything is ACKed 		 */
+	int ok;						/* Every byte sent and acknowledged 				 */
+} result;
+
+static char data[CHUNK];		/* Payload, filled with pseudo-random bytes 		 */
+
+/*----- Wall clock in seconds -----*/
+static double now(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*----- Parsing a comma-separated list of numbers, with k/m/g as powers of 1024 -----*/
+static int parseList(const char *str, double *values){
+	char *end;
+	int n = 0;
+
+	while (*str != '\0'){
+		if (n == MAXVALUES)
+			return(-1);
+		values[n] = strtod(str, &end);
+		if (end == str || values[n] < 0)
+			return(-1);
+		switch (*end){
+			case 'k': case 'K': values[n] *= 1024; end++; break;
+			case 'm': case 'M': values[n] *= 1024 * 1024; end++; break;
+			case 'g': case 'G': values[n] *= 1024 * 1024 * 1024; end++; break;
+		}
+		n++;
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return(-1);
+		str = end;
+	}
+
+	return (n > 0) ? n : -1;
+}
+
+/*----- Setting the options shared by both ends of a run -----*/
+static int setOptions(int sockfd, int mss, int sack, double loss, double rtt, unsigned long seed){
+	gbn_impair impair;
+
+	if ((sack && gbn_setsockopt(sockfd, GBN_SACK, &sack, sizeof(sack)) == -1) ||
+		gbn_setsockopt(sockfd, GBN_MSS, &mss, sizeof(mss)) == -1)
+		return(-1);
+
+	if (loss == 0 && rtt == 0)
+		return(0);
+	gbn_impair_parse("", &impair);
+	impair.seed  = seed;
+	impair.loss  = loss;
+	impair.delay = (uint64_t)(rtt * 1000 / 2);
+	return gbn_setsockopt(sockfd, GBN_IMPAIR, &impair, sizeof(impair));
+}
+
+/*----- Receiver process: accepts one connection and reads until the end -----*/
+static void runReceiver(int sockfd, double size){
+	static char buf[CHUNK];
+	int newSockfd;
+	ssize_t numRead;
+	double total = 0;
+
+	if ((newSockfd = gbn_accept(sockfd, NULL, NULL)) == -1){
+		perror("gbn_accept");
+		_exit(1);
+	}
+	while ((numRead = gbn_recv(newSockfd, buf, sizeof(buf), 0)) > 0)
+		total += numRead;
+	if (numRead == -1)
+		perror("gbn_recv");
+	gbn_close(newSockfd);
+	_exit(total == size ? 0 : 1);
+}
+
+/*----- Sender process: sends size bytes, reports the result on fd -----*/
+static void runSender(int fd, const struct sockaddr_in *server, double size, int mss, int window,
+					  int sack, int threaded, double rtt, unsigned long seed){
+	result res;
+	double left = size;
+	double start;
+	size_t len;
+	int sockfd;
+
+	memset(&res, 0, sizeof(res));
+	if ((sockfd = gbn_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1 ||
+		setOptions(sockfd, mss, sack, 0, rtt, seed) == -1 ||
+		gbn_setsockopt(sockfd, GBN_WINDOW, &window, sizeof(window)) == -1 ||
+		(threaded && gbn_setsockopt(sockfd, GBN_THREADS, &threaded, sizeof(threaded)) == -1)){
+		perror("gbn_socket");
+		_exit(1);
+	}
+
+	start = now();
+	if (gbn_connect(sockfd, (const struct sockaddr *)server, sizeof(*server)) == -1){
+		perror("gbn_connect");
+		_exit(1);
+	}
+	while (left > 0){
+		len = (left < CHUNK) ? (size_t)left : CHUNK;
+		if (gbn_send(sockfd, data, len, 0) == -1){
+			perror("gbn_send");
+			break;
+		}
+		left -= len;
+	}
+	res.ok = (left == 0 && gbn_flush(sockfd) == 0);
+	gbn_getstats(sockfd, &res.stats);
+	res.ok = (gbn_close(sockfd) == 0 && res.ok);
+	res.seconds = now() - start;
+
+	if (write(fd, &res, sizeof(res)) != sizeof(res))
+		_exit(1);
+	_exit(0);
+}
+
+/*----- Waiting for a child until the deadline; kills it afterwards -----*/
+static int reap(pid_t pid, double deadline, struct rusage *usage){
+	int status;
+	pid_t ret;
+
+	while ((ret = wait4(pid, &status, WNOHANG, usage)) == 0){
+		if (now() > deadline){
+			kill(pid, SIGKILL);
+			wait4(pid, &status, 0, usage);
+			return(-1);
+		}
+		usleep(1000);
+	}
+
+	return (ret == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+/*----- One run: returns 0 and fills res, or -1 if it failed -----*/
+static int runOnce(double size, int mss, int window, int sack, int threaded, double loss, double rtt,
+				   unsigned long seed, int timeout, result *res, double *cpu){
+	int sockfd;
+	int fds[2];
+	int ok = 1;
+	pid_t receiver;
+	pid_t sender;
+	struct sockaddr_in server;
+	socklen_t socklen = sizeof(server);
+	struct rusage usage;
+	double deadline;
+
+	memset(res, 0, sizeof(*res));
+	*cpu = 0;
+
+	/*----- Listening on an ephemeral loopback port -----*/
+	memset(&server, 0, sizeof(server));
+	server.sin_family      = AF_INET;
+	server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	server.sin_port        = 0;
+	if ((sockfd = gbn_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1 ||
+		setOptions(sockfd, mss, sack, loss, rtt, seed) == -1 ||
+		gbn_bind(sockfd, (struct sockaddr *)&server, sizeof(server)) == -1 ||
+		getsockname(sockfd, (struct sockaddr *)&server, &socklen) == -1 ||
+		gbn_listen(sockfd, 1) == -1){
+		perror("bench: receiver socket");
+		return(-1);
+	}
+
+	if (pipe(fds) == -1){
+		perror("pipe");
+		gbn_close(sockfd);
+		return(-1);
+	}
+
+	fflush(stdout);
+	if ((receiver = fork()) == 0)
+		runReceiver(sockfd, size);
+	gbn_close(sockfd);
+	if (receiver == -1 || (sender = fork()) == -1){
+		perror("fork");
+		if (receiver != -1)
+			kill(receiver, SIGKILL);
+		close(fds[0]);
+		close(fds[1]);
+		return(-1);
+	}
+	if (sender == 0){
+		close(fds[0]);
+		runSender(fds[1], &server, size, mss, window, sack, threaded, rtt, seed);
+	}
+	close(fds[1]);
+
+	/*----- Collecting both processes and their CPU time -----*/
+	deadline = now() + timeout;
+	if (reap(sender, deadline, &usage) == -1)
+		ok = 0;
+	*cpu += usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	if (reap(receiver, deadline, &usage) == -1)
+		ok = 0;
+	*cpu += usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+
+	if (read(fds[0], res, sizeof(*res)) != sizeof(*res))
+		ok = 0;
+	close(fds[0]);
+
+	return (ok && res->ok) ? 0 : -1;
+}
+
+int main(int argc, char *argv[]){
+	double sizes[MAXVALUES] = {4 << 20};		/* Bytes per run (-s) 						 */
+	double msss[MAXVALUES] = {DATALEN, 8192};	/* Maximum segment sizes (-m) 				 */
+	double windows[MAXVALUES] = {WINDOW, 256};	/* Maximum windows in packets (-w) 			 */
+	double losses[MAXVALUES] = {0, 0.01};		/* Loss rates of DATA packets (-l) 			 */
+	double rtts[MAXVALUES] = {0, 10};			/* Added round-trip times in ms (-r) 		 */
+	int nsizes = 1, nmss = 2, nwindows = 2, nlosses = 2, nrtts = 2;
+	int sack = 0;								/* Selective Repeat (-S) 					 */
+	int threaded = 0;							/* Sender threads (-T) 						 */
+	int repeat = 1;								/* Runs per combination (-n) 				 */
+	int json = 0;								/* Print JSON instead of CSV (-j) 			 */
+	int timeout = RUN_TIMEOUT;					/* Seconds before a run is abandoned (-t) 	 */
+	unsigned long seed = 1;						/* Impairment seed (-e) 					 */
+	int opt;
+	int i, a, b, c, d, e;
+	int count = 0;
+	int ok;
+	int failed = 0;
+	double cpu;									/* CPU seconds of both processes 			 */
+	double goodput;								/* Megabits per second 						 */
+	double ratio;								/* Retransmitted share of the segments 		 */
+	result res;
+	const char *usage = "usage: gbnbench [-s sizes] [-m mss] [-w windows] [-l losses] [-r rtts_ms] [-S] [-T] [-n repeat] [-e seed] [-t timeout] [-j]\n";
+
+	/*----- Checking arguments -----*/
+	while ((opt = getopt(argc, argv, "s:m:w:l:r:STn:e:t:j")) != -1){
+		switch (opt){
+			case 's':
+				nsizes = parseList(optarg, sizes);
+				break;
+			case 'm':
+				nmss = parseList(optarg, msss);
+				break;
+			case 'w':
+				nwindows = parseList(optarg, windows);
+				break;
+			case 'l':
+				nlosses = parseList(optarg, losses);
+				break;
+			case 'r':
+				nrtts = parseList(optarg, rtts);
+				break;
+			case 'S':
+				sack = 1;
+				break;
+			case 'T':
+				threaded = 1;
+				break;
+			case 'n':
+				repeat = atoi(optarg);
+				break;
+			case 'e':
+				seed = strtoul(optarg, NULL, 0);
+				break;
+			case 't':
+				timeout = atoi(optarg);
+				break;
+			case 'j':
+				json = 1;
+				break;
+			default:
+				fprintf(stderr, "%s", usage);
+				exit(-1);
+		}
+	}
+	if (optind != argc || nsizes < 0 || nmss < 0 || nwindows < 0 || nlosses < 0 || nrtts < 0 ||
+		repeat < 1 || timeout < 1){
+		fprintf(stderr, "%s", usage);
+		exit(-1);
+	}
+
+	for (i = 0; i < CHUNK; i++)
+		data[i] = (char)rand();
+
+	if (json)
+		printf("[");
+	else
+		printf("size,mss,window,loss,rtt_ms,sack,threads,run,ok,seconds,goodput_mbps,segments,retransmits,retrans_ratio,timeouts,fast_retransmits,srtt_us,cpu_s_per_gb\n");
+
+	for (a = 0; a < nsizes; a++)
+	for (b = 0; b < nmss; b++)
+	for (c = 0; c < nwindows; c++)
+	for (d = 0; d < nlosses; d++)
+	for (e = 0; e < nrtts; e++)
+	for (i = 0; i < repeat; i++){
+		ok = (runOnce(sizes[a], (int)msss[b], (int)windows[c], sack, threaded, losses[d], rtts[e],
+					  seed + i, timeout, &res, &cpu) == 0);
+		failed += !ok;
+		goodput = (ok && res.seconds > 0) ? sizes[a] * 8 / res.seconds / 1e6 : 0;
+		ratio   = res.stats.segssent ? (double)res.stats.retransmits / res.stats.segssent : 0;
+
+		if (json)
+			printf("%s\n  {\"size\": %.0f, \"mss\": %d, \"window\": %d, \"loss\": %g, \"rtt_ms\": %g, "
+				   "\"sack\": %d, \"threads\": %d, \"run\": %d, \"ok\": %s, \"seconds\": %.6f, \"goodput_mbps\": %.3f, "
+				   "\"segments\": %llu, \"retransmits\": %llu, \"retrans_ratio\": %.6f, \"timeouts\": %llu, "
+				   "\"fast_retransmits\": %llu, \"srtt_us\": %llu, \"cpu_s_per_gb\": %.3f}",
+				   count++ ? "," : "", sizes[a], (int)msss[b], (int)windows[c], losses[d], rtts[e], sack, threaded, i,
+				   ok ? "true" : "false", res.seconds, goodput,
+				   (unsigned long long)res.stats.segssent, (unsigned long long)res.stats.retransmits, ratio,
+				   (unsigned long long)res.stats.timeouts, (unsigned long long)res.stats.fastretransmits,
+				   (unsigned long long)res.stats.srtt, cpu / (sizes[a] / 1e9));
+		else
+			printf("%.0f,%d,%d,%g,%g,%d,%d,%d,%d,%.6f,%.3f,%llu,%llu,%.6f,%llu,%llu,%llu,%.3f\n",
+				   sizes[a], (int)msss[b], (int)windows[c], losses[d], rtts[e], sack, threaded, i, ok, res.seconds, goodput,
+				   (unsigned long long)res.stats.segssent, (unsigned long long)res.stats.retransmits, ratio,
+				   (unsigned long long)res.stats.timeouts, (unsigned long long)res.stats.fastretransmits,
+				   (unsigned long long)res.stats.srtt, cpu / (sizes[a] / 1e9));
+		fflush(stdout);
+	}
+
+	if (json)
+		printf("\n]\n");
+
+	return failed ? 1 : 0;
+}
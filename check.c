@@ -0,0 +1,91 @@
+#include "gbn.h"
+#include<sys/wait.h>
+
+/*----- Loopback checks of the socket life cycle -----*/
+/* Each check runs against 127.0.0.1 and prints one line; the exit status */
+/* is the number of checks that failed.                                   */
+
+/*----- Whether gbn_close released both the descriptor and its table entry -----*/
+static int released(int sockfd){
+	gbn_stats stats;
+
+	return fcntl(sockfd, F_GETFD) == -1 && errno == EBADF && gbn_getstats(sockfd, &stats) == -1;
+}
+
+/*----- Print the outcome of a check -----*/
+static int report(const char *name, int ok){
+	printf("%-40s %s\n", name, ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+/*----- A socket closed before it is bound or connected -----*/
+static int checkUnused(void){
+	int sockfd;
+
+	if ((sockfd = gbn_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1){
+		perror("gbn_socket");
+		return report("close of an unused socket", 0);
+	}
+	return report("close of an unused socket", gbn_close(sockfd) == 0 && released(sockfd));
+}
+
+/*----- A connect refused with a RST, then closed -----*/
+/* A plain UDP socket stands in for the server and answers the SYN with a */
+/* RST, as a listener whose backlog is full does.                         */
+static int checkRefused(void){
+	int serverfd;				/* Stand-in server 							 */
+	int sockfd;					/* Client 									 */
+	int refused;				/* gbn_connect failed with ECONNREFUSED 	 */
+	pid_t server;
+	gbnhdr packet;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	struct sockaddr_storage from;
+	socklen_t fromlen = sizeof(from);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((serverfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1 ||
+		bind(serverfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+		getsockname(serverfd, (struct sockaddr *)&addr, &addrlen) == -1){
+		perror("server socket");
+		return report("close after a refused connect", 0);
+	}
+
+	if ((server = fork()) == -1){
+		perror("fork");
+		return report("close after a refused connect", 0);
+	}
+	if (server == 0){
+		if (recvfrom(serverfd, &packet, sizeof(packet), 0, (struct sockaddr *)&from, &fromlen) == -1)
+			_exit(1);
+		packet.type       = RST;
+		packet.flags      = 0;
+		packet.checksum   = 0;
+		packet.payloadlen = 0;
+		packet.checksum   = checksum_fold(checksum_add(0, (const uint8_t *)&packet, GBN_HDRLEN));
+		sendto(serverfd, &packet, GBN_HDRLEN, 0, (struct sockaddr *)&from, fromlen);
+		_exit(0);
+	}
+	close(serverfd);
+
+	if ((sockfd = gbn_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1){
+		perror("gbn_socket");
+		waitpid(server, NULL, 0);
+		return report("close after a refused connect", 0);
+	}
+	refused = gbn_connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno == ECONNREFUSED;
+	waitpid(server, NULL, 0);
+
+	return report("close after a refused connect", refused && gbn_close(sockfd) == 0 && released(sockfd));
+}
+
+int main(void){
+	int failed = 0;
+
+	failed += checkUnused();
+	failed += checkRefused();
+
+	return failed;
+}
@@ -1,932 +1,3164 @@
 #include "gbn.h"
 
-/* Initialize global variable with the state of the client/server socket */
-state_t sockstate;
+/* Connection table: the state of each gbn socket, indexed by descriptor. */
+/* It is split into chunks of SOCKCHUNK entries, allocated when first      */
+/* needed and never moved or freed, so sock_get takes no lock while        */
+/* another thread adds a socket: entries and chunks are published with     */
+/* release stores. Adding and removing sockets take socklock.              */
+#define SOCKCHUNK   4096          /* Descriptors per chunk                    */
+#define SOCKCHUNKS 16384          /* Chunks: descriptors up to 2^26 - 1       */
 
-/* Initialize global variable with the client window values */
-window windowstate;
+static gbn_sock **socktable[SOCKCHUNKS];
+static pthread_mutex_t socklock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Return checksum for buf */
-uint16_t checksum(uint16_t *buf, int nwords)
-{
-    uint32_t sum;
+/* Defined with gbn_send, used by gbn_close */
+int send_drain(gbn_sock *sk, int sockfd);
 
-    for (sum = 0; nwords > 0; nwords--)
-        sum += *buf++;
-    sum = (sum >> 16) + (sum & 0xffff);
-    sum += (sum >> 16);
-    return ~sum;
-}
+/* Defined with the sender threads, used by sock_free */
+int stop_threads(gbn_sock *sk);
 
 /* Helper to create packets */
-void create_pkt(gbnhdr *packet, int type, int seqnum)
+void create_pkt(gbnhdr *packet, int type, uint32_t seqnum)
 {
     packet->type     = type;
+    packet->flags    = 0;
     packet->seqnum   = seqnum;
     packet->checksum = 0;
+    packet->payloadlen = 0;
 }
 
-/* Helper tp calculate the checksum */
-void calc_checksum(gbnhdr *packet, size_t len)
+/* Helper to calculate the checksum over the bytes that go on the wire, */
+/* or the CRC32C trailer if the packet has FLAG_CRC set.                 */
+void calc_checksum(gbnhdr *packet)
 {
+    uint32_t crc;
+
     /* Note: Packet's checksum value is 0 when this is calculated */
-    packet->checksum = checksum((uint16_t *)packet, (len / (sizeof(uint16_t))));
+    if (GBN_HASCRC(packet)){
+        crc = crc32c(0, (const uint8_t *)packet, GBN_HDRLEN + packet->payloadlen);
+        memcpy(packet->data + packet->payloadlen, &crc, CRC_BYTES);
+        return;
+    }
+
+    packet->checksum = checksum_fold(checksum_add(0, (const uint8_t *)packet, GBN_PKTLEN(packet)));
 }
 
-/* Timeout handler */
-void timeouthandler(int signo)
+/* Helper to validate a packet of len bytes read from the socket.          */
+/* Returns 0 if the length matches the header and the checksum (or the     */
+/* CRC32C trailer) is correct.                                             */
+int check_pkt(gbnhdr *packet, ssize_t len)
 {
-    /* Increment the number of recorded timeouts */
-    windowstate.numtimeouts += 1;
+    uint32_t crc;
+
+    /* A packet is a full header followed by exactly payloadlen bytes */
+    if (len < (ssize_t)GBN_HDRLEN || packet->payloadlen > MAXDATALEN || (ssize_t)GBN_PKTLEN(packet) != len)
+        return(-1);
+
+    if (GBN_HASCRC(packet)){
+        memcpy(&crc, packet->data + packet->payloadlen, CRC_BYTES);
+        if (packet->checksum != 0 || crc32c(0, (const uint8_t *)packet, GBN_HDRLEN + packet->payloadlen) != crc)
+            return(-1);
+        return(0);
+    }
+
+    /* Summed with its checksum, a correct packet checksums to 0 */
+    if (checksum_fold(checksum_add(0, (const uint8_t *)packet, len)) != 0)
+        return(-1);
+
+    return(0);
 }
 
-/*-----------------------------------------------------------------------*/
+/* Current time of the monotonic clock in microseconds */
+uint64_t now_us(void)
+{
+    struct timespec ts;
 
-/* Create the socket interface with the given domain, type, and protocol. */
-/* Nonblocking                                                            */
-int gbn_socket(int domain, int type, int protocol)
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Helper to let the kernel buffer a full window in either direction.  */
+/* This is best effort: the kernel caps it at rmem/wmem_max.           */
+void set_bufsize(int sockfd, int window, int mss)
 {
-    fprintf(stdout, "\n");
-    fprintf(stdout, "\n");
+    double size = (double)window * (GBN_HDRLEN + mss);
+    int bufsize = (size < 0x7fffffff) ? (int)size : 0x7fffffff;
 
-    int sockfd;
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+}
 
-    /*----- Randomizing the seed. This is used by the rand() function -----*/
-    srand((unsigned)time(0));
+/* Helper to reset the window when a connection is established */
+void init_window(gbn_sock *sk)
+{
+    state_t *sockstate = &sk->state;
+    window *windowstate = &sk->window;
+
+    cc_init(&windowstate->cc, windowstate->congestion, windowstate->maxwindow);
+    windowstate->window  = cc_window(&windowstate->cc);
+    windowstate->dupacks = 0;
+    windowstate->recover = sockstate->seqnum - 1;
+    windowstate->holeend = sockstate->seqnum;
+    windowstate->sndmax  = sockstate->expectedseqnum;
+    windowstate->rtseqnum = sockstate->expectedseqnum;
+    windowstate->rwnd    = MAXWINDOW;
+
+    /* Count from here */
+    memset(&sk->stats, 0, sizeof(sk->stats));
+    sk->starttime = now_us();
+
+    /* Make room in the kernel for a full window of the negotiated size */
+    if (windowstate->maxwindow != WINDOW || sockstate->mss > DATALEN)
+        set_bufsize(sockstate->sockfd, windowstate->maxwindow, sockstate->mss);
+
+    LOGINFO("init_window: congestion control: %s\n", windowstate->cc.ops->name);
+}
 
-    if ((sockfd = socket(domain, type, protocol)) == -1){
-        fprintf(stderr, "gbn_socket: error opening socket\n");
-        perror("gbn_socket");
-        return(-1);
+/* Helper to allocate the send buffer on first use, and to make room in  */
+/* the descriptor ring for a full window. The ring is only resized while */
+/* nothing is in flight; until then the window is clamped to its size.   */
+/* Returns 0 on success, -1 if memory is exhausted.                       */
+int init_sndbuf(gbn_sock *sk)
+{
+    window *windowstate = &sk->window;
+    gbn_txseg *txsegs;
+    uint32_t size = BATCH;
+
+    /* A packet never wraps around the ring, so it must hold one of each size */
+    if (windowstate->sndbuf == NULL){
+        while (windowstate->sndsize < (size_t)sk->state.mss)
+            windowstate->sndsize *= 2;
+        if ((windowstate->sndbuf = malloc(windowstate->sndsize)) == NULL)
+            return(-1);
     }
 
-    /* Update state */
-    sockstate.sockfd = sockfd;
-    sockstate.status = CLOSED;
-    /* Packet sequence number (0-255) */
-    sockstate.seqnum = rand() % 256;
-    sockstate.expectedseqnum = sockstate.seqnum;
+    /* Packets in flight must never share an entry */
+    while (size < (uint32_t)windowstate->maxwindow)
+        size *= 2;
 
-    /* Update window */
-    windowstate.numtimeouts = 0;
-    windowstate.window      = 1;
+    if (windowstate->txsegs == NULL ||
+        (windowstate->txmask + 1 < size && sk->state.expectedseqnum == windowstate->sndmax)){
+        if ((txsegs = calloc(size, sizeof(gbn_txseg))) == NULL)
+            return(-1);
+        free(windowstate->txsegs);
+        windowstate->txsegs = txsegs;
+        windowstate->txmask = size - 1;
+    }
 
-    fprintf(stdout, "gbn_socket: socket created\n");
+    return(0);
+}
 
-    return sockfd;
+/* Helper to release the Selective Repeat buffers */
+void free_sack(gbn_sock *sk)
+{
+    state_t *sockstate = &sk->state;
+
+    int i;
+
+    for (i = 0; sockstate->rcvslot != NULL && i < SACK_WINDOW; i++)
+        pool_put(sockstate->rcvslot[i]);
+    free(sockstate->rcvpresent);
+    free(sockstate->rcvslot);
+    sockstate->rcvpresent   = NULL;
+    sockstate->rcvslot      = NULL;
+    sockstate->poolheld     = 0;
 }
 
-/* Set the server socket status to LISTENING. */
-/* For this implementation, backlog is 1.     */
-/* Nonblocking                                */
-int gbn_listen(int sockfd, int backlog)
+/* Helper to allocate the receiver's Selective Repeat packet slots, which */
+/* take their packets from the pool as they arrive (the sender keeps its  */
+/* scoreboard in the descriptors of the packets in flight).               */
+/* Returns 0 on success, -1 if memory is exhausted.                       */
+int init_sack(gbn_sock *sk)
+{
+    state_t *sockstate = &sk->state;
+
+    if (sockstate->rcvpresent == NULL){
+        sockstate->rcvpresent = calloc(SACK_WINDOW, sizeof(uint8_t));
+        sockstate->rcvslot    = calloc(SACK_WINDOW, sizeof(gbnhdr *));
+        if (sockstate->rcvpresent == NULL || sockstate->rcvslot == NULL){
+            free_sack(sk);
+            return(-1);
+        }
+    }
+
+    return(0);
+}
+
+/* Helper to release a batch, returning its buffers to the pool */
+void free_batch(gbn_batch *batch)
+{
+    int i;
+
+    for (i = 0; batch != NULL && i < BATCH; i++)
+        pool_put(batch->bufs[i]);
+    free(batch);
+}
+
+/* Helper to add a socket to the connection table. Safe to call while    */
+/* other threads use their sockets.                                       */
+/* Returns its zeroed state, or NULL if memory is exhausted (or sockfd is */
+/* past the table).                                                       */
+gbn_sock *sock_new(int sockfd)
+{
+    gbn_sock **chunk;
+    gbn_sock *sk;
+
+    if (sockfd < 0 || sockfd / SOCKCHUNK >= SOCKCHUNKS)
+        return NULL;
+
+    pthread_mutex_lock(&socklock);
+
+    /* Add the chunk that covers the descriptor */
+    if ((chunk = socktable[sockfd / SOCKCHUNK]) == NULL){
+        if ((chunk = calloc(SOCKCHUNK, sizeof(*chunk))) == NULL){
+            pthread_mutex_unlock(&socklock);
+            return NULL;
+        }
+        __atomic_store_n(&socktable[sockfd / SOCKCHUNK], chunk, __ATOMIC_RELEASE);
+    }
+
+    if ((sk = chunk[sockfd % SOCKCHUNK]) == NULL && (sk = malloc(sizeof(gbn_sock))) == NULL){
+        pthread_mutex_unlock(&socklock);
+        return NULL;
+    }
+    memset(sk, 0, sizeof(gbn_sock));
+    __atomic_store_n(&chunk[sockfd % SOCKCHUNK], sk, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&socklock);
+    return sk;
+}
+
+/* Helper to find a socket in the connection table without a lock. */
+/* Returns NULL if it is not a gbn socket; errno is left alone.     */
+gbn_sock *sock_find(int sockfd)
 {
-    fprintf(stdout, "\n");
-    fprintf(stdout, "\n");
+    gbn_sock **chunk;
 
-    if (sockstate.status != BOUND){
-        fprintf(stderr, "gbn_listen: server socket can only transition from BOUND to LISTENING\n");
+    if (sockfd < 0 || sockfd / SOCKCHUNK >= SOCKCHUNKS ||
+        (chunk = __atomic_load_n(&socktable[sockfd / SOCKCHUNK], __ATOMIC_ACQUIRE)) == NULL)
+        return NULL;
+
+    return __atomic_load_n(&chunk[sockfd % SOCKCHUNK], __ATOMIC_ACQUIRE);
+}
+
+/* Helper to look up a socket in the connection table.             */
+/* Returns NULL with errno set to EBADF if it is not a gbn socket. */
+gbn_sock *sock_get(int sockfd)
+{
+    gbn_sock *sk;
+
+    if ((sk = sock_find(sockfd)) == NULL){
+        errno = EBADF;
+        return NULL;
+    }
+
+    return sk;
+}
+
+/* Helper to find the simulated path of a socket in direction dir */
+/* (IMPAIR_RX or IMPAIR_TX). Returns NULL if it has none; errno is */
+/* left alone.                                                     */
+gbn_impstate *impaired(int sockfd, int dir)
+{
+    gbn_sock *sk;
+
+    if ((sk = sock_find(sockfd)) == NULL || sk->impair == NULL)
+        return NULL;
+
+    return (sk->impair->conf.dir & dir) ? sk->impair : NULL;
+}
+
+/* Helper to remove a closed socket from the connection table */
+void sock_free(int sockfd)
+{
+    gbn_sock *sk;
+
+    if ((sk = sock_get(sockfd)) == NULL)
+        return;
+
+    stop_threads(sk);
+
+    pthread_mutex_lock(&socklock);
+    __atomic_store_n(&socktable[sockfd / SOCKCHUNK][sockfd % SOCKCHUNK], NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&socklock);
+
+    free_sack(sk);
+    free(sk->pending);
+    free(sk->accepted);
+    free_batch(sk->txbatch);
+    free_batch(sk->rxbatch);
+    free(sk->window.txsegs);
+    free(sk->window.sndbuf);
+    free(sk->state.rcvbuf);
+    impair_free(sk->impair);
+    free(sk);
+}
+
+/* Helper to get one of the socket's batches, allocating it on first use */
+/* with pool buffers for packets of up to mss bytes of payload (none if  */
+/* mss is 0: the transmit batch points into the send buffer).            */
+/* Returns NULL if memory is exhausted.                                  */
+gbn_batch *get_batch(gbn_batch **batch, int mss)
+{
+    int i;
+
+    if (*batch != NULL)
+        return *batch;
+
+    if ((*batch = calloc(1, sizeof(gbn_batch))) == NULL)
+        return NULL;
+    if (mss == 0)
+        return *batch;
+    (*batch)->stride = GBN_HDRLEN + mss;
+    for (i = 0; i < BATCH; i++){
+        if (((*batch)->bufs[i] = pool_get((*batch)->stride)) == NULL){
+            free_batch(*batch);
+            *batch = NULL;
+            break;
+        }
+    }
+
+    return *batch;
+}
+
+/* Helper to add the handshake options to a SYN, SYNACK or ACK */
+void put_opts(gbnhdr *packet, int mss, uint32_t window, uint32_t cookie)
+{
+    uint16_t value = (uint16_t)mss;
+
+    memcpy(packet->data, &value, MSS_BYTES);
+    memcpy(packet->data + MSS_BYTES, &window, RWND_BYTES);
+    memcpy(packet->data + MSS_BYTES + RWND_BYTES, &cookie, COOKIE_BYTES);
+    packet->payloadlen = SYNOPT_BYTES;
+}
+
+/* Helper to read the MSS option of a SYN, SYNACK or ACK.    */
+/* Returns DATALEN if the peer did not send a valid option. */
+int get_mss(const gbnhdr *packet)
+{
+    uint16_t value;
+
+    if (packet->payloadlen < MSS_BYTES)
+        return DATALEN;
+    memcpy(&value, packet->data, MSS_BYTES);
+    if (value < 1 || value > MAXDATALEN)
+        return DATALEN;
+
+    return value;
+}
+
+/* Helper to read the receive window option of a SYN, SYNACK or ACK, */
+/* between 1 and MAXWINDOW packets.                                   */
+/* Returns MAXWINDOW if the peer did not send the option.             */
+uint32_t get_window(const gbnhdr *packet)
+{
+    uint32_t window;
+
+    if (packet->payloadlen < MSS_BYTES + RWND_BYTES)
+        return MAXWINDOW;
+    memcpy(&window, packet->data + MSS_BYTES, RWND_BYTES);
+    if (window < 1)
+        return 1;
+    if (window > MAXWINDOW)
+        return MAXWINDOW;
+
+    return window;
+}
+
+/* Helper to read the cookie of a SYNACK or ACK.   */
+/* Returns 0 if the packet carries none.          */
+uint32_t get_cookie(const gbnhdr *packet)
+{
+    uint32_t cookie;
+
+    if (packet->payloadlen < SYNOPT_BYTES)
+        return 0;
+    memcpy(&cookie, packet->data + MSS_BYTES + RWND_BYTES, COOKIE_BYTES);
+
+    return cookie;
+}
+
+/* Helper to cap the MSS so that a packet to addr fits in the path MTU    */
+/* (IP_MTU of a socket connected to addr) and is never fragmented, with   */
+/* trailer bytes (the CRC32C) after the payload.                          */
+/* Returns the capped MSS, or mss unchanged if the MTU cannot be read.    */
+int path_mss(const struct sockaddr *addr, socklen_t addrlen, int mss, int trailer)
+{
+    int fd;
+    int mtu;
+    int overhead;                 /* IP, UDP and gbn headers                  */
+    int ret;
+    socklen_t optlen = sizeof(mtu);
+
+    if ((fd = socket(addr->sa_family, SOCK_DGRAM, 0)) == -1)
+        return mss;
+
+    if (addr->sa_family == AF_INET6){
+        overhead = 40 + 8 + GBN_HDRLEN + trailer;
+        ret = connect(fd, addr, addrlen) == -1 ? -1 : getsockopt(fd, IPPROTO_IPV6, IPV6_MTU, &mtu, &optlen);
+    } else {
+        overhead = 20 + 8 + GBN_HDRLEN + trailer;
+        ret = connect(fd, addr, addrlen) == -1 ? -1 : getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &optlen);
+    }
+    close(fd);
+
+    if (ret == 0 && mtu - overhead >= 1 && mtu - overhead < mss){
+        LOGINFO("path_mss: path MTU %d, MSS capped to %d\n", mtu, mtu - overhead);
+        mss = mtu - overhead;
+    }
+
+    return mss;
+}
+
+/* Helper to turn path MTU probing on (DF set on every packet, which is */
+/* never fragmented, whatever ICMP reports) or back to the default.     */
+/* Returns 0 on success, or -1 on error.                                */
+int set_pmtu(int sockfd, int on)
+{
+    int domain;
+    int discover;
+    socklen_t optlen = sizeof(domain);
+
+    if (getsockopt(sockfd, SOL_SOCKET, SO_DOMAIN, &domain, &optlen) == -1)
         return(-1);
+
+    if (domain == AF_INET6){
+        discover = on ? IPV6_PMTUDISC_PROBE : IPV6_PMTUDISC_WANT;
+        return setsockopt(sockfd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &discover, sizeof(discover));
     }
 
-    /* Update state */
-    sockstate.status = LISTENING;
+    discover = on ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+    return setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &discover, sizeof(discover));
+}
+
+/* Helper to turn SO_ZEROCOPY on or off.  */
+/* Returns 0 on success, or -1 on error. */
+int set_zerocopy(int sockfd, int on)
+{
+    return setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on));
+}
+
+/* Helper to read the MSG_ZEROCOPY completions from the socket's error   */
+/* queue. Each one reports a range of sends, numbered from 0 in the      */
+/* order they were made, whose pages the kernel has released.            */
+/* Returns the number of messages read from the error queue.             */
+int reap_zerocopy(gbn_sock *sk)
+{
+    char control[128];            /* Ancillary data of one notification       */
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct sock_extended_err *serr;
+    int nread = 0;
+
+    while (1){
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(sk->state.sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1){
+            if (errno == EINTR)
+                continue;
+            return nread;
+        }
+        nread++;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+            if (!(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                continue;
+            serr = (struct sock_extended_err *)(void *)CMSG_DATA(cmsg);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            /* Sends ee_info to ee_data (inclusive) are complete */
+            sk->state.zcdone += serr->ee_data - serr->ee_info + 1;
+        }
+    }
+}
+
+/* Wait until the first upto MSG_ZEROCOPY sends have completed, after  */
+/* which the kernel no longer references the bytes they sent.          */
+/* Returns 0 on success, or -1 on error.                               */
+int wait_zerocopy(gbn_sock *sk, uint32_t upto)
+{
+    struct pollfd pfd;
+
+    /* Completions are signalled through POLLERR */
+    pfd.fd     = sk->state.sockfd;
+    pfd.events = 0;
 
-    fprintf(stdout, "gbn_listen: socket is listening\n");
+    while ((int32_t)(sk->state.zcdone - upto) < 0){
+        if (poll(&pfd, 1, -1) == -1){
+            if (errno == EINTR)
+                continue;
+            return(-1);
+        }
+        reap_zerocopy(sk);
+    }
 
     return(0);
 }
 
-/* Associate and reserve a port for use by the server socket. */
-/* Nonblocking                                                */
-int gbn_bind(int sockfd, const struct sockaddr *server, socklen_t socklen)
+/* Helper to update the RTT estimate with a new sample (Jacobson/Karels, */
+/* RFC 6298) and derive the retransmission timeout from it.              */
+void rtt_sample(window *windowstate, uint64_t rtt)
+{
+    uint64_t delta;
+    uint64_t var;
+
+    if (windowstate->srtt == 0){
+        /* First sample */
+        windowstate->srtt   = rtt;
+        windowstate->rttvar = rtt / 2;
+    } else {
+        delta = (windowstate->srtt > rtt) ? (windowstate->srtt - rtt) : (rtt - windowstate->srtt);
+        windowstate->rttvar = (3 * windowstate->rttvar + delta) / 4;
+        windowstate->srtt   = (7 * windowstate->srtt + rtt) / 8;
+    }
+
+    /* RTO = SRTT + max(G, 4 * RTTVAR), with a 1 ms clock granularity G */
+    var = 4 * windowstate->rttvar;
+    windowstate->rto = windowstate->srtt + ((var > 1000) ? var : 1000);
+    if (windowstate->rto < RTO_MIN)
+        windowstate->rto = RTO_MIN;
+    if (windowstate->rto > RTO_MAX)
+        windowstate->rto = RTO_MAX;
+}
+
+/* Helper to double the retransmission timeout after a timeout. The backed */
+/* off value is kept until a packet that was not retransmitted is ACKed.   */
+void rtt_backoff(window *windowstate)
 {
-    fprintf(stdout, "\n");
-    fprintf(stdout, "\n");
+    windowstate->rto *= 2;
+    if (windowstate->rto > RTO_MAX)
+        windowstate->rto = RTO_MAX;
+}
 
-    int bindstatus;
+/* Helper to publish the current window and RTT values for gbn_getstats, */
+/* which may run in another thread than the one that owns the window.   */
+void publish_window(gbn_sock *sk)
+{
+    window *windowstate = &sk->window;
+
+    STAT_SET(sk, cwnd, cc_window(&windowstate->cc));
+    STAT_SET(sk, ssthresh, (windowstate->cc.ssthresh < MAXWINDOW) ? (uint32_t)windowstate->cc.ssthresh : MAXWINDOW);
+    STAT_SET(sk, rwnd, windowstate->rwnd);
+    STAT_SET(sk, srtt, windowstate->srtt);
+    STAT_SET(sk, rttvar, windowstate->rttvar);
+    STAT_SET(sk, rto, windowstate->rto);
+}
 
-    if ((bindstatus = bind(sockfd, server, socklen)) == -1){
-        fprintf(stderr, "gbn_bind: error binding server socket\n");
-        perror("gbn_bind");
+/* Wait until the socket is readable or the deadline passes (0 waits forever). */
+/* MSG_ZEROCOPY completions that wake the socket up are read on the way.       */
+/* On a simulated path, readable means a held packet is due: datagrams in the  */
+/* kernel join the path and the wait also ends when the next one is released.  */
+/* Returns 0 once readable, or -1 with errno set (ETIMEDOUT on timeout).       */
+int wait_until(int sockfd, uint64_t deadline)
+{
+    gbn_sock *sk;
+    gbn_impstate *im = impaired(sockfd, IMPAIR_RX);
+    struct pollfd pfd;
+    struct timespec ts;
+    uint64_t now;
+    uint64_t wake;                /* Deadline, or an earlier packet release   */
+    uint64_t release;
+    uint64_t remaining;
+    int ready;
+
+    pfd.fd     = sockfd;
+    pfd.events = POLLIN;
+
+    while (1){
+        wake = deadline;
+        if (deadline != 0 && now_us() >= deadline){
+            errno = ETIMEDOUT;
+            return(-1);
+        }
+
+        /* A socket error is left for the read to report */
+        if (im != NULL){
+            if (impair_pull(im, sockfd) == -1 || ((release = impair_next(im)) != 0 && release <= now_us()))
+                return(0);
+            if (release != 0 && (wake == 0 || release < wake))
+                wake = release;
+        }
+
+        if (wake != 0){
+            now        = now_us();
+            remaining  = (wake > now) ? wake - now : 0;
+            ts.tv_sec  = remaining / 1000000;
+            ts.tv_nsec = (remaining % 1000000) * 1000;
+        }
+
+        if ((ready = ppoll(&pfd, 1, (wake != 0) ? &ts : NULL, NULL)) == -1){
+            if (errno == EINTR)
+                continue;
+            return(-1);
+        }
+
+        /* Anything else on the error queue is reported by the next read */
+        if (ready > 0 && !(pfd.revents & POLLIN) && (pfd.revents & POLLERR) &&
+            (sk = sock_get(sockfd)) != NULL && sk->state.zerocopy && reap_zerocopy(sk) > 0)
+            continue;
+
+        if (ready > 0 && im == NULL)
+            return(0);
+    }
+}
+
+/* Wait for a packet until the deadline (0 waits forever).                     */
+/* Returns the result of maybe_recvfrom, or -1 with errno set to ETIMEDOUT.    */
+ssize_t recv_until(int sockfd, char *buf, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen, uint64_t deadline)
+{
+    if (wait_until(sockfd, deadline) == -1)
+        return(-1);
+
+    return maybe_recvfrom(sockfd, buf, len, flags, from, fromlen);
+}
+
+/*-----------------------------------------------------------------------*/
+
+/* Create the socket interface with the given domain, type, and protocol. */
+/* Nonblocking                                                            */
+int gbn_socket(int domain, int type, int protocol)
+{
+
+    int sockfd;
+    gbn_sock *sk;
+    state_t *sockstate;
+    window *windowstate;
+    static int seeded = 0;
+
+    /*----- Randomizing the seed once. This is used by the rand() function -----*/
+    if (!seeded){
+        srand((unsigned)time(0) ^ (unsigned)getpid());
+        seeded = 1;
+    }
+
+    if ((sockfd = socket(domain, type, protocol)) == -1){
+        LOGERR("gbn_socket: error opening socket\n");
+        LOGERRNO("gbn_socket");
+        return(-1);
+    }
+
+    /* Add the socket to the connection table */
+    if ((sk = sock_new(sockfd)) == NULL){
+        LOGERR("gbn_socket: cannot allocate the socket state\n");
+        close(sockfd);
+        errno = ENOMEM;
         return(-1);
     }
+    sockstate   = &sk->state;
+    windowstate = &sk->window;
 
     /* Update state */
-    sockstate.status = BOUND;
+    sockstate->sockfd = sockfd;
+    sockstate->status = CLOSED;
+    /* Initial packet sequence number (32 bits) */
+    sockstate->seqnum = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+    sockstate->expectedseqnum = sockstate->seqnum;
+    sockstate->sackok = 0;
+    sockstate->crcok  = 0;
+    sockstate->sack   = 0;
+    sockstate->ackevery = ACK_EVERY;
+    sockstate->ackdelay = ACK_DELAY;
+    sockstate->poolquota = SACK_WINDOW;
+    sockstate->mss      = DATALEN;
+    sockstate->pmtu     = 0;
 
-    fprintf(stdout, "gbn_bind: socket is bound\n");
+    /* Update window */
+    windowstate->numtimeouts = 0;
+    windowstate->maxwindow   = WINDOW;
+    windowstate->congestion  = GBN_CC_RENO;
+    cc_init(&windowstate->cc, windowstate->congestion, windowstate->maxwindow);
+    windowstate->window      = cc_window(&windowstate->cc);
+    windowstate->sndsize     = SNDBUF;
+    sockstate->rcvsize       = RCVBUF;
+
+    /* Update timer */
+    windowstate->srtt        = 0;
+    windowstate->rttvar      = 0;
+    windowstate->rto         = RTO_INIT;
+    windowstate->deadline    = 0;
+
+    LOGINFO("gbn_socket: socket created\n");
 
-    return bindstatus;
+    return sockfd;
 }
 
-/* Close the socket. */
-/* Blocking          */
-int gbn_close(int sockfd)
+/* Set a protocol option on the socket (see GBN_* options in gbn.h). */
+/* Nonblocking                                                       */
+int gbn_setsockopt(int sockfd, int optname, const void *optval, socklen_t optlen)
 {
-    fprintf(stdout, "\n");
-    fprintf(stdout, "\n");
+    int value;
+    gbn_sock *sk;
+    gbn_impstate *im = NULL;
+    state_t *sockstate;
+    window *windowstate;
 
-    int closestatus;              /* Status of close socket function          */
-    int bytessent;                /* Number of bytes sent to server           */
-    int bytesrec;                 /* Number of bytes received from server     */
-    char recbuf[sizeof(gbnhdr)];  /* Buffer for received packets              */
+    if ((sk = sock_get(sockfd)) == NULL)
+        return(-1);
+    sockstate   = &sk->state;
+    windowstate = &sk->window;
+
+    /* The only option that is not an int: replaces the simulated path, */
+    /* dropping the packets it still holds                              */
+    if (optname == GBN_IMPAIR){
+        if (optval != NULL && optlen != sizeof(gbn_impair)){
+            LOGERR("gbn_setsockopt: option value must be a gbn_impair\n");
+            errno = EINVAL;
+            return(-1);
+        }
+        if (sk->threads != NULL){
+            LOGERR("gbn_setsockopt: the sender threads use the simulated path\n");
+            errno = EBUSY;
+            return(-1);
+        }
+        if (optval != NULL && (im = impair_new((const gbn_impair *)optval)) == NULL){
+            LOGERR("gbn_setsockopt: invalid impairments\n");
+            return(-1);
+        }
+        impair_free(sk->impair);
+        sk->impair = (optval != NULL) ? im : NULL;
 
-    gbnhdr FINpacket;             /* FIN packet                               */
-    gbnhdr *FINACKpacket;         /* Used to cast buffer received from server */
+        LOGINFO("gbn_setsockopt: impairments %s\n", (optval != NULL) ? "on" : "off");
+        return(0);
+    }
 
-    /* Expected by recvfrom */
-    struct sockaddr from;
-    socklen_t fromlen = sizeof(from);
+    if (optval == NULL || optlen != sizeof(int)){
+        LOGERR("gbn_setsockopt: option value must be an int\n");
+        errno = EINVAL;
+        return(-1);
+    }
+    value = *(const int *)optval;
 
-    switch(sockstate.status){
-        case 0:         /* CLOSED       */
-            fprintf(stderr, "gbn_close: socket is already closed\n");
-            return(0);
-        case 1:         /* BOUND        */
-        case 2:         /* LISTENING    */
-        case 6:         /* FIN_SENT     */
-        case 7:         /* FIN_RCVD     */
-        case 8:         /* BROKEN       */
-            /* For above cases, there is no current connection - cleanly close */
-            if ((closestatus = close(sockfd)) == -1){
-                fprintf(stderr, "gbn_close: error closing socket\n");
-                perror("gbn_close");
+    switch(optname){
+        case GBN_WINDOW:
+            if (value < 1 || value > MAXWINDOW){
+                LOGERR("gbn_setsockopt: window must be between 1 and %d\n", MAXWINDOW);
+                errno = EINVAL;
                 return(-1);
             }
-            /* Update state */
-            sockstate.status = CLOSED;
-            fprintf(stdout, "gbn_close: socket closed\n");
-            return closestatus;
-        case 3:         /* SYN_SENT     */
-        case 4:         /* SYN_RCVD     */
-        case 5:         /* ESTABLISHED  */
-            /* Handle these cases below */
-            break;
-    }
-
-    /* Remaining cases: SYN_SENT, SYN_RCVD, ESTABLISHED */
+            windowstate->maxwindow = value;
+            windowstate->cc.maxwindow = value;
+            windowstate->window = cc_window(&windowstate->cc);
+            set_bufsize(sockfd, value, sockstate->mss);
 
-    fprintf(stdout, "gbn_close: sending FIN\n");
+            LOGINFO("gbn_setsockopt: maximum window set to %d\n", value);
+            return(0);
+        case GBN_CONGESTION:
+            /* Takes effect when the connection is set up */
+            if (value != GBN_CC_RENO && value != GBN_CC_CUBIC){
+                LOGERR("gbn_setsockopt: unknown congestion control algorithm %d\n", value);
+                errno = EINVAL;
+                return(-1);
+            }
+            windowstate->congestion = value;
+            LOGINFO("gbn_setsockopt: congestion control set to %d\n", value);
+            return(0);
+        case GBN_SACK:
+            /* Negotiated when the connection is set up */
+            sockstate->sackok = (value != 0);
+            LOGINFO("gbn_setsockopt: selective repeat %s\n", sockstate->sackok ? "on" : "off");
+            return(0);
+        case GBN_CRC32C:
+            /* Negotiated when the connection is set up */
+            sockstate->crcok = (value != 0);
+            LOGINFO("gbn_setsockopt: CRC32C %s\n", sockstate->crcok ? "on" : "off");
+            return(0);
+        case GBN_SNDBUF:
+            /* Allocated by the first gbn_send */
+            if (value < 1){
+                LOGERR("gbn_setsockopt: send buffer size must be at least 1\n");
+                errno = EINVAL;
+                return(-1);
+            }
+            if (windowstate->sndbuf != NULL){
+                LOGERR("gbn_setsockopt: send buffer already in use\n");
+                errno = EISCONN;
+                return(-1);
+            }
+            for (windowstate->sndsize = 1; windowstate->sndsize < (size_t)value; windowstate->sndsize *= 2)
+                ;
+            LOGINFO("gbn_setsockopt: send buffer set to %lu bytes\n", (unsigned long)windowstate->sndsize);
+            return(0);
+        case GBN_RCVBUF:
+            /* Allocated by the first gbn_recv */
+            if (value < 1){
+                LOGERR("gbn_setsockopt: receive buffer size must be at least 1\n");
+                errno = EINVAL;
+                return(-1);
+            }
+            if (sockstate->rcvbuf != NULL){
+                LOGERR("gbn_setsockopt: receive buffer already in use\n");
+                errno = EISCONN;
+                return(-1);
+            }
+            for (sockstate->rcvsize = 1; sockstate->rcvsize < (size_t)value; sockstate->rcvsize *= 2)
+                ;
+            LOGINFO("gbn_setsockopt: receive buffer set to %lu bytes\n", (unsigned long)sockstate->rcvsize);
+            return(0);
+        case GBN_ACKEVERY:
+            if (value < 1 || value > MAXWINDOW){
+                LOGERR("gbn_setsockopt: packets per ACK must be between 1 and %d\n", MAXWINDOW);
+                errno = EINVAL;
+                return(-1);
+            }
+            sockstate->ackevery = value;
+            LOGINFO("gbn_setsockopt: one ACK every %d packets\n", value);
+            return(0);
+        case GBN_ACKDELAY:
+            /* A delay close to the sender's timeout would cause retransmissions */
+            if (value < 0 || value > RTO_MIN){
+                LOGERR("gbn_setsockopt: ACK delay must be between 0 and %d us\n", RTO_MIN);
+                errno = EINVAL;
+                return(-1);
+            }
+            sockstate->ackdelay = value;
+            LOGINFO("gbn_setsockopt: ACK delay set to %d us\n", value);
+            return(0);
+        case GBN_MSS:
+            /* The smaller of both sides' MSS is used once connected */
+            if (value < 1 || value > MAXDATALEN){
+                LOGERR("gbn_setsockopt: MSS must be between 1 and %d\n", MAXDATALEN);
+                errno = EINVAL;
+                return(-1);
+            }
+            sockstate->mss = value;
+            LOGINFO("gbn_setsockopt: MSS set to %d\n", value);
+            return(0);
+        case GBN_PMTU:
+            if (set_pmtu(sockfd, value) == -1){
+                LOGERR("gbn_setsockopt: cannot set path MTU discovery\n");
+                LOGERRNO("gbn_setsockopt");
+                return(-1);
+            }
+            sockstate->pmtu = (value != 0);
+            LOGINFO("gbn_setsockopt: path MTU probing %s\n", sockstate->pmtu ? "on" : "off");
+            return(0);
+        case GBN_ZEROCOPY:
+            /* Used for DATA packets of at least ZEROCOPY_MIN bytes */
+            if (set_zerocopy(sockfd, value != 0) == -1){
+                LOGERR("gbn_setsockopt: cannot set SO_ZEROCOPY\n");
+                LOGERRNO("gbn_setsockopt");
+                return(-1);
+            }
+            sockstate->zerocopy = (value != 0);
+            LOGINFO("gbn_setsockopt: zero-copy send %s\n", sockstate->zerocopy ? "on" : "off");
+            return(0);
+        case GBN_POOLQUOTA:
+            if (value < 0 || value > SACK_WINDOW){
+                LOGERR("gbn_setsockopt: pool quota must be between 0 and %d packets\n", SACK_WINDOW);
+                errno = EINVAL;
+                return(-1);
+            }
+            sockstate->poolquota = value;
+            LOGINFO("gbn_setsockopt: pool quota set to %d packets\n", value);
+            return(0);
+        case GBN_THREADS:
+            /* Started by the next gbn_send, stopped by gbn_close */
+            if (sk->threads != NULL){
+                LOGERR("gbn_setsockopt: sender threads already running\n");
+                errno = EISCONN;
+                return(-1);
+            }
+            sockstate->threaded = (value != 0);
+            LOGINFO("gbn_setsockopt: sender threads %s\n", sockstate->threaded ? "on" : "off");
+            return(0);
+    }
+
+    LOGERR("gbn_setsockopt: unknown option %d\n", optname);
+    errno = ENOPROTOOPT;
+    return(-1);
+}
+
+/* Get the statistics of a connection: its counters (see gbn_stats) and  */
+/* the current window, RTT and goodput. Can be called while another      */
+/* thread sends or receives on the connection, but not while it closes.  */
+/* Returns 0 on success, or -1 if sockfd is not a gbn socket.            */
+int gbn_getstats(int sockfd, struct gbn_stats *stats)
+{
+    gbn_sock *sk;                 /* Socket in the connection table           */
+
+    if ((sk = sock_get(sockfd)) == NULL)
+        return(-1);
+
+#define STAT_GET(counter) stats->counter = __atomic_load_n(&sk->stats.counter, __ATOMIC_RELAXED)
+    STAT_GET(bytessent);
+    STAT_GET(segssent);
+    STAT_GET(retransmits);
+    STAT_GET(bytesacked);
+    STAT_GET(acksrecv);
+    STAT_GET(dupacks);
+    STAT_GET(timeouts);
+    STAT_GET(fastretransmits);
+    STAT_GET(bytesrecv);
+    STAT_GET(segsrecv);
+    STAT_GET(ackssent);
+    STAT_GET(nobuf);
+    STAT_GET(corrupted);
+    STAT_GET(outoforder);
+    STAT_GET(cwnd);
+    STAT_GET(ssthresh);
+    STAT_GET(rwnd);
+    STAT_GET(srtt);
+    STAT_GET(rttvar);
+    STAT_GET(rto);
+
+    STAT_GET(poolbufs);
+#undef STAT_GET
+
+    stats->mss      = sk->state.mss;
+    stats->elapsed  = (sk->starttime != 0) ? now_us() - sk->starttime : 0;
+    stats->goodput  = (stats->elapsed != 0) ? (stats->bytesacked + stats->bytesrecv) * 1e6 / stats->elapsed : 0;
+
+    return(0);
+}
+
+/* Set the server socket status to LISTENING.                         */
+/* Up to backlog connections (1..MAXBACKLOG) that completed the       */
+/* handshake are queued until gbn_accept takes them; further clients  */
+/* are refused with a RST. SYNs are answered with a SYN cookie and    */
+/* take no room in the queue.                                         */
+/* Nonblocking                                                        */
+int gbn_listen(int sockfd, int backlog)
+{
+
+    gbn_sock *sk;
+    state_t *sockstate;
+
+    if ((sk = sock_get(sockfd)) == NULL)
+        return(-1);
+    sockstate = &sk->state;
+
+    if (sockstate->status != BOUND){
+        LOGERR("gbn_listen: server socket can only transition from BOUND to LISTENING\n");
+        return(-1);
+    }
+
+    /* Clamp the backlog as listen(2) does */
+    if (backlog < 1)
+        backlog = 1;
+    if (backlog > MAXBACKLOG)
+        backlog = MAXBACKLOG;
+
+    if ((sk->pending = malloc(backlog * sizeof(gbn_pending))) == NULL ||
+        (sk->accepted = calloc(ACCEPTED_SETS * ACCEPTED_WAYS, sizeof(gbn_accepted))) == NULL){
+        LOGERR("gbn_listen: cannot allocate the backlog\n");
+        free(sk->pending);
+        sk->pending = NULL;
+        errno = ENOMEM;
+        return(-1);
+    }
+    sk->backlog  = backlog;
+    sk->npending = 0;
+
+    /* Update state */
+    sockstate->status = LISTENING;
+
+    LOGINFO("gbn_listen: socket is listening\n");
+
+    return(0);
+}
+
+/* Associate and reserve a port for use by the server socket. */
+/* Nonblocking                                                */
+int gbn_bind(int sockfd, const struct sockaddr *server, socklen_t socklen)
+{
+
+    int bindstatus;
+    int reuse = 1;
+    gbn_sock *sk;
+
+    if ((sk = sock_get(sockfd)) == NULL)
+        return(-1);
+
+    /* Accepted connections get their own sockets bound to the same port */
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1){
+        LOGERR("gbn_bind: error setting SO_REUSEADDR\n");
+        LOGERRNO("gbn_bind");
+        return(-1);
+    }
+
+    if ((bindstatus = bind(sockfd, server, socklen)) == -1){
+        LOGERR("gbn_bind: error binding server socket\n");
+        LOGERRNO("gbn_bind");
+        return(-1);
+    }
+
+    /* Update state */
+    sk->state.status = BOUND;
+
+    LOGINFO("gbn_bind: socket is bound\n");
+
+    return bindstatus;
+}
+
+/* Close the socket. */
+/* Blocking          */
+int gbn_close(int sockfd)
+{
+
+    int closestatus;              /* Status of close socket function          */
+    int bytessent;                /* Number of bytes sent to server           */
+    int bytesrec;                 /* Number of bytes received from server     */
+    int drained;                  /* Status of sending the queued data        */
+    int err;                      /* errno of the failure ending the close    */
+    char recbuf[sizeof(gbnhdr)];  /* Buffer for received packets              */
+
+    gbnhdr FINpacket;             /* FIN packet                               */
+    gbnhdr *FINACKpacket;         /* Used to cast buffer received from server */
+
+    gbn_sock *sk;                 /* Socket in the connection table           */
+    state_t *sockstate;
+    window *windowstate;
+
+    /* Expected by recvfrom */
+    struct sockaddr_storage from;
+    socklen_t fromlen = sizeof(from);
+
+    if ((sk = sock_get(sockfd)) == NULL)
+        return(-1);
+    sockstate   = &sk->state;
+    windowstate = &sk->window;
+
+    switch(sockstate->status){
+        case 0:         /* CLOSED       */
+        case 1:         /* BOUND        */
+        case 2:         /* LISTENING    */
+        case 6:         /* FIN_SENT     */
+        case 7:         /* FIN_RCVD     */
+        case 8:         /* BROKEN       */
+            /* For above cases, there is no current connection - cleanly close. */
+            /* The table entry goes first: once closed, the descriptor can be  */
+            /* handed out again, to a socket another thread is adding          */
+            sock_free(sockfd);
+            if ((closestatus = close(sockfd)) == -1){
+                LOGERR("gbn_close: error closing socket\n");
+                LOGERRNO("gbn_close");
+                return(-1);
+            }
+            LOGINFO("gbn_close: socket closed\n");
+            return closestatus;
+        case 3:         /* SYN_SENT     */
+        case 4:         /* SYN_RCVD     */
+        case 5:         /* ESTABLISHED  */
+            /* Handle these cases below */
+            break;
+    }
+
+    /* Remaining cases: SYN_SENT, SYN_RCVD, ESTABLISHED */
+
+    /* Send what gbn_send queued before the FIN, then take the socket */
+    /* back from the sender threads                                   */
+    if (sockstate->status == ESTABLISHED){
+        drained = send_drain(sk, sockfd);
+        err     = errno;
+        if (stop_threads(sk) == -1 && drained == 0){
+            drained = -1;
+            err     = errno;
+        }
+        if (drained == -1){
+            LOGERR("gbn_close: cannot send the queued data\n");
+            errno = err;
+            LOGERRNO("gbn_close");
+            goto fail;
+        }
+    }
+
+    LOGINFO("gbn_close: sending FIN\n");
+
+    /* Set final seqnum */
+    sockstate->seqnum = sockstate->expectedseqnum;
+
+    /* Create FIN packet */
+    memset(&FINpacket, 0, sizeof(gbnhdr));
+    create_pkt(&FINpacket, FIN, sockstate->seqnum);
+    if (sockstate->crc)
+        FINpacket.flags |= FLAG_CRC;
+    calc_checksum(&FINpacket);
+
+    LOGDEBUG("gbn_close: FIN seqnum: %u, checksum: %d\n", FINpacket.seqnum, FINpacket.checksum);
+
+    /* The FIN gets its own CONN_BROKEN timeouts */
+    windowstate->numtimeouts = 0;
+    windowstate->deadline = 0;
+
+    while(1){
+
+        /* (Re)send the FIN whenever the timer is off */
+        if (windowstate->deadline == 0){
+
+            /* Send FIN packet */
+            if ((bytessent = maybe_sendto(sockfd, (void *)&FINpacket, GBN_PKTLEN(&FINpacket), 0, (const struct sockaddr *)&sockstate->destaddr, sockstate->destsocklen)) == -1){
+                LOGERR("gbn_close: error sending FIN packet\n");
+                LOGERRNO("gbn_close");
+                goto fail;
+            }
+
+            /* Begin timer */
+            windowstate->deadline = now_us() + windowstate->rto;
+
+            /* Update state */
+            sockstate->status = FIN_SENT;
+
+            LOGDEBUG("gbn_close: waiting for FINACK...\n");
+        }
+
+        /* Block and wait for FINACK */
+        if ((bytesrec = recv_until(sockfd, recbuf, sizeof(gbnhdr), 0, (struct sockaddr *)&from, &fromlen, windowstate->deadline)) == -1){
+
+            /* Handle timeout */
+            if (errno == ETIMEDOUT){
+                LOGDEBUG("gbn_close: timeout waiting for FINACK\n");
+                /* Timed-out CONN_BROKEN times */
+                if (++windowstate->numtimeouts == CONN_BROKEN){
+                    sockstate->status = BROKEN;
+                    LOGERR("gbn_close: timed out %d times - connection is broken\n", CONN_BROKEN);
+                    errno = ETIMEDOUT;
+                    goto fail;
+                }
+                rtt_backoff(windowstate);
+                windowstate->deadline = 0;
+                continue;
+            }
+
+            LOGERR("gbn_close: error receiving FINACK packet\n");
+            LOGERRNO("gbn_close");
+            goto fail;
+        }
+
+        /* Cast FINACK packet */
+        FINACKpacket = (gbnhdr*) recbuf;
+
+        /* Validate length and checksum */
+        if (check_pkt(FINACKpacket, bytesrec) == -1){
+            LOGDEBUG("gbn_close: received corrupted packet - length: %d\n", bytesrec);
+            continue;
+        }
+
+        /* Validate type and seqnum */
+        if (FINACKpacket->type != FINACK || sockstate->seqnum != FINACKpacket->seqnum) {
+            LOGDEBUG("gbn_close: received out of order packet - got: %u, expected: %u\n", FINACKpacket->seqnum, sockstate->seqnum);
+            continue;
+        }
+
+        TRACE(TRACE_CTRL_RX, sockfd, FINACKpacket->seqnum, FINACKpacket->type);
+        LOGDEBUG("gbn_close: received FINACK seqnum: %u\n", FINACKpacket->seqnum);
+
+        break;
+    }
+
+    /* Turn off the timer */
+    windowstate->numtimeouts = 0;
+    windowstate->deadline = 0;
+
+    /* Update state, then close socket */
+    sock_free(sockfd);
+    if ((closestatus = close(sockfd)) == -1){
+        LOGERR("gbn_close: error closing socket\n");
+        LOGERRNO("gbn_close");
+        return(-1);
+    }
+
+    return closestatus;
+
+fail:
+    /* Like close(2), release the descriptor even though it fails */
+    err = errno;
+    sock_free(sockfd);
+    close(sockfd);
+    errno = err;
+    return(-1);
+}
+
+/* Helper to send the DATA packets of the transmit batch, with as few  */
+/* sendmmsg calls as the kernel allows. Each packet is gathered from   */
+/* its cached header and its slice of the send buffer; with            */
+/* GBN_ZEROCOPY and a large enough MSS, the kernel sends the slice     */
+/* without copying it (MSG_ZEROCOPY).                                  */
+/* Returns 0 on success, or -1 on error.                               */
+int flush_data(gbn_sock *sk, int sockfd, int flags)
+{
+    state_t *sockstate = &sk->state;
+    gbn_batch *tx = sk->txbatch;
+    int sent;                     /* Number of packets sent so far            */
+    int zcflags;                  /* MSG_ZEROCOPY, or 0 to copy               */
+    int retval;
+    int i;
+
+    for (i = 0; i < tx->count; i++){
+        memset(&tx->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        tx->msgs[i].msg_hdr.msg_name    = &sockstate->destaddr;
+        tx->msgs[i].msg_hdr.msg_namelen = sockstate->destsocklen;
+        tx->msgs[i].msg_hdr.msg_iov     = &tx->iov[3 * i];
+        tx->msgs[i].msg_hdr.msg_iovlen  = sockstate->crc ? 3 : 2;
+    }
+
+    /* Impaired sends may never reach the kernel, whose completions would */
+    /* then never balance zcsent: copy them. So do the sender threads,    */
+    /* which would otherwise race the application for the error queue.    */
+    zcflags = (sockstate->zerocopy && sockstate->mss >= ZEROCOPY_MIN && impaired(sockfd, IMPAIR_TX) == NULL &&
+               sk->threads == NULL) ? MSG_ZEROCOPY : 0;
+
+    for (sent = 0; sent < tx->count; sent += retval){
+        if ((retval = maybe_sendmmsg(sockfd, tx->msgs + sent, tx->count - sent, flags | zcflags)) == -1){
+            if (errno == EINTR){
+                retval = 0;
+                continue;
+            }
+            /* Too many zerocopy sends outstanding, or a payload that spans */
+            /* more pages than one datagram can pin: copy the rest          */
+            if ((errno == ENOBUFS || errno == EMSGSIZE) && zcflags != 0){
+                reap_zerocopy(sk);
+                zcflags = 0;
+                retval  = 0;
+                continue;
+            }
+            tx->count = 0;
+            LOGERR("gbn_send: error sending DATA packets\n");
+            LOGERRNO("gbn_send");
+            return(-1);
+        }
+        if (zcflags != 0)
+            sockstate->zcsent += retval;
+    }
+
+    tx->count = 0;
+    return(0);
+}
+
+/* Helper to add the DATA packet with the given seqnum to the transmit    */
+/* batch, which is sent once BATCH packets have been queued. A packet is  */
+/* cut from the send buffer the first time it is sent (seqnum is sndmax): */
+/* up to mss bytes of queued data, stopping at the end of the ring. Its   */
+/* header, checksum included, and its offset are kept, so a resent packet */
+/* carries the same bytes. The payload is never copied: the batch points  */
+/* into the send buffer.                                                  */
+/* Returns 0 on success, or -1 on error.                                  */
+int send_data(gbn_sock *sk, int sockfd, uint32_t seqnum, int flags)
+{
+    window *windowstate = &sk->window;
+    gbn_batch *tx = sk->txbatch;
+    gbn_txseg *seg;               /* Descriptor of the packet                 */
+    gbnhdr *DATApacket;           /* DATA packet header                       */
+    const uint8_t *payload;       /* Payload of the packet in the send buffer */
+    size_t mask = windowstate->sndsize - 1;
+    size_t payloadlen;            /* Length of a new packet's payload         */
+    uint32_t crc;                 /* CRC32C of the packet                     */
+
+    seg        = &windowstate->txsegs[seqnum & windowstate->txmask];
+    DATApacket = (gbnhdr *)(void *)seg->hdr;
+
+    /* Fill in the descriptor, unless this is a retransmission */
+    if (seqnum == windowstate->sndmax){
+        payloadlen = windowstate->sndtail - windowstate->sndnew;
+        if (payloadlen > (size_t)sk->state.mss)
+            payloadlen = sk->state.mss;
+        if (payloadlen > windowstate->sndsize - (windowstate->sndnew & mask))
+            payloadlen = windowstate->sndsize - (windowstate->sndnew & mask);
+
+        seg->seqnum  = seqnum;
+        seg->length  = payloadlen;
+        seg->offset  = windowstate->sndnew;
+        seg->rexmits = 0;
+        seg->state   = SB_NONE;
+        windowstate->sndnew += payloadlen;
+        windowstate->sndmax++;
+        payload = windowstate->sndbuf + (seg->offset & mask);
+
+        create_pkt(DATApacket, DATA, seqnum);
+        DATApacket->payloadlen = payloadlen;
+        if (sk->state.crc) {
+            DATApacket->flags |= FLAG_CRC;
+            crc = crc32c(crc32c(0, seg->hdr, GBN_HDRLEN), payload, payloadlen);
+            memcpy(seg->crc, &crc, CRC_BYTES);
+        } else {
+            DATApacket->checksum = checksum_fold(checksum_add(checksum_add(0, seg->hdr, GBN_HDRLEN), payload, payloadlen));
+        }
+    } else {
+        seg->rexmits++;
+        STAT_ADD(sk, retransmits, 1);
+    }
+    seg->sent = now_us();
+    payload   = windowstate->sndbuf + (seg->offset & mask);
+    STAT_ADD(sk, segssent, 1);
+    STAT_ADD(sk, bytessent, seg->length);
+
+    tx->iov[3 * tx->count].iov_base     = seg->hdr;
+    tx->iov[3 * tx->count].iov_len      = GBN_HDRLEN;
+    tx->iov[3 * tx->count + 1].iov_base = (void *)payload;
+    tx->iov[3 * tx->count + 1].iov_len  = seg->length;
+    tx->iov[3 * tx->count + 2].iov_base = seg->crc;
+    tx->iov[3 * tx->count + 2].iov_len  = CRC_BYTES;
+    tx->count++;
+
+    TRACE(TRACE_DATA_TX, sockfd, seqnum, DATApacket->payloadlen);
+    LOGDEBUG("gbn_send: DATA seqnum: %u, payloadlen: %d\n", seqnum, DATApacket->payloadlen);
+
+    /* Send DATA packets once the batch is full */
+    if (tx->count == BATCH)
+        return flush_data(sk, sockfd, flags);
+
+    return(0);
+}
+
+/* Helper to apply the SACK bitmap of a DATAACK to the scoreboard */
+void read_sack(gbn_sock *sk, gbnhdr *ACKpacket)
+{
+    state_t *sockstate = &sk->state;
+    window *windowstate = &sk->window;
+
+    const uint8_t *bitmap = ACKpacket->data; /* SACK bitmap, past the window */
+    int bitmaplen = ACKpacket->payloadlen;
+    uint32_t seqnum;
+    int i;
+
+    if ((ACKpacket->flags & FLAG_RWND) && bitmaplen >= (int)RWND_BYTES){
+        bitmap    += RWND_BYTES;
+        bitmaplen -= RWND_BYTES;
+    }
+
+    for (i = 0; i < bitmaplen * 8; i++){
+        if (!(bitmap[i / 8] & (1 << (i % 8))))
+            continue;
+
+        seqnum = ACKpacket->seqnum + 2 + i;
+        if (SEQ_LT(seqnum, sockstate->expectedseqnum) || SEQ_GEQ(seqnum, windowstate->sndmax))
+            continue;
+
+        windowstate->txsegs[seqnum & windowstate->txmask].state = SB_SACKED;
+        if (SEQ_GT(seqnum, windowstate->holeend))
+            windowstate->holeend = seqnum;
+    }
+}
+
+/* Helper to take the receive window of a DATAACK, if it carries one.      */
+/* Returns 1 if the window grew, 0 otherwise.                             */
+int read_rwnd(gbn_sock *sk, gbnhdr *ACKpacket)
+{
+    window *windowstate = &sk->window;
+    uint32_t rwnd;
+
+    if (!(ACKpacket->flags & FLAG_RWND) || ACKpacket->payloadlen < RWND_BYTES)
+        return(0);
+
+    memcpy(&rwnd, ACKpacket->data, RWND_BYTES);
+    if (rwnd <= windowstate->rwnd){
+        windowstate->rwnd = rwnd;
+        return(0);
+    }
+    windowstate->rwnd = rwnd;
+    return(1);
+}
+
+/* Helper to send every packet the window allows: data queued by gbn_send */
+/* is cut into MSS-sized packets, and up to windowstate->window packets    */
+/* are kept in flight, never more than the receiver has room for (its     */
+/* receive window; one packet still goes out when it is 0, to probe for a */
+/* window update). The window is driven by the congestion control module  */
+/* (gbn_cc.c). In Selective Repeat mode, the packets taken as lost that   */
+/* the receiver has not SACKed are resent first.                          */
+/* Returns 0 on success, or -1 on error.                                  */
+int send_window(gbn_sock *sk, int sockfd, int flags)
+{
+    uint32_t seqnum;              /* Seqnum of a packet being resent          */
+    gbn_txseg *txsegs;            /* Descriptor ring                          */
+    uint32_t mask;                /* Index mask of the ring                   */
+
+    state_t *sockstate = &sk->state;
+    window *windowstate = &sk->window;
+
+    windowstate->window = cc_window(&windowstate->cc);
+
+    /* The receiver cannot buffer more than SACK_WINDOW packets out of order */
+    if (sockstate->sack && windowstate->window > SACK_WINDOW)
+        windowstate->window = SACK_WINDOW;
+
+    /* Packets in flight never share a descriptor */
+    if ((uint32_t)windowstate->window > windowstate->txmask + 1)
+        windowstate->window = windowstate->txmask + 1;
+
+    /* Flow control */
+    if ((uint32_t)windowstate->window > windowstate->rwnd)
+        windowstate->window = (windowstate->rwnd > 0) ? windowstate->rwnd : 1;
+
+    LOGDEBUG("gbd_send: sending packets in window %d\n", windowstate->window);
+
+    /* Selective Repeat: during loss recovery, resend every packet before */
+    /* the highest SACKed one that is neither SACKed nor already resent   */
+    if (sockstate->sack && SEQ_LEQ(sockstate->expectedseqnum, windowstate->recover)) {
+        txsegs = windowstate->txsegs;
+        mask   = windowstate->txmask;
+        for (seqnum = sockstate->expectedseqnum; SEQ_LT(seqnum, windowstate->holeend); seqnum++) {
+            __builtin_prefetch(&txsegs[(seqnum + TXSEG_PREFETCH) & mask]);
+            if (txsegs[seqnum & mask].state != SB_NONE)
+                continue;
+            if (send_data(sk, sockfd, seqnum, flags) == -1)
+                return(-1);
+            txsegs[seqnum & mask].state = SB_REXMIT;
+        }
+    }
+
+    /* Send every packet that fits in the window: resent ones, then new data */
+    while (SEQ_LT(sockstate->seqnum, sockstate->expectedseqnum + (uint32_t)windowstate->window) &&
+           (SEQ_LT(sockstate->seqnum, windowstate->sndmax) || windowstate->sndnew != windowstate->sndtail)) {
+
+        /* Begin timer for the oldest packet in flight */
+        if (windowstate->deadline == 0){
+            windowstate->deadline = now_us() + windowstate->rto;
+        }
+
+        /* Send DATA packet */
+        if (send_data(sk, sockfd, sockstate->seqnum, flags) == -1)
+            return(-1);
+
+        /* Increment sequence number */
+        sockstate->seqnum++;
+    }
+
+    /* Send what is left of the batch */
+    if (flush_data(sk, sockfd, flags) == -1)
+        return(-1);
+
+    return(0);
+}
+
+/* Helper to handle the timeout of the oldest packet in flight: the timer */
+/* backs off and, unless the connection is broken, every unacknowledged   */
+/* packet is resent (only the unSACKed ones in Selective Repeat mode).   */
+/* Returns 1, or -1 once CONN_BROKEN timeouts occurred in a row.          */
+int send_timeout(gbn_sock *sk, int sockfd)
+{
+    uint32_t seqnum;              /* Seqnum of a packet in flight             */
+    gbn_txseg *txsegs;            /* Descriptor ring                          */
+    uint32_t mask;                /* Index mask of the ring                   */
+
+    state_t *sockstate = &sk->state;
+    window *windowstate = &sk->window;
+
+    TRACE(TRACE_TIMEOUT, sockfd, sockstate->expectedseqnum, windowstate->rto);
+    STAT_ADD(sk, timeouts, 1);
+    LOGDEBUG("gbn_send: timeout waiting for DATAACK\n");
+    /* Timed-out CONN_BROKEN times */
+    if (++windowstate->numtimeouts == CONN_BROKEN){
+        sockstate->status = BROKEN;
+        LOGERR("gbn_send: client has timed out %d times - connection is broken\n", CONN_BROKEN);
+        errno = ETIMEDOUT;
+        return(-1);
+    }
+    /* Update timer */
+    rtt_backoff(windowstate);
+    windowstate->deadline = 0;
+
+    /* Update window */
+    cc_timeout(&windowstate->cc, windowstate->sndmax - sockstate->expectedseqnum);
+    windowstate->dupacks = 0;
+    windowstate->recover = windowstate->sndmax - 1;
+
+    if (sockstate->sack) {
+        /* Resend every unSACKed packet up to the oldest one again */
+        txsegs = windowstate->txsegs;
+        mask   = windowstate->txmask;
+        for (seqnum = sockstate->expectedseqnum; SEQ_LT(seqnum, windowstate->sndmax); seqnum++) {
+            __builtin_prefetch(&txsegs[(seqnum + TXSEG_PREFETCH) & mask]);
+            if (txsegs[seqnum & mask].state == SB_REXMIT)
+                txsegs[seqnum & mask].state = SB_NONE;
+        }
+        if (SEQ_LEQ(windowstate->holeend, sockstate->expectedseqnum))
+            windowstate->holeend = sockstate->expectedseqnum + 1;
+        windowstate->deadline = now_us() + windowstate->rto;
+    } else {
+        /* Go back to the oldest unacknowledged packet */
+        sockstate->seqnum = sockstate->expectedseqnum;
+    }
+
+    publish_window(sk);
+    LOGDEBUG("gbn_send: rto: %lu us, window changed to: %d\n", (unsigned long)windowstate->rto, cc_window(&windowstate->cc));
+    return(1);
+}
+
+/* Helper to process a packet of bytesrec bytes received by the sender.   */
+/* ACKs are cumulative and carry the last in-order seqnum seen by the     */
+/* receiver. After CC_DUPACKS duplicate ACKs (fast retransmit), every     */
+/* unacknowledged packet is resent. The timeout adapts to the measured   */
+/* round-trip time (see rtt_sample). Taking an ACK is O(1) whatever the   */
+/* number of packets it covers: the descriptor of the last one gives the  */
+/* new head of the send buffer and the send time of the RTT sample.      */
+/* Returns 1.                                                             */
+int ack_process(gbn_sock *sk, int sockfd, gbnhdr *DATAACKpacket, ssize_t bytesrec)
+{
+    uint32_t ACKseqnum;           /* Seqnum carried by the received DATAACK   */
+    gbn_txseg *seg;               /* Descriptor of the last packet ACKed      */
+    uint32_t acked;               /* Number of packets newly ACKed            */
+    uint64_t sndhead;             /* Head of the send buffer before the ACK   */
+
+    state_t *sockstate = &sk->state;
+    window *windowstate = &sk->window;
+
+    /* Validate length and checksum */
+    if (check_pkt(DATAACKpacket, bytesrec) == -1){
+        TRACE(TRACE_CORRUPT, sockfd, 0, bytesrec);
+        STAT_ADD(sk, corrupted, 1);
+        LOGDEBUG("gbn_send: received corrupted packet - length: %d\n", (int)bytesrec);
+        return(1);
+    }
+
+    /* Reset number of timeouts */
+    windowstate->numtimeouts = 0;
+
+    ACKseqnum = DATAACKpacket->seqnum;
+
+    /* Duplicate ACK: the receiver got a packet past a hole. After    */
+    /* CC_DUPACKS of them, the hole is taken as lost and everything  */
+    /* from it onward is resent, at most once per window of packets. */
+    if (DATAACKpacket->type == DATAACK && ACKseqnum == sockstate->expectedseqnum - 1) {
+        if (sockstate->sack)
+            read_sack(sk, DATAACKpacket);
+
+        /* A window update is not a sign of loss */
+        if (read_rwnd(sk, DATAACKpacket)) {
+            publish_window(sk);
+            LOGDEBUG("gbn_send: receive window opened to %u\n", windowstate->rwnd);
+            return(1);
+        }
+        windowstate->dupacks++;
+        TRACE(TRACE_DUPACK, sockfd, ACKseqnum, windowstate->dupacks);
+        STAT_ADD(sk, dupacks, 1);
+        LOGDEBUG("gbn_send: duplicate DATAACK %d for seqnum: %u\n", windowstate->dupacks, ACKseqnum);
+        if (windowstate->dupacks == CC_DUPACKS && SEQ_GT(sockstate->expectedseqnum, windowstate->recover)) {
+            cc_loss(&windowstate->cc, windowstate->sndmax - sockstate->expectedseqnum);
+            windowstate->recover = windowstate->sndmax - 1;
+            if (!sockstate->sack)
+                sockstate->seqnum = sockstate->expectedseqnum;
+            TRACE(TRACE_FASTREXMIT, sockfd, sockstate->expectedseqnum, cc_window(&windowstate->cc));
+            STAT_ADD(sk, fastretransmits, 1);
+            publish_window(sk);
+            LOGDEBUG("gbn_send: fast retransmit, window changed to: %d\n", cc_window(&windowstate->cc));
+        }
+        return(1);
+    }
+
+    /* Validate seqnum: the ACK must cover at least one packet in flight */
+    if (DATAACKpacket->type != DATAACK ||
+        SEQ_LT(ACKseqnum, sockstate->expectedseqnum) || SEQ_GEQ(ACKseqnum, windowstate->sndmax)) {
+        TRACE(TRACE_OUTOFORDER, sockfd, ACKseqnum, sockstate->expectedseqnum);
+        STAT_ADD(sk, outoforder, 1);
+        LOGDEBUG("gbn_send: received out of order packet - expected seqnum: %u, DATAACKpacket seqnum: %u\n", sockstate->expectedseqnum, ACKseqnum);
+        return(1);
+    }
+
+    TRACE(TRACE_ACK_RX, sockfd, ACKseqnum, windowstate->rwnd);
+    LOGDEBUG("gbn_send: received DATAACK seqnum: %u\n", ACKseqnum);
+
+    /* Update the RTT estimate once per round trip, outside loss recovery  */
+    /* and never from a retransmitted packet (Karn's algorithm)            */
+    seg = &windowstate->txsegs[ACKseqnum & windowstate->txmask];
+    if (SEQ_GEQ(ACKseqnum, windowstate->rtseqnum) && seg->rexmits == 0 &&
+        SEQ_GT(sockstate->expectedseqnum, windowstate->recover)){
+        rtt_sample(windowstate, now_us() - seg->sent);
+        windowstate->rtseqnum = windowstate->sndmax;
+    }
+
+    /* Receiver sends LAST KNOWN seqnum, so every packet up to it is ACKed */
+    acked = ACKseqnum + 1 - sockstate->expectedseqnum;
+    sockstate->expectedseqnum = ACKseqnum + 1;
+    if (SEQ_LT(sockstate->seqnum, sockstate->expectedseqnum))
+        sockstate->seqnum = sockstate->expectedseqnum;
+    if (SEQ_LT(windowstate->holeend, sockstate->expectedseqnum))
+        windowstate->holeend = sockstate->expectedseqnum;
+    windowstate->dupacks = 0;
+
+    /* The ACKed bytes of the send buffer can be reused, once the */
+    /* zerocopy sends made so far, resends of them included, are  */
+    /* done with them (see gbn_send)                               */
+    sndhead = windowstate->sndhead;
+    windowstate->sndhead = seg->offset + seg->length;
+    sockstate->zcmark = sockstate->zcsent;
+    STAT_ADD(sk, acksrecv, 1);
+    STAT_ADD(sk, bytesacked, windowstate->sndhead - sndhead);
+
+    /* Record the packets buffered past the next hole */
+    if (sockstate->sack)
+        read_sack(sk, DATAACKpacket);
+    read_rwnd(sk, DATAACKpacket);
+
+    /* Update window */
+    cc_ack(&windowstate->cc, acked);
+
+    publish_window(sk);
+    LOGDEBUG("gbn_send: window changed to: %d\n", cc_window(&windowstate->cc));
+
+    /* Restart the timer if packets remain in flight */
+    if (sockstate->expectedseqnum != windowstate->sndmax){
+        windowstate->deadline = now_us() + windowstate->rto;
+    } else {
+        windowstate->deadline = 0;
+    }
+
+    return(1);
+}
+
+/* Helper to move the send window along (see send_window), then process */
+/* one DATAACK or timeout: with wait, this blocks until one happens;      */
+/* otherwise only an ACK that already arrived, or a timer that already    */
+/* expired, is taken.                                                     */
+/* Returns 1 if an ACK or timeout was processed, 0 if there was none (or  */
+/* nothing is in flight), or -1 on error.                                 */
+int send_progress(gbn_sock *sk, int sockfd, int flags, int wait)
+{
+    ssize_t bytesrec;             /* Number of bytes received from client     */
+    char recbuf[sizeof(gbnhdr)];  /* Buffer for received packets              */
+
+    state_t *sockstate = &sk->state;
+    window *windowstate = &sk->window;
+
+    /* Expected by recvfrom */
+    struct sockaddr_storage from;
+    socklen_t fromlen = sizeof(from);
+
+    if (send_window(sk, sockfd, flags) == -1)
+        return(-1);
+
+    /* Nothing in flight, nothing to wait for */
+    if (sockstate->expectedseqnum == windowstate->sndmax)
+        return(0);
+
+    LOGDEBUG("gbn_send: waiting for DATAACK...\n");
+
+    /* Wait for DATAACK until the oldest packet times out, or only take one that is queued */
+    if (!wait && now_us() < windowstate->deadline)
+        bytesrec = maybe_recvfrom(sockfd, recbuf, sizeof(gbnhdr), flags | MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
+    else
+        bytesrec = recv_until(sockfd, recbuf, sizeof(gbnhdr), flags, (struct sockaddr *)&from, &fromlen, windowstate->deadline);
+
+    if (bytesrec == -1){
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return(0);
+
+        /* Handle timeout */
+        if (errno == ETIMEDOUT)
+            return send_timeout(sk, sockfd);
+
+        LOGERR("gbn_send: error receiving DATAACK packet\n");
+        LOGERRNO("gbn_send");
+        return(-1);
+    }
+
+    return ack_process(sk, sockfd, (gbnhdr *)(void *)recbuf, bytesrec);
+}
+
+/*----- Sender threads (see GBN_THREADS and gbn_threads) -----*/
+
+/* Helper to wake a thread that sleeps on the eventfd fd, after work for */
+/* it was published. The fence orders the publication before the look  */
+/* at its sleeping flag, which it raises before its last look for work. */
+void thr_wake(int *sleeping, int fd)
+{
+    uint64_t one = 1;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(sleeping, __ATOMIC_RELAXED) && write(fd, &one, sizeof(one)) == -1)
+        LOGERRNO("thr_wake");
+}
+
+/* Helper to sleep until fd or stopfd is readable, or the deadline (0     */
+/* waits forever). Resets fd, which a later wake makes readable again.    */
+void thr_wait(int fd, int stopfd, uint64_t deadline)
+{
+    struct pollfd pfd[2];
+    struct timespec ts;
+    uint64_t now;
+    uint64_t remaining;
+    uint64_t count;
+
+    pfd[0].fd     = fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd     = stopfd;
+    pfd[1].events = POLLIN;
+
+    if (deadline != 0){
+        now        = now_us();
+        remaining  = (deadline > now) ? deadline - now : 0;
+        ts.tv_sec  = remaining / 1000000;
+        ts.tv_nsec = (remaining % 1000000) * 1000;
+    }
+
+    if (ppoll(pfd, 2, (deadline != 0) ? &ts : NULL, NULL) > 0 && (pfd[0].revents & POLLIN) &&
+        read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        LOGERRNO("thr_wait");
+}
+
+/* Helper to end both sender threads, recording err (0: none) for the */
+/* application, which is woken as well.                               */
+void thr_stop(gbn_threads *thr, int err)
+{
+    uint64_t one = 1;
+
+    if (err != 0)
+        __atomic_store_n(&thr->error, err, __ATOMIC_RELEASE);
+    __atomic_store_n(&thr->stop, 1, __ATOMIC_SEQ_CST);
+    if (write(thr->stopfd, &one, sizeof(one)) == -1)
+        LOGERRNO("thr_stop");
+}
+
+/* Transmit thread: sends what the window allows, takes the ACKs the ACK */
+/* thread read and handles timeouts, sleeping when there is none of it.  */
+/* Exits when told to, or on an error, which it leaves in thr->error.    */
+void *tx_thread(void *arg)
+{
+    gbn_sock *sk = arg;
+    gbn_threads *thr = sk->threads;
+    state_t *sockstate = &sk->state;
+    window *windowstate = &sk->window;
+    gbn_ackrec *rec;
+    uint32_t acktail;             /* ACK slot the ACK thread fills next       */
+    int taken;                    /* ACKs taken this round                    */
+    int inflight;                 /* Whether packets wait for their ACK       */
+
+    while (!__atomic_load_n(&thr->stop, __ATOMIC_ACQUIRE)){
+
+        /* Take the data gbn_send queued since the last round */
+        windowstate->sndtail = __atomic_load_n(&thr->sndtail, __ATOMIC_ACQUIRE);
+        if (send_window(sk, sockstate->sockfd, 0) == -1)
+            break;
+
+        /* Take every ACK read so far, then let gbn_send reuse the ACKed bytes */
+        acktail = __atomic_load_n(&thr->acktail, __ATOMIC_ACQUIRE);
+        for (taken = 0; thr->ackhead != acktail; taken++){
+            rec = &thr->acks[thr->ackhead & (ACKRING - 1)];
+            ack_process(sk, sockstate->sockfd, (gbnhdr *)(void *)rec->pkt, rec->len);
+            __atomic_store_n(&thr->ackhead, thr->ackhead + 1, __ATOMIC_RELEASE);
+        }
+        if (taken > 0){
+            __atomic_store_n(&thr->sndhead, windowstate->sndhead, __ATOMIC_RELEASE);
+            thr_wake(&thr->appsleeping, thr->appwake);
+            continue;
+        }
+
+        /* The oldest packet in flight timed out */
+        inflight = (sockstate->expectedseqnum != windowstate->sndmax);
+        if (inflight && windowstate->deadline != 0 && now_us() >= windowstate->deadline){
+            if (send_timeout(sk, sockstate->sockfd) == -1)
+                break;
+            continue;
+        }
+
+        /* Sleep until an ACK, new data, the timer or the end */
+        __atomic_store_n(&thr->txsleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&thr->acktail, __ATOMIC_SEQ_CST) == thr->ackhead &&
+            __atomic_load_n(&thr->sndtail, __ATOMIC_SEQ_CST) == windowstate->sndtail)
+            thr_wait(thr->txwake, thr->stopfd, inflight ? windowstate->deadline : 0);
+        __atomic_store_n(&thr->txsleeping, 0, __ATOMIC_RELAXED);
+    }
+
+    /* A failure ends both threads and wakes the application */
+    if (!__atomic_load_n(&thr->stop, __ATOMIC_ACQUIRE))
+        thr_stop(thr, (errno != 0) ? errno : EIO);
+
+    return NULL;
+}
+
+/* ACK thread: reads every datagram that reaches the sender into the ACK  */
+/* ring and wakes the transmit thread. A full ring drops the datagram: a  */
+/* later cumulative ACK covers it. Exits when told to, or on a socket     */
+/* error, which it leaves in thr->error.                                  */
+void *ack_thread(void *arg)
+{
+    gbn_sock *sk = arg;
+    gbn_threads *thr = sk->threads;
+    int sockfd = sk->state.sockfd;
+    gbn_ackrec *rec;
+    char buf[sizeof(gbnhdr)];     /* Datagram being read                      */
+    ssize_t len;
+    uint64_t release;             /* When the simulated path releases one     */
+    uint64_t remaining;
+    uint32_t acktail = thr->acktail;
+    struct pollfd pfd[2];
+    struct timespec ts;
+    uint64_t now;
+
+    pfd[0].fd     = sockfd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd     = thr->stopfd;
+    pfd[1].events = POLLIN;
+
+    while (!__atomic_load_n(&thr->stop, __ATOMIC_ACQUIRE)){
+        if ((len = maybe_recvfrom(sockfd, buf, sizeof(buf), MSG_DONTWAIT, NULL, NULL)) >= 0){
+            /* Nothing longer than an ACK is of use to the sender */
+            if (len > (ssize_t)ACKREC_BYTES ||
+                acktail - __atomic_load_n(&thr->ackhead, __ATOMIC_ACQUIRE) == ACKRING)
+                continue;
+            rec = &thr->acks[acktail & (ACKRING - 1)];
+            rec->len = len;
+            memcpy(rec->pkt, buf, len);
+            __atomic_store_n(&thr->acktail, ++acktail, __ATOMIC_RELEASE);
+            thr_wake(&thr->txsleeping, thr->txwake);
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK){
+            LOGERR("gbn_send: error receiving DATAACK packet\n");
+            LOGERRNO("gbn_send");
+            thr_stop(thr, errno);
+            break;
+        }
+
+        /* Wait for a datagram, or for the simulated path to release one */
+        release = (sk->impair != NULL && (sk->impair->conf.dir & IMPAIR_RX)) ? impair_next(sk->impair) : 0;
+        if (release != 0){
+            now        = now_us();
+            remaining  = (release > now) ? release - now : 0;
+            ts.tv_sec  = remaining / 1000000;
+            ts.tv_nsec = (remaining % 1000000) * 1000;
+        }
+        ppoll(pfd, 2, (release != 0) ? &ts : NULL, NULL);
+    }
+
+    return NULL;
+}
+
+/* Helper to start the sender threads of a connection, which take over */
+/* its window from the current state.                                  */
+/* Returns 0 on success, or -1 with errno set.                         */
+int start_threads(gbn_sock *sk)
+{
+    gbn_threads *thr;
+    int err;
+
+    if ((thr = calloc(1, sizeof(gbn_threads))) == NULL)
+        return(-1);
+    thr->sndtail = sk->window.sndtail;
+    thr->sndhead = sk->window.sndhead;
+    thr->txwake  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    thr->appwake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    thr->stopfd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (thr->txwake == -1 || thr->appwake == -1 || thr->stopfd == -1){
+        err = errno;
+        goto fail;
+    }
+
+    sk->threads = thr;
+    if ((err = pthread_create(&thr->tx, NULL, tx_thread, sk)) != 0)
+        goto fail;
+    if ((err = pthread_create(&thr->ack, NULL, ack_thread, sk)) != 0){
+        thr_stop(thr, 0);
+        pthread_join(thr->tx, NULL);
+        goto fail;
+    }
+
+    LOGINFO("gbn_send: sender threads started\n");
+    return(0);
+
+fail:
+    if (thr->txwake != -1)
+        close(thr->txwake);
+    if (thr->appwake != -1)
+        close(thr->appwake);
+    if (thr->stopfd != -1)
+        close(thr->stopfd);
+    free(thr);
+    sk->threads = NULL;
+    errno = err;
+    return(-1);
+}
+
+/* Helper to stop the sender threads, if running, and hand the window    */
+/* back to the calling thread.                                           */
+/* Returns 0, or -1 with errno set to the failure that ended them.       */
+int stop_threads(gbn_sock *sk)
+{
+    gbn_threads *thr = sk->threads;
+    int err;
+
+    if (thr == NULL)
+        return(0);
+
+    thr_stop(thr, 0);
+    pthread_join(thr->tx, NULL);
+    pthread_join(thr->ack, NULL);
+
+    sk->window.sndtail = thr->sndtail;
+    err = thr->error;
+    close(thr->txwake);
+    close(thr->appwake);
+    close(thr->stopfd);
+    free(thr);
+    sk->threads = NULL;
+
+    if (err != 0){
+        sk->state.status = BROKEN;
+        errno = err;
+        return(-1);
+    }
+    return(0);
+}
+
+/* Helper for gbn_send and send_drain to sleep until the transmit thread */
+/* publishes a new sndhead (when want is 0) or sndhead reaches want.     */
+/* Returns 0, or -1 with errno set if the threads failed.                */
+int thr_sleep(gbn_sock *sk, uint64_t head, uint64_t want)
+{
+    gbn_threads *thr = sk->threads;
+    uint64_t now;
+
+    __atomic_store_n(&thr->appsleeping, 1, __ATOMIC_SEQ_CST);
+    now = __atomic_load_n(&thr->sndhead, __ATOMIC_SEQ_CST);
+    if ((want == 0 ? now == head : now != want) && !__atomic_load_n(&thr->stop, __ATOMIC_SEQ_CST))
+        thr_wait(thr->appwake, thr->stopfd, 0);
+    __atomic_store_n(&thr->appsleeping, 0, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&thr->error, __ATOMIC_ACQUIRE) != 0){
+        sk->state.status = BROKEN;
+        errno = thr->error;
+        return(-1);
+    }
+    return(0);
+}
+
+/* Helper to send everything gbn_send has queued and wait for its ACKs.  */
+/* Returns 0 on success, or -1 on error (e.g. the connection is broken). */
+int send_drain(gbn_sock *sk, int sockfd)
+{
+    window *windowstate = &sk->window;
+    gbn_threads *thr = sk->threads;
+    uint64_t tail;
+
+    if (windowstate->sndbuf == NULL)
+        return(0);
+
+    /* The transmit thread owns the window: wait until it has it all ACKed */
+    if (thr != NULL){
+        tail = thr->sndtail;
+        while (__atomic_load_n(&thr->sndhead, __ATOMIC_ACQUIRE) != tail)
+            if (thr_sleep(sk, 0, tail) == -1)
+                return(-1);
+        return(0);
+    }
+
+    while (sk->state.expectedseqnum != windowstate->sndmax || windowstate->sndnew != windowstate->sndtail) {
+        if (send_progress(sk, sockfd, 0, 1) == -1)
+            return(-1);
+    }
+
+    /* The send buffer is released only once the kernel is done with it */
+    return wait_zerocopy(sk, sk->state.zcsent);
+}
+
+/* Send messages between sockets.                                           */
+/* The data is copied into the socket's send buffer (GBN_SNDBUF bytes) and  */
+/* the call returns as soon as all of it is queued, leaving the window to   */
+/* drain it (see send_progress): later calls keep the packets flowing, and  */
+/* gbn_close sends whatever is left before the FIN. Calls can be of any     */
+/* length; while the buffer is full, the call processes ACKs until they     */
+/* free some room.                                                          */
+/* Returns number of bytes queued, or -1 on error.                          */
+/* Blocking while the send buffer is full, unless the socket is             */
+/* non-blocking (O_NONBLOCK) or flags has MSG_DONTWAIT: then it returns     */
+/* what fit, or fails with EAGAIN if nothing did.                           */
+ssize_t gbn_send(int sockfd, const void *buf, size_t len, int flags)
+{
+
+    size_t queued;                /* Number of bytes of buf queued so far     */
+    size_t room;                  /* Free bytes in the send buffer            */
+    size_t offset;                /* Offset of the tail in the send buffer    */
+    size_t first;                 /* Bytes copied before the ring wraps       */
+    int nonblock;                 /* The call must not block                  */
+    int progress;                 /* Result of send_progress                  */
+    uint64_t head;                /* Stream offset of the oldest unACKed byte */
+    uint64_t tail;                /* Stream offset of the next byte queued    */
+
+    gbn_sock *sk;                 /* Socket in the connection table           */
+    gbn_threads *thr;             /* Sender threads, if running               */
+    state_t *sockstate;
+    window *windowstate;
+
+    if ((sk = sock_get(sockfd)) == NULL)
+        return(-1);
+    sockstate   = &sk->state;
+    windowstate = &sk->window;
+
+    if (sockstate->status == BOUND) {
+        LOGERRNO("gbn_send");
+        LOGERR("gbn_send: cannot send packet from BOUND state\n");
+        return(-1);
+    }
+
+    if (sockstate->status == BROKEN) {
+        LOGERRNO("gbn_send");
+        LOGERR("gbn_send: cannot send packet from BROKEN state\n");
+        return(-1);
+    }
+
+    if (sk->threads == NULL) {
+        if (get_batch(&sk->txbatch, 0) == NULL || init_sndbuf(sk) == -1) {
+            LOGERR("gbn_send: cannot allocate the send buffer\n");
+            errno = ENOMEM;
+            return(-1);
+        }
+
+        /* Nothing in flight: the window starts at the oldest unacknowledged packet */
+        if (sockstate->expectedseqnum == windowstate->sndmax)
+            sockstate->seqnum = sockstate->expectedseqnum;
+
+        if (sockstate->threaded && start_threads(sk) == -1) {
+            LOGERR("gbn_send: cannot start the sender threads\n");
+            LOGERRNO("gbn_send");
+            return(-1);
+        }
+    }
+    thr = sk->threads;
+
+    nonblock = (flags & MSG_DONTWAIT) || (fcntl(sockfd, F_GETFL) & O_NONBLOCK);
+
+    /* With the sender threads, only the tail is ours: the head is theirs */
+    tail = (thr != NULL) ? thr->sndtail : windowstate->sndtail;
+
+    for (queued = 0; queued < len; ) {
+
+        /* Copy what fits at the tail of the send buffer, which may wrap */
+        head = (thr != NULL) ? __atomic_load_n(&thr->sndhead, __ATOMIC_ACQUIRE) : windowstate->sndhead;
+        room = windowstate->sndsize - (size_t)(tail - head);
+        if (room > len - queued)
+            room = len - queued;
+
+        /* ACKed bytes may still be in a MSG_ZEROCOPY send queued in the */
+        /* kernel, e.g. a Go-Back-N resend: wait for it before reuse     */
+        if (room > 0 && thr == NULL && (int32_t)(sockstate->zcdone - sockstate->zcmark) < 0) {
+            reap_zerocopy(sk);
+            if ((int32_t)(sockstate->zcdone - sockstate->zcmark) < 0) {
+                if (nonblock)
+                    break;
+                if (wait_zerocopy(sk, sockstate->zcmark) == -1)
+                    return(-1);
+            }
+        }
+
+        if (room > 0) {
+            offset = tail & (windowstate->sndsize - 1);
+            first  = (room < windowstate->sndsize - offset) ? room : windowstate->sndsize - offset;
+            memcpy(windowstate->sndbuf + offset, (const char *)buf + queued, first);
+            memcpy(windowstate->sndbuf, (const char *)buf + queued + first, room - first);
+            tail   += room;
+            queued += room;
+            if (thr != NULL) {
+                __atomic_store_n(&thr->sndtail, tail, __ATOMIC_RELEASE);
+                thr_wake(&thr->txsleeping, thr->txwake);
+            } else
+                windowstate->sndtail = tail;
+            continue;
+        }
+
+        /* The buffer is full: the window must move before more fits */
+        if (thr != NULL) {
+            if (nonblock)
+                break;
+            if (thr_sleep(sk, head, 0) == -1)
+                return(-1);
+            continue;
+        }
+        if ((progress = send_progress(sk, sockfd, flags, !nonblock)) == -1)
+            return(-1);
+        if (progress == 0 && nonblock)
+            break;
+    }
+
+    LOGDEBUG("gbn_send: bytes queued: %lu\n", (unsigned long)queued);
+
+    /* Put the new data on the wire and take the ACKs that already arrived */
+    if (thr != NULL) {
+        if (__atomic_load_n(&thr->error, __ATOMIC_ACQUIRE) != 0 && queued == 0) {
+            sockstate->status = BROKEN;
+            errno = thr->error;
+            return(-1);
+        }
+    } else {
+        while ((progress = send_progress(sk, sockfd, flags, 0)) == 1)
+            ;
+        if (progress == -1)
+            return(-1);
+    }
+
+    if (queued == 0 && len > 0) {
+        errno = EAGAIN;
+        return(-1);
+    }
+
+    return queued;
+}
+
+/* Wait until everything gbn_send has queued is acknowledged, as gbn_close */
+/* does before its FIN, e.g. to read final statistics with gbn_getstats.   */
+/* Returns 0 on success, or -1 on error (e.g. the connection is broken).   */
+/* Blocking, even on a non-blocking socket.                                */
+int gbn_flush(int sockfd)
+{
+    gbn_sock *sk;                 /* Socket in the connection table           */
+
+    if ((sk = sock_get(sockfd)) == NULL)
+        return(-1);
+
+    if (sk->state.status != ESTABLISHED) {
+        LOGERR("gbn_flush: connection is not established\n");
+        errno = ENOTCONN;
+        return(-1);
+    }
+
+    return send_drain(sk, sockfd);
+}
 
-    /* Set final seqnum */
-    sockstate.seqnum = sockstate.expectedseqnum;
+/* Helper to add the SACK bitmap of the packets buffered past the next */
+/* hole, after the receive window                                      */
+void write_sack(state_t *sockstate, gbnhdr *ACKpacket)
+{
+    uint8_t *bitmap = ACKpacket->data + RWND_BYTES;
+    uint32_t seqnum;
+    int i;
+
+    memset(bitmap, 0, SACK_BYTES);
+    for (i = 0; i < SACK_WINDOW; i++){
+        seqnum = sockstate->expectedseqnum + 1 + i;
+        if (SEQ_GEQ(seqnum, sockstate->expectedseqnum + SACK_WINDOW))
+            break;
+        if (sockstate->rcvpresent[seqnum % SACK_WINDOW]){
+            bitmap[i / 8] |= 1 << (i % 8);
+            ACKpacket->payloadlen = RWND_BYTES + i / 8 + 1;
+        }
+    }
+}
 
-    /* Create FIN packet */
-    memset(&FINpacket, 0, sizeof(gbnhdr));
-    create_pkt(&FINpacket, FIN, sockstate.seqnum);
-    calc_checksum(&FINpacket, sizeof(gbnhdr));
+/* Helper to allocate the receive buffer on first use, with room for at */
+/* least one packet so the receive window never stays closed.          */
+/* Returns 0 on success, -1 if memory is exhausted.                     */
+int init_rcvbuf(gbn_sock *sk)
+{
+    state_t *sockstate = &sk->state;
 
-    fprintf(stdout, "gbn_close: packet type: %d\n", FINpacket.type);
-    fprintf(stdout, "gbn_close: packet seqnum: %d\n", FINpacket.seqnum);
-    fprintf(stdout, "gbn_close: packet checksum: %d\n", FINpacket.checksum);
-    fprintf(stdout, "\n");
-    fprintf(stdout, "\n");
+    if (sockstate->rcvbuf != NULL)
+        return(0);
 
-    for(; windowstate.numtimeouts < CONN_BROKEN; ){
+    while (sockstate->rcvsize < (size_t)sockstate->mss)
+        sockstate->rcvsize *= 2;
+    if ((sockstate->rcvbuf = malloc(sockstate->rcvsize)) == NULL)
+        return(-1);
+    sockstate->rcvhead = 0;
+    sockstate->rcvtail = 0;
+    sockstate->rcvwnd  = sockstate->rcvsize / sockstate->mss;
 
-        /* Send FIN packet */
-        if ((bytessent = sendto(sockfd, (void *)&FINpacket, sizeof(gbnhdr), 0, (const struct sockaddr *)sockstate.destaddr, sockstate.destsocklen)) == -1){
-            fprintf(stderr, "gbn_close: error sending FIN packet\n");
-            perror("gbn_close");
-            return(-1);
-        }
+    return(0);
+}
 
-        /* Begin timer */
-        signal(SIGALRM, timeouthandler);   /* Install the handler */
-        alarm(TIMEOUT);                    /* Set the alarm       */
+/* Helper to compute the receive window: the number of full-size packets */
+/* the receive buffer has room for.                                      */
+uint32_t rcv_window(state_t *sockstate)
+{
+    return (sockstate->rcvsize - (size_t)(sockstate->rcvtail - sockstate->rcvhead)) / sockstate->mss;
+}
 
-        /* Update state */
-        sockstate.status = FIN_SENT;
+/* Helper to hand up to len bytes of the receive buffer to the application. */
+/* Returns the number of bytes copied to buf.                               */
+size_t rcv_take(state_t *sockstate, uint8_t *buf, size_t len)
+{
+    size_t mask = sockstate->rcvsize - 1;
+    size_t offset = sockstate->rcvhead & mask;
+    size_t n = sockstate->rcvtail - sockstate->rcvhead;
+    size_t first;
+
+    if (n > len)
+        n = len;
+    first = (n < sockstate->rcvsize - offset) ? n : sockstate->rcvsize - offset;
+    memcpy(buf, sockstate->rcvbuf + offset, first);
+    memcpy(buf + first, sockstate->rcvbuf, n - first);
+    sockstate->rcvhead += n;
+
+    return n;
+}
 
-        fprintf(stdout, "gbn_close: waiting for FINACK...\n");
+/* Helper to add the payload of the next in-order packet to the stream.   */
+/* While the receive buffer is empty, it goes straight to the caller's    */
+/* buffer (buf, len bytes, *got of them filled); whatever does not fit    */
+/* there is kept in the receive buffer.                                   */
+/* Returns 0 on success, or -1 (taking nothing) if there is no room.      */
+int rcv_append(state_t *sockstate, const uint8_t *data, size_t n, uint8_t *buf, size_t len, size_t *got)
+{
+    size_t mask = sockstate->rcvsize - 1;
+    size_t direct = 0;            /* Bytes copied straight to buf             */
+    size_t offset;                /* Offset of the tail in the receive buffer */
+    size_t first;                 /* Bytes copied before the ring wraps       */
+
+    if (sockstate->rcvtail == sockstate->rcvhead)
+        direct = (n < len - *got) ? n : len - *got;
+    if (n - direct > sockstate->rcvsize - (size_t)(sockstate->rcvtail - sockstate->rcvhead))
+        return(-1);
 
-        /* Block and wait for FINACK */
-        if ((bytesrec = maybe_recvfrom(sockfd, recbuf, sizeof(gbnhdr), 0, &from, &fromlen)) == -1){ 
-            fprintf(stderr, "gbn_close: error receiving FINACK packet\n");
-            
-            /* Handle timeout */
-            if (errno == EINTR){
-                
-                /* windowstate.numtimeouts is incremented in the signal handler */
-                fprintf(stdout, "gbn_close: timeout waiting for FINACK\n");
-                /* Timed-out CONN_BROKEN times */
-                if (windowstate.numtimeouts == CONN_BROKEN){
-                    sockstate.status = BROKEN;
-                    fprintf(stderr, "gbn_close: timed out %d times - connection is broken\n", CONN_BROKEN);
-                    return(-1);
-                }
+    memcpy(buf + *got, data, direct);
+    *got += direct;
+    data += direct;
+    n    -= direct;
 
-            }
-        } else {
-            /* Reset number of timeouts */
-            windowstate.numtimeouts = 0;
-            
-            /* Turn off the alarm */
-            alarm(0);
-
-            /* Cast FINACK packet */
-            FINACKpacket = (gbnhdr*) recbuf;
-
-            /* Validate checksum */
-            uint16_t recchecksum = FINACKpacket->checksum;
-            FINACKpacket->checksum = 0;
-            calc_checksum(FINACKpacket, sizeof(gbnhdr));
-            if (FINACKpacket->checksum != recchecksum){
-                fprintf(stderr, "gbn_close: received corrupted packet - got: %d, expected: %d\n", FINACKpacket->checksum, recchecksum);
-                continue;
-            }
+    offset = sockstate->rcvtail & mask;
+    first  = (n < sockstate->rcvsize - offset) ? n : sockstate->rcvsize - offset;
+    memcpy(sockstate->rcvbuf + offset, data, first);
+    memcpy(sockstate->rcvbuf, data + first, n - first);
+    sockstate->rcvtail += n;
 
-            /* Validate seqnum */
-            if (sockstate.seqnum  != FINACKpacket->seqnum) {
-                fprintf(stderr, "gbn_close: received out of order packet - got: %d, expected: %d\n", FINACKpacket->seqnum, sockstate.seqnum);
-                continue;
-            }
+    return(0);
+}
 
-            fprintf(stdout, "gbn_close: client received FINACK\n");
-            fprintf(stdout, "gbn_close: type: %d\n", FINACKpacket->type);
-            fprintf(stdout, "gbn_close: seqnum: %d\n", FINACKpacket->seqnum);
-            fprintf(stdout, "gbn_close: checksum: %d\n", recchecksum);
+/* Helper to send an ACK packet of the given type and seqnum. The packet  */
+/* is kept: a Go-Back-N DATAACK differs from the previous one only in     */
+/* its seqnum and receive window, so its checksum is updated rather than  */
+/* recomputed.                                                            */
+int send_ack(gbn_sock *sk, int sockfd, uint8_t ACKtype, uint32_t ACKseqnum, int flags)
+{
+    state_t *sockstate = &sk->state;
+    gbnhdr *ACKpacket = &sk->ackpkt; /* Last ACK packet sent                */
+    uint32_t rwnd = 0;               /* Receive window advertised          */
 
-            break;
+    if (ACKtype == DATAACK) {
+        rwnd = sockstate->rcvwnd = rcv_window(sockstate);
+        STAT_ADD(sk, ackssent, 1);
+    }
 
+    if (ACKtype == DATAACK && ACKpacket->type == DATAACK && !sockstate->sack && !sockstate->crc) {
+        /* Incremental update (RFC 1624) */
+        ACKpacket->checksum = checksum_update(ACKpacket->checksum, &ACKpacket->seqnum, &ACKseqnum, sizeof(ACKseqnum));
+        ACKpacket->checksum = checksum_update(ACKpacket->checksum, ACKpacket->data, &rwnd, RWND_BYTES);
+        ACKpacket->seqnum   = ACKseqnum;
+        memcpy(ACKpacket->data, &rwnd, RWND_BYTES);
+    } else {
+        /* Create ACK packet */
+        create_pkt(ACKpacket, ACKtype, ACKseqnum);
+        if (ACKtype == DATAACK) {
+            ACKpacket->flags |= FLAG_RWND;
+            memcpy(ACKpacket->data, &rwnd, RWND_BYTES);
+            ACKpacket->payloadlen = RWND_BYTES;
         }
-
+        if (sockstate->sack && ACKtype == DATAACK)
+            write_sack(sockstate, ACKpacket);
+        if (sockstate->crc)
+            ACKpacket->flags |= FLAG_CRC;
+        calc_checksum(ACKpacket);
     }
 
-    /* Close socket */
-    if ((closestatus = close(sockfd)) == -1){
-        fprintf(stderr, "gbn_close: error closing socket\n");
-        perror("gbn_close");
+    TRACE(ACKtype == DATAACK ? TRACE_ACK_TX : TRACE_CTRL_TX, sockfd, ACKseqnum, ACKtype == DATAACK ? rwnd : ACKtype);
+    LOGDEBUG("gbn_recv: sending ACK type: %d, seqnum: %u, window: %u\n", ACKtype, ACKseqnum, rwnd);
+
+    /* Send ACK packet unreliably */
+    if (maybe_sendto(sockfd, (void *)ACKpacket, GBN_PKTLEN(ACKpacket), flags, (const struct sockaddr *)&sockstate->destaddr, sockstate->destsocklen) == -1){
+        LOGERR("gbn_recv: error sending ACK packet to client\n");
+        LOGERRNO("gbn_recv");
         return(-1);
     }
 
-    /* Update state */
-    sockstate.status = CLOSED;
 
-    return closestatus;
+    return(0);
 }
 
-/* Send messages between sockets.                       */
-/* Returns number of bytes transmitted, or -1 on error. */
-/* Blocking                                             */
-ssize_t gbn_send(int sockfd, const void *buf, size_t len, int flags)
+/* Helper to send the cumulative DATAACK, which covers every packet accepted */
+/* so far, and stop the delayed ACK timer.                                   */
+int send_dataack(gbn_sock *sk, int sockfd, int flags)
 {
-    fprintf(stdout, "\n");
-    fprintf(stdout, "\n");
-
-    /* Max number of packets is N */
-    int newwindownum;             /* New window size                          */
-    int numtosend;                /* Number of packets to send within window  */
-    int maxseqnum;                /* Highest ACK sequence number we have seen */
-    int lastpacket;               /* Used for conditional                     */
-    int extrabytes;               /* Number of payload bytes in final packet  */
-    int index;                    /* Index for inner loop                     */
-    int packetsACKed;             /* Number of packets ACK'ed from server     */
-    int totalpacketstosend;       /* Number of packets that need to be sent   */
-    int bytestotal;               /* Total bytes we have sent                 */
-    int bytessent;                /* Number of bytes sent to client           */
-    int bytesrec;                 /* Number of bytes received from client     */
-    char recbuf[sizeof(gbnhdr)];  /* Buffer for received packets              */
+    sk->state.unacked     = 0;
+    sk->state.ackdeadline = 0;
 
-    gbnhdr DATApacket;            /* DATA packet                              */
-    gbnhdr *DATAACKpacket;        /* Used to cast buffer received from server */
-
-    /* Expected by recvfrom */
-    struct sockaddr from;
-    socklen_t fromlen = sizeof(from);
-
-    /* Set packet count */
-    packetsACKed = 0;
-
-    /* Set conditional */
-    lastpacket = 0;
+    return send_ack(sk, sockfd, DATAACK, sk->state.expectedseqnum - 1, flags);
+}
 
-    /* Set total number of packets to send */
-    totalpacketstosend = (int) len / DATALEN;
-    if (len % DATALEN != 0) {
-        totalpacketstosend += 1;
-    }
+/* Receive messages from one socket to another.                          */
+/* Up to BATCH datagrams are read with each recvmmsg call. The payloads  */
+/* of in-order DATA packets go straight to buf while it has room, then   */
+/* to the connection's receive buffer (GBN_RCVBUF bytes), which the next */
+/* calls drain first. Each call returns up to len contiguous bytes: it   */
+/* blocks for the first packet, then only takes what is already queued.  */
+/* ACKs are cumulative, carry the last in-order seqnum and advertise the */
+/* room left in the receive buffer (the receive window): one is sent     */
+/* once ackevery in-order packets are pending (GBN_ACKEVERY), or when    */
+/* the delayed ACK timer (GBN_ACKDELAY) expires, or when a non-blocking  */
+/* read finds nothing left, or when reading reopens a window that was    */
+/* less than half open. Out-of-order packets, packets that do not fit,   */
+/* filled holes and the FIN are ACKed at once. In Selective Repeat mode, */
+/* packets past a hole are buffered, reported in the ACK's SACK bitmap   */
+/* and added to the stream once the hole is filled; otherwise they are   */
+/* dropped.                                                              */
+/* Returns number of bytes recieved, 0 once the FIN arrived, or -1 on    */
+/* error.                                                                */
+/* Blocking, unless the socket is non-blocking (O_NONBLOCK) or flags     */
+/* has MSG_DONTWAIT: then it fails with EAGAIN if nothing is ready.      */
+ssize_t gbn_recv(int sockfd, void *buf, size_t len, int flags)
+{
 
-    /* Set extra bytes for final packet */
-    extrabytes = len % DATALEN;
+    gbnhdr *DATApacket;           /* Packet of the batch                      */
+    gbn_batch *rx;                /* Receive batch                            */
 
-    fprintf(stdout, "gbn_send: totalpacketstosend: %d\n", totalpacketstosend);
+    int numrec;                   /* Number of datagrams in the batch         */
+    int slot;                     /* Selective Repeat slot of a packet        */
+    int gotfin;                   /* A FIN was accepted from the batch        */
+    int outoforder;               /* A packet calls for an immediate ACK      */
+    int naccepted;                /* In-order DATA packets of the batch       */
+    int recvflags;                /* Flags for recvmmsg                       */
+    uint32_t FINseqnum;           /* Seqnum of the FIN                        */
+    uint32_t half;                /* Half of the largest receive window       */
+    size_t got;                   /* Number of bytes handed to the caller     */
+    int i;
 
-    /* Set byte count */
-    bytestotal = 0;
+    gbn_sock *sk;                 /* Socket in the connection table           */
+    state_t *sockstate;
 
-    /* Set for loop window */
-    numtosend = windowstate.window;
+    if ((sk = sock_get(sockfd)) == NULL)
+        return(-1);
+    sockstate = &sk->state;
 
-    maxseqnum = 0;
+    if (sockstate->status != ESTABLISHED && sockstate->status != FIN_RCVD){
+        LOGERR("gbn_recv: socket can only receive in the ESTABLISHED state\n");
+        return(-1);
+    }
 
-    if (sockstate.status == BOUND) {
-        perror("gbn_send");
-        fprintf(stderr, "gbn_send: cannot send packet from BOUND state\n");
+    if ((sockstate->sack && init_sack(sk) == -1) || init_rcvbuf(sk) == -1) {
+        LOGERR("gbn_recv: cannot allocate the receive buffer\n");
+        errno = ENOMEM;
         return(-1);
     }
 
-    if (sockstate.status == BROKEN) {
-        perror("gbn_send");
-        fprintf(stderr, "gbn_send: cannot send packet from BROKEN state\n");
+    if ((rx = get_batch(&sk->rxbatch, sockstate->mss + (sockstate->crc ? CRC_BYTES : 0))) == NULL) {
+        LOGERR("gbn_recv: cannot allocate the receive batch\n");
+        errno = ENOMEM;
         return(-1);
     }
 
-    while(packetsACKed < totalpacketstosend){
-        
-        fprintf(stdout, "gbd_send: sending packet in window %d\n", windowstate.window);
+    got  = 0;
+    half = (sockstate->rcvsize / sockstate->mss + 1) / 2;
 
-        /* Set index */
-        index = 0;
+    while (1) {
 
-        /* Iterate over our transmission window */
-        for (; index < numtosend; index++) {
+        /* Hand over what the receive buffer holds */
+        got += rcv_take(sockstate, (uint8_t *)buf + got, len - got);
 
-            /* Create DATA packet */
-            memset(&DATApacket, 0, sizeof(gbnhdr));
+        /* Tell the sender as soon as a mostly closed window is half open */
+        if (sockstate->status == ESTABLISHED && sockstate->rcvwnd < half && rcv_window(sockstate) >= half) {
+            if (send_dataack(sk, sockfd, flags) == -1)
+                return(-1);
+        }
 
-            create_pkt(&DATApacket, DATA, sockstate.seqnum);
+        if (got == len)
+            return got;
 
-            if ( (packetsACKed + index + (windowstate.window - numtosend)) == totalpacketstosend - 1) {
-                fprintf(stdout, "gbd_send: final packet payload size is: %d\n", extrabytes);
-                DATApacket.payloadlen = extrabytes;  
-                /* We have the final packet */
-                lastpacket = 1;
-            } else {
-                DATApacket.payloadlen = DATALEN;                
-            }
-            
-            /* Add buf to packet */
-            fprintf(stdout, "index: %d\n", index);
-            fprintf(stdout, "packetsACKed: %d\n", packetsACKed);
-            fprintf(stdout, "windowstate.window - numtosend: %d\n", (windowstate.window - numtosend));
-            memcpy(DATApacket.data, buf + ( (index * DATALEN) + (packetsACKed * DATALEN) + ( (windowstate.window - numtosend) * DATALEN) ), DATApacket.payloadlen);
-            
-            /* Calculate the checksum */
-            calc_checksum(&DATApacket, sizeof(gbnhdr));
-
-            fprintf(stdout, "\n" );
-            fprintf(stdout, "\n" );
-            fprintf(stdout, "------------------------------------------\n");
-            fprintf(stdout, "gbd_send: packet type: %d\n", DATApacket.type);
-            fprintf(stdout, "gbd_send: packet seqnum: %d\n", DATApacket.seqnum);
-            fprintf(stdout, "gbd_send: packet checksum: %d\n", DATApacket.checksum);
-            fprintf(stdout, "gbd_send: packet data: %s\n", DATApacket.data);
-            fprintf(stdout, "------------------------------------------\n");
-            fprintf(stdout, "\n" );
-            fprintf(stdout, "\n" );
+        if (sockstate->status == FIN_RCVD) {
+            LOGINFO("gbn_recv: connection closed by the sender\n");
+            return got;
+        }
 
-            /* Begin timer */
-            signal(SIGALRM, timeouthandler);   /* Install the handler */
-            alarm(TIMEOUT);                    /* Set the alarm       */
+        LOGDEBUG("gbn_recv: waiting for packets...\n");
+
+        /* Reuse the batch: its payloads were all copied out or moved */
+        for (i = 0; i < BATCH; i++) {
+            rx->iov[i].iov_base = BATCH_PKT(rx, i);
+            rx->iov[i].iov_len  = rx->stride;
+            memset(&rx->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+            rx->msgs[i].msg_hdr.msg_iov    = &rx->iov[i];
+            rx->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        /* Block until a packet arrives, then take whatever else is queued. */
+        /* With an ACK pending or bytes to return, only take what is queued */
+        recvflags = flags | MSG_WAITFORONE;
+        if (sockstate->ackdeadline != 0 || got > 0)
+            recvflags |= MSG_DONTWAIT;
 
-            /* Send DATA packet */
-            if ((bytessent = sendto(sockfd, (void *)&DATApacket, sizeof(gbnhdr), flags, (const struct sockaddr *)sockstate.destaddr, sockstate.destsocklen)) == -1){
-                fprintf(stderr, "gbn_send: error sending DATA packet\n");
-                perror("gbn_send");
+        if ((numrec = maybe_recvmmsg(sockfd, rx->msgs, BATCH, recvflags)) == -1) {
+            if (errno == EINTR)
+                continue;
+            if (got > 0)
+                return got;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOGERR("gbn_recv: error receiving packet from client\n");
                 return(-1);
             }
 
-            /* Increment sequence number */
-            sockstate.seqnum = ((sockstate.seqnum + 1) % 256);
-
-            if(lastpacket) {
-                fprintf(stdout, "gbn_send: sent final DATA packet\n");
-                break;
+            /* Blocking socket: wait for more packets until the delayed ACK is due */
+            if (!(flags & MSG_DONTWAIT) && !(fcntl(sockfd, F_GETFL) & O_NONBLOCK)) {
+                if (wait_until(sockfd, sockstate->ackdeadline) == -1) {
+                    if (errno != ETIMEDOUT)
+                        return(-1);
+                    if (send_dataack(sk, sockfd, flags) == -1)
+                        return(-1);
+                }
+                continue;
             }
 
+            /* Non-blocking socket with nothing left to read: ACK what is pending */
+            if (sockstate->ackdeadline != 0 && send_dataack(sk, sockfd, flags) == -1)
+                return(-1);
+            errno = EAGAIN;
+            return(-1);
         }
+        rx->count = numrec;
 
-        fprintf(stdout, "gbn_send: waiting for DATAACK...\n");
-
-
-        /* Decrease sliding window range */
-        numtosend = 0;
-
-        /* Block and wait for DATAACK */
-        if ((bytesrec = maybe_recvfrom(sockfd, recbuf, sizeof(gbnhdr), flags, &from, &fromlen)) == -1){
-            fprintf(stderr, "gbn_send: error receiving DATAACK packet\n");
-            
-            /* Handle timeout */
-            if (errno == EINTR){
+        gotfin = 0;
+        outoforder = 0;
+        naccepted = 0;
+        FINseqnum = 0;
 
-                /* windowstate.numtimeouts is incremented in the signal handler */
-                fprintf(stdout, "gbn_send: timeout waiting for DATAACK\n");
-                /* Timed-out CONN_BROKEN times */
-                if (windowstate.numtimeouts == CONN_BROKEN){
-                    sockstate.status = BROKEN;
-                    fprintf(stderr, "gbn_send: client has timed out %d times - connection is broken\n", CONN_BROKEN);
-                    return(-1);
-                }
-                /* Update window */
-                windowstate.window = 1;
-                numtosend = windowstate.window;
+        for (i = 0; i < numrec && !gotfin; i++) {
 
-                /* Update sequence number */
-                sockstate.seqnum = sockstate.expectedseqnum;
+            DATApacket = BATCH_PKT(rx, i);
 
-                fprintf(stdout, "gbn_send: window changed to: %d\n", windowstate.window);
+            /* Validate length and checksum */
+            if (check_pkt(DATApacket, rx->msgs[i].msg_len) == -1){
+                TRACE(TRACE_CORRUPT, sockfd, 0, rx->msgs[i].msg_len);
+                STAT_ADD(sk, corrupted, 1);
+                LOGDEBUG("gbn_recv: received corrupted packet - length: %u\n", rx->msgs[i].msg_len);
                 continue;
             }
-        } else {
-            /* Reset number of timeouts */
-            windowstate.numtimeouts = 0;
-            
-            /* Turn off the alarm */
-            alarm(0);
-
-            /* Cast DATAACK packet */
-            DATAACKpacket = (gbnhdr*) recbuf;
-
-            /* Validate checksum */
-            uint16_t recchecksum = DATAACKpacket->checksum;
-            DATAACKpacket->checksum = 0;
-    
-            /* Calculate the checksum to compare the two */
-            calc_checksum(DATAACKpacket, sizeof(gbnhdr));
-            if (DATAACKpacket->checksum != recchecksum){
-                fprintf(stderr, "gbn_send: received corrupted packet - got: %d, expected: %d\n", DATAACKpacket->checksum, recchecksum);
-                /* Update sequence number */
-                sockstate.seqnum = sockstate.expectedseqnum;
-                windowstate.window = 1;
-                numtosend = windowstate.window;
+
+            TRACE(DATApacket->type == DATA ? TRACE_DATA_RX : TRACE_CTRL_RX, sockfd, DATApacket->seqnum,
+                  DATApacket->type == DATA ? DATApacket->payloadlen : DATApacket->type);
+            LOGDEBUG("gbn_recv: received packet type: %d, seqnum: %u, payloadlen: %d\n", DATApacket->type, DATApacket->seqnum, DATApacket->payloadlen);
+            if (DATApacket->type == DATA)
+                STAT_ADD(sk, segsrecv, 1);
+
+            /* The client resent its ACK because the DATAACK that confirmed */
+            /* the connection (see gbn_accept) was lost: answer it at once */
+            if (DATApacket->type == ACK && DATApacket->seqnum == sockstate->synseqnum) {
+                LOGDEBUG("gbn_recv: received duplicate handshake ACK - resending DATAACK\n");
+                outoforder = 1;
                 continue;
             }
 
             /* Validate seqnum */
-            if (DATAACKpacket->seqnum != sockstate.expectedseqnum) {
-                fprintf(stderr, "gbn_send: received out of order packet - expected seqnum: %d, DATAACKpacket seqnum: %d\n", sockstate.expectedseqnum, DATAACKpacket->seqnum);
-                if (DATAACKpacket->seqnum > maxseqnum) {
-                    int numpacketsdiff = DATAACKpacket->seqnum - maxseqnum;
-                    maxseqnum = DATAACKpacket->seqnum;
-                    packetsACKed += numpacketsdiff;
+            if (DATApacket->seqnum != sockstate->expectedseqnum) {
+                TRACE(TRACE_OUTOFORDER, sockfd, DATApacket->seqnum, sockstate->expectedseqnum);
+                STAT_ADD(sk, outoforder, 1);
+                LOGDEBUG("gbn_recv: received out of order packet - expected seqnum: %u, DATApacket seqnum: %u\n", sockstate->expectedseqnum, DATApacket->seqnum);
+                outoforder = 1;
+
+                /* Selective Repeat: keep a DATA packet past the hole if it fits. */
+                /* Its buffer moves to the slot and the batch takes a fresh one  */
+                /* from the pool, so the packet is never copied                  */
+                slot = DATApacket->seqnum % SACK_WINDOW;
+                if (sockstate->sack && DATApacket->type == DATA &&
+                    SEQ_GT(DATApacket->seqnum, sockstate->expectedseqnum) &&
+                    SEQ_LT(DATApacket->seqnum, sockstate->expectedseqnum + SACK_WINDOW) &&
+                    !sockstate->rcvpresent[slot]) {
+                    if (sockstate->poolheld >= sockstate->poolquota) {
+                        pool_quotadrop();
+                        STAT_ADD(sk, nobuf, 1);
+                    } else if ((rx->bufs[i] = pool_get(rx->stride)) == NULL) {
+                        rx->bufs[i] = (uint8_t *)DATApacket;
+                        STAT_ADD(sk, nobuf, 1);
+                    } else {
+                        sockstate->rcvslot[slot]    = DATApacket;
+                        sockstate->rcvpresent[slot] = 1;
+                        sockstate->poolheld++;
+                    }
                 }
-                /* Update sequence numbers          */
-                /* Receiver sends LAST KNOWN seqnum */
-                sockstate.expectedseqnum = ((DATAACKpacket->seqnum + 1) % 256);
-                fprintf(stderr, "gbn_send: updating seqnum from: %d to: %d\n", sockstate.seqnum, sockstate.expectedseqnum);
-                sockstate.seqnum = sockstate.expectedseqnum;
-                windowstate.window = 1;
-                numtosend = windowstate.window;
                 continue;
             }
 
-            fprintf(stdout, "\n");
-            fprintf(stdout, "\n");
-            fprintf(stdout, "------------------------------------------\n");
-            fprintf(stdout, "gbn_send: client received DATAACK\n");
-            fprintf(stdout, "gbn_send: type: %d\n", DATAACKpacket->type);
-            fprintf(stdout, "gbn_send: seqnum: %d\n", DATAACKpacket->seqnum);
-            fprintf(stdout, "gbn_send: checksum: %d\n", recchecksum);
-            fprintf(stdout, "------------------------------------------\n");
-            fprintf(stdout, "\n");
-            fprintf(stdout, "\n");
-
-            /* Update window */
-            switch(windowstate.window){
-                case(1):
-                case(2):
-                    newwindownum = (windowstate.window * 2);
-                case(4):
+            switch(DATApacket->type){
+                case DATA:
+                    /* Flow control: drop a packet the receive buffer has no room for */
+                    if (rcv_append(sockstate, DATApacket->data, DATApacket->payloadlen, buf, len, &got) == -1) {
+                        TRACE(TRACE_FULL, sockfd, DATApacket->seqnum, rcv_window(sockstate));
+                        STAT_ADD(sk, nobuf, 1);
+                        LOGDEBUG("gbn_recv: receive buffer full - dropping seqnum: %u\n", DATApacket->seqnum);
+                        outoforder = 1;
+                        break;
+                    }
+                    naccepted++;
+                    STAT_ADD(sk, bytesrecv, DATApacket->payloadlen);
+                    sockstate->seqnum         = DATApacket->seqnum;
+                    sockstate->expectedseqnum = sockstate->seqnum + 1;
+
+                    /* Packets buffered right after this one are now in order too */
+                    if (sockstate->sack) {
+                        while (sockstate->rcvpresent[slot = sockstate->expectedseqnum % SACK_WINDOW] &&
+                               rcv_append(sockstate, sockstate->rcvslot[slot]->data,
+                                          sockstate->rcvslot[slot]->payloadlen, buf, len, &got) == 0) {
+                            STAT_ADD(sk, bytesrecv, sockstate->rcvslot[slot]->payloadlen);
+                            pool_put(sockstate->rcvslot[slot]);
+                            sockstate->rcvslot[slot]    = NULL;
+                            sockstate->rcvpresent[slot] = 0;
+                            sockstate->poolheld--;
+                            sockstate->expectedseqnum++;
+                            outoforder = 1;
+                        }
+                    }
+                    break;
+                case FIN:
+                    /* Nothing follows the FIN */
+                    gotfin = 1;
+                    FINseqnum = DATApacket->seqnum;
+                    sockstate->seqnum         = DATApacket->seqnum;
+                    sockstate->expectedseqnum = sockstate->seqnum + 1;
+                    sockstate->status         = FIN_RCVD;
+                    break;
+                default:
+                    /* Anything else is not expected here */
                     break;
             }
-
-            /* Calc how many new packets we can send */
-            if (windowstate.window != newwindownum) {
-                if (newwindownum == 4) {
-                    numtosend = newwindownum - 1;
-                } else {
-                    numtosend = newwindownum;
-                }
-                windowstate.window = newwindownum;
-            } else {
-                numtosend++;
-            }
-
-            fprintf(stdout, "gbn_send: window changed to: %d\n", windowstate.window);
-
-            maxseqnum = DATAACKpacket->seqnum;
-
-            /* Update sequence number */
-            sockstate.expectedseqnum = ((DATAACKpacket->seqnum + 1) % 256);
-
-            /* Update packets ACK'ed */
-            packetsACKed++;
-
-            fprintf(stdout, "gbn_send: packages ACKed: %d\n", packetsACKed);
-
-            /* Update bytes count */
-            bytestotal += bytessent;
-
+        }
+        STAT_SET(sk, poolbufs, BATCH + sockstate->poolheld);
+
+        /* ACK the batch: FINACK echoes the FIN, DATAACK carries the last */
+        /* in-order seqnum and may be delayed                             */
+        if (gotfin) {
+            sockstate->unacked     = 0;
+            sockstate->ackdeadline = 0;
+            if (send_ack(sk, sockfd, FINACK, FINseqnum, flags) == -1)
+                return(-1);
+            continue;
         }
 
+        sockstate->unacked += naccepted;
+        if (outoforder || sockstate->unacked >= sockstate->ackevery || sockstate->ackdelay == 0) {
+            if (send_dataack(sk, sockfd, flags) == -1)
+                return(-1);
+        } else if (sockstate->unacked > 0 && sockstate->ackdeadline == 0) {
+            sockstate->ackdeadline = now_us() + sockstate->ackdelay;
+        }
     }
-
-    return bytestotal;
 }
 
-/* Receive messages from one socket to another.      */
-/* Returns number of bytes recieved, or -1 on error. */
-/* Blocking                                          */
-ssize_t gbn_recv(int sockfd, void *buf, size_t len, int flags)
+/* Connect the client socket to the server socket.                                        */
+/* Three-way handshake: the client sends a SYN with its options (see SYNOPT_BYTES), the    */
+/* server answers with a SYNACK that grants some of them and carries a SYN cookie, and the */
+/* client echoes the cookie in an ACK. The SYN is resent until a SYNACK arrives, then the  */
+/* ACK until the server confirms the connection with a DATAACK once it accepts it, so no   */
+/* DATA packet reaches the listening socket. Either fails after CONN_BROKEN timeouts; a    */
+/* RST means the server refused the connection (ECONNREFUSED).                             */
+/* Blocking.                                                                              */
+int gbn_connect(int sockfd, const struct sockaddr *server, socklen_t socklen)
 {
-    fprintf(stdout, "\n");
-    fprintf(stdout, "\n");
-
-    gbnhdr *DATApacket;           /* Used to cast buffer received from client */
-    gbnhdr ACKpacket;             /* ACK packet                               */
 
-    int bytessent;                /* Number of bytes sent to client           */
-    int bytesrec;                 /* Number of bytes received from client     */
+    int bytessent;                /* Number of bytes sent to server           */
+    int bytesrec;                 /* Number of bytes received from server     */
     char recbuf[sizeof(gbnhdr)];  /* Buffer for received packets              */
 
-    int rectype;                  /* Received packet type                     */
+    int numsent;                  /* Number of times the SYN was sent         */
+    uint64_t sentat;              /* When the SYN was last sent               */
+    uint32_t peerwindow;          /* Receive window of the server             */
+    uint64_t rto;                 /* Timeout the data starts with             */
+
+    gbnhdr SYNpacket;             /* SYN packet                               */
+    gbnhdr ACKpacket;             /* ACK packet                               */
+    gbnhdr *HSpacket;             /* Handshake packet being (re)sent          */
+    gbnhdr *REPLYpacket;          /* Used to cast buffer received from server */
+
+    gbn_sock *sk;                 /* Socket in the connection table           */
+    state_t *sockstate;
+    window *windowstate;
 
     /* Expected by recvfrom */
-    struct sockaddr from;
+    struct sockaddr_storage from;
     socklen_t fromlen = sizeof(from);
 
-    /* Flag denoting error in transmission */
-    int needpacket = 1;
+    LOGINFO("gbn_connect: client sending SYN\n");
 
-    if (sockstate.status == FIN_RCVD) {
-        fprintf(stderr, "gbn_recv: socket can only receive in the ESTABLISHED state\n");
-        return 0;
+    if ((sk = sock_get(sockfd)) == NULL)
+        return(-1);
+    sockstate   = &sk->state;
+    windowstate = &sk->window;
+
+    if (sockstate->status != CLOSED){
+        LOGERR("gbn_connect: client socket can only establish a connection from the CLOSED state\n");
+        return(-1);
     }
 
-    if (sockstate.status != ESTABLISHED){
-        fprintf(stderr, "gbn_recv: socket can only receive in the ESTABLISHED state\n");
+    if (socklen > sizeof(sockstate->destaddr)){
+        errno = EINVAL;
         return(-1);
     }
 
-    fprintf(stdout, "gbn_recv: waiting for packets...\n");
+    /* Save server info */
+    memcpy(&sockstate->destaddr, server, socklen);
+    sockstate->destsocklen = socklen;
+    sockstate->synseqnum = sockstate->seqnum;
 
-    while(needpacket) {
-        
-        /* Block and wait for connection from the client */
-         if ((bytesrec = maybe_recvfrom(sockfd, recbuf, sizeof(gbnhdr), flags, &from, &fromlen)) == -1){ 
-            fprintf(stderr, "gbn_recv: error receiving packet from client\n");
-            return(-1);
-        }
+    /* Offer the largest payload that reaches the server unfragmented */
+    if (sockstate->pmtu)
+        sockstate->mss = path_mss(server, socklen, sockstate->mss, sockstate->crcok ? CRC_BYTES : 0);
 
-        needpacket = 0;
+    /* Create SYN packet */
+    memset(&SYNpacket, 0, sizeof(gbnhdr));
+    create_pkt(&SYNpacket, SYN, sockstate->seqnum);
+    if (sockstate->sackok)
+        SYNpacket.flags |= FLAG_SACK;
+    if (sockstate->crcok)
+        SYNpacket.flags |= FLAG_CRC;
+    put_opts(&SYNpacket, sockstate->mss, rcv_window(sockstate), 0);
+    calc_checksum(&SYNpacket);
 
-        /* Cast DATA packet */
-        DATApacket = (gbnhdr*) recbuf;
+    LOGDEBUG("gbn_connect: SYN seqnum: %u, checksum: %d\n", SYNpacket.seqnum, SYNpacket.checksum);
 
-        /* Validate checksum */
-        uint16_t recchecksum = DATApacket->checksum;
-        DATApacket->checksum = 0;
-        
-        /* Calculate the checksum to compare the two */
-        calc_checksum(DATApacket, sizeof(gbnhdr));
-        if (DATApacket->checksum != recchecksum){
-            fprintf(stderr, "gbn_recv: received corrupted packet - expected sum: %d, recchecksum: %d\n", DATApacket->checksum, recchecksum);
-            needpacket = 1;
-        }
+    /* Timeout up to CONN_BROKEN times on startup */
+    numsent = 0;
+    rto = RTO_INIT;
+    peerwindow = MAXWINDOW;
+    HSpacket = &SYNpacket;
+    windowstate->deadline = 0;
+    sockstate->status = SYN_SENT;
 
-        fprintf(stdout, "\n");
-        fprintf(stdout, "\n");
-        fprintf(stdout, "------------------------------------------\n");
-        fprintf(stdout, "gbn_recv: server received packet\n");
-        fprintf(stdout, "gbn_recv: packet type: %d\n", DATApacket->type);
-        fprintf(stdout, "gbn_recv: packet seqnum: %d\n", DATApacket->seqnum);
-        fprintf(stdout, "gbn_recv: packet checksum: %d\n", recchecksum);
-        fprintf(stdout, "gbn_recv: packet data: %s\n", DATApacket->data);
-        fprintf(stdout, "------------------------------------------\n");
-        fprintf(stdout, "\n");
-        fprintf(stdout, "\n");
+    while(1){
 
-        /* Validate seqnum */
-        if (DATApacket->seqnum != sockstate.expectedseqnum) {
-            fprintf(stderr, "gbn_recv: received out of order packet - expected seqnum: %d, DATApacket seqnum: %d\n", sockstate.expectedseqnum, DATApacket->seqnum);
-            needpacket = 1;
-        }
+        /* (Re)send the SYN, or the ACK once the SYNACK arrived, whenever the timer is off */
+        if (windowstate->deadline == 0){
 
-        uint8_t ACKtype = DATAACK;
-        uint8_t ACKseqnum = DATApacket->seqnum;
+            if ((bytessent = maybe_sendto(sockfd, (void *)HSpacket, GBN_PKTLEN(HSpacket), 0, (const struct sockaddr *)&sockstate->destaddr, sockstate->destsocklen)) == -1){
+                LOGERR("gbn_connect: error sending handshake packet\n");
+                LOGERRNO("gbn_connect");
+                return(-1);
+            }
+            TRACE(TRACE_CTRL_TX, sockfd, HSpacket->seqnum, HSpacket->type);
+            numsent++;
 
-        switch(DATApacket->type){
-            case 2:     /* DATA */
-                /* ACK packet defaults to DATAACK */
-                rectype = 2;
-                break;
-            case 4:     /* FIN  */
-                /* Set ACK packet to FIN_RCVD     */
-                rectype = 4;
-                ACKtype = 7;
-                break;
+            /* Begin timer */
+            sentat = now_us();
+            windowstate->deadline = sentat + windowstate->rto;
+
+            LOGDEBUG("gbn_connect: waiting for %s...\n", HSpacket == &SYNpacket ? "SYNACK" : "DATAACK");
         }
 
-        /* If there were no errors i.e. checksum and seqnum are good          */
-        /* Then we want to increment seqnum, since we have an accepted packet */
-        /* Otherwise, by not incrementing we reject the packet                */
-        if (!needpacket) {
-            /* Only write DATA packets */
-            if (DATApacket->type != 4) {
-                /* If we haven't already seen the file */
-                if (DATApacket->seqnum != sockstate.seqnum) {
-                    /* Save data to file */
-                    memcpy(buf, DATApacket->data, DATApacket->payloadlen);
+        /* Block and wait for the SYNACK, then for the DATAACK */
+        fromlen = sizeof(from);
+        if ((bytesrec = recv_until(sockfd, recbuf, sizeof(gbnhdr), 0, (struct sockaddr *)&from, &fromlen, windowstate->deadline)) == -1){
+
+            /* Handle timeout */
+            if (errno == ETIMEDOUT){
+                LOGDEBUG("gbn_connect: timeout waiting for %s\n", HSpacket == &SYNpacket ? "SYNACK" : "DATAACK");
+                /* Timed-out CONN_BROKEN times */
+                if (++windowstate->numtimeouts == CONN_BROKEN){
+                    sockstate->status = BROKEN;
+                    LOGERR("gbn_connect: client has timed out %d times - connection is broken\n", CONN_BROKEN);
+                    return(-1);
                 }
+                rtt_backoff(windowstate);
+                windowstate->deadline = 0;
+                continue;
             }
-            /* Store seqnum */
-            sockstate.seqnum          = DATApacket->seqnum;
-            sockstate.expectedseqnum  = ((sockstate.seqnum + 1) % 256);
-        } else {
-            /* Not a valid packet, so we set the seqnum to the last good seqnum we have */
-            ACKseqnum = ((sockstate.expectedseqnum - 1) % 256);
-        }
 
-        /* Create ACK packet */
-        memset(&ACKpacket, 0, sizeof(ACKpacket));
-        create_pkt(&ACKpacket, ACKtype, ACKseqnum);
-        calc_checksum(&ACKpacket, sizeof(gbnhdr));
-
-        fprintf(stdout, "\n");
-        fprintf(stdout, "\n");
-        fprintf(stdout, "------------------------------------------\n");
-        fprintf(stdout, "gbn_recv: packet type: %d\n", ACKpacket.type);
-        fprintf(stdout, "gbn_recv: packet seqnum: %d\n", ACKpacket.seqnum);
-        fprintf(stdout, "gbn_recv: packet checksum: %d\n", ACKpacket.checksum);
-        fprintf(stdout, "------------------------------------------\n");
-        fprintf(stdout, "\n");
-        fprintf(stdout, "\n");
-
-        /* Send ACK packet unreliably */
-        if ((bytessent = sendto(sockfd, (void *)&ACKpacket, sizeof(gbnhdr), flags, (const struct sockaddr *)sockstate.destaddr, sockstate.destsocklen)) == -1){
-            fprintf(stderr, "gbn_recv: error sending ACK packet to client\n"); 
-            perror("gbn_recv");
+            LOGERR("gbn_connect: error receiving handshake packet\n");
+            LOGERRNO("gbn_connect");
             return(-1);
         }
 
-        fprintf(stdout, "gbn_recv: server sent ACK\n\n");
+        /* Cast reply packet */
+        REPLYpacket = (gbnhdr*) recbuf;
 
-        if (!needpacket) {
-            switch(rectype){
-                case 2:     /* Received DATA */
-                    return DATApacket->payloadlen;
-                case 4:     /* Received FIN  */
-                    sockstate.status = FIN_RCVD;
-                    return(0);
-            }
+        /* Validate length and checksum */
+        if (check_pkt(REPLYpacket, bytesrec) == -1){
+            LOGDEBUG("gbn_connect: received corrupted packet - length: %d\n", bytesrec);
+            continue;
         }
-    }
 
-    fprintf(stderr, "gbn_recv: error receiving packet from client\n");
-    return(-1);
+        /* Validate seqnum: every reply carries the seqnum of the SYN */
+        if (sockstate->seqnum != REPLYpacket->seqnum) {
+            LOGDEBUG("gbn_connect: received out of order packet - got: %u, expected: %u\n", REPLYpacket->seqnum, sockstate->seqnum);
+            continue;
+        }
 
-}
+        TRACE(TRACE_CTRL_RX, sockfd, REPLYpacket->seqnum, REPLYpacket->type);
 
-/* Connect the client socket to the server socket.                                        */
-/* Client will send a SYN and then wait for a reply. If a SYNACK is not received before   */
-/* the timeout, the client will resend the SYN. Since this is only a two-way handshake,   */
-/* it is possible that the server will send a SYNACK that is not delivered successfully   */
-/* to the client. In this case, the client will timeout 5 times and assume the connection */
-/* is broken.                                                                             */
-/* Blocking.                                                                              */
-int gbn_connect(int sockfd, const struct sockaddr *server, socklen_t socklen)
-{
-    fprintf(stdout, "\n");
-    fprintf(stdout, "\n");
+        /* The server's backlog is full */
+        if (REPLYpacket->type == RST) {
+            LOGERR("gbn_connect: connection refused by server\n");
+            sockstate->status = CLOSED;
+            windowstate->deadline = 0;
+            errno = ECONNREFUSED;
+            return(-1);
+        }
 
-    int bytessent;                /* Number of bytes sent to server           */
-    int bytesrec;                 /* Number of bytes received from server     */
-    char recbuf[sizeof(gbnhdr)];  /* Buffer for received packets              */
+        /* The server accepted the connection */
+        if (REPLYpacket->type == DATAACK && HSpacket == &ACKpacket)
+            break;
 
-    gbnhdr SYNpacket;             /* SYN packet                               */
-    gbnhdr *SYNACKpacket;         /* Used to cast buffer received from server */
+        if (REPLYpacket->type != SYNACK || HSpacket != &SYNpacket) {
+            LOGDEBUG("gbn_connect: received unexpected packet type: %d\n", REPLYpacket->type);
+            continue;
+        }
 
-    /* Expected by recvfrom */
-    struct sockaddr from;
-    socklen_t fromlen = sizeof(from);
+        /* The SYN round trip is the first RTT sample, unless the SYN had   */
+        /* to be resent (Karn's algorithm): the data then starts at RTO_INIT */
+        windowstate->numtimeouts = 0;
+        windowstate->deadline = 0;
+        if (numsent == 1)
+            rtt_sample(windowstate, now_us() - sentat);
+        else
+            windowstate->rto = RTO_INIT;
+        rto = windowstate->rto;
+
+        LOGINFO("gbn_connect: client received SYNACK\n");
+
+        /* Selective Repeat is used only if the server granted it */
+        sockstate->sack = sockstate->sackok && (REPLYpacket->flags & FLAG_SACK);
+        LOGINFO("gbn_connect: selective repeat: %s\n", sockstate->sack ? "on" : "off");
+
+        /* CRC32C likewise */
+        sockstate->crc = sockstate->crcok && (REPLYpacket->flags & FLAG_CRC);
+        LOGINFO("gbn_connect: CRC32C: %s\n", sockstate->crc ? "on" : "off");
+
+        /* Both sides use the smaller MSS, leaving room for the CRC32C trailer */
+        if (get_mss(REPLYpacket) < sockstate->mss)
+            sockstate->mss = get_mss(REPLYpacket);
+        if (sockstate->crc && sockstate->mss > MAXDATALEN - (int)CRC_BYTES)
+            sockstate->mss = MAXDATALEN - CRC_BYTES;
+        LOGINFO("gbn_connect: MSS: %d\n", sockstate->mss);
+        peerwindow = get_window(REPLYpacket);
+
+        /* Echo the cookie with the options of the SYN and the MSS agreed on */
+        memset(&ACKpacket, 0, sizeof(gbnhdr));
+        create_pkt(&ACKpacket, ACK, sockstate->seqnum);
+        ACKpacket.flags = SYNpacket.flags;
+        put_opts(&ACKpacket, sockstate->mss, rcv_window(sockstate), get_cookie(REPLYpacket));
+        calc_checksum(&ACKpacket);
+        HSpacket = &ACKpacket;
+    }
 
-    fprintf(stdout, "gbn_connect: client sending SYN\n");
+    /* Turn off the timer, dropping the backoff of resent ACKs */
+    windowstate->numtimeouts = 0;
+    windowstate->deadline = 0;
+    windowstate->rto = rto;
 
-    if (sockstate.status != CLOSED){
-        fprintf(stderr, "gbn_connect: client socket can only establish a connection from the CLOSED state\n");
-        return(-1);
-    }
+    LOGINFO("gbn_connect: server confirmed the connection\n");
 
-    /* Save server info */
-    sockstate.destaddr = (struct sockaddr *)server;
-    sockstate.destsocklen = socklen;
+    /* Update sequence number */
+    sockstate->seqnum = sockstate->seqnum + 1;
+    sockstate->expectedseqnum = sockstate->seqnum;
 
-    /* Create SYN packet */
-    memset(&SYNpacket, 0, sizeof(gbnhdr));
-    create_pkt(&SYNpacket, SYN, sockstate.seqnum);
-    calc_checksum(&SYNpacket, sizeof(gbnhdr));
+    /* Update state: the DATAACK carries the current receive window */
+    sockstate->status = ESTABLISHED;
+    init_window(sk);
+    windowstate->rwnd = peerwindow;
+    read_rwnd(sk, REPLYpacket);
+    publish_window(sk);
 
-    fprintf(stdout, "gbn_connect: packet type: %d\n", SYNpacket.type);
-    fprintf(stdout, "gbn_connect: packet seqnum: %d\n", SYNpacket.seqnum);
-    fprintf(stdout, "gbn_connect: packet checksum: %d\n", SYNpacket.checksum);
+    return(0);
+}
 
-    /* Timeout up to CONN_BROKEN times on startup */
-    for(; windowstate.numtimeouts < CONN_BROKEN; ){
+/* Helper to compare two socket addresses */
+int same_addr(const struct sockaddr_storage *a, socklen_t alen, const struct sockaddr_storage *b, socklen_t blen)
+{
+    return alen == blen && memcmp(a, b, alen) == 0;
+}
 
-        /* Send SYN packet */
-        if ((bytessent = sendto(sockfd, (void *)&SYNpacket, sizeof(gbnhdr), 0, (const struct sockaddr *)sockstate.destaddr, sockstate.destsocklen)) == -1){
-            fprintf(stderr, "gbn_connect: error sending SYN packet\n");
-            perror("gbn_connect");
-            return(-1);
-        }
+/* Helper to find the set of the accepted-connection hash of a listening */
+/* socket for the client addr with the given seqnum (FNV-1a of both)     */
+gbn_accepted *accepted_set(gbn_sock *sk, uint32_t seqnum, const struct sockaddr_storage *addr, socklen_t addrlen)
+{
+    const uint8_t *p = (const uint8_t *)addr;
+    uint32_t hash = 2166136261u;
+    socklen_t i;
 
-        /* Begin timer */
-        signal(SIGALRM, timeouthandler);   /* Install the handler */
-        alarm(TIMEOUT);                    /* Set the alarm       */
+    for (i = 0; i < addrlen; i++)
+        hash = (hash ^ p[i]) * 16777619u;
+    for (i = 0; i < sizeof(seqnum); i++)
+        hash = (hash ^ ((seqnum >> (8 * i)) & 0xff)) * 16777619u;
 
-        /* Update state */
-        sockstate.status = SYN_SENT;
+    return &sk->accepted[(hash % ACCEPTED_SETS) * ACCEPTED_WAYS];
+}
 
-        fprintf(stdout, "gbn_connect: waiting for SYNACK...\n");
+/* Helper to tell whether the listening socket sk accepted a connection */
+/* for the SYN with the given seqnum from addr within ACCEPTED_TTL.     */
+int accepted_find(gbn_sock *sk, uint32_t seqnum, const struct sockaddr_storage *addr, socklen_t addrlen)
+{
+    gbn_accepted *set = accepted_set(sk, seqnum, addr, addrlen);
+    uint64_t now = now_us();
+    int i;
+
+    for (i = 0; i < ACCEPTED_WAYS; i++){
+        if (set[i].when != 0 && now - set[i].when < ACCEPTED_TTL && set[i].seqnum == seqnum &&
+            same_addr(&set[i].addr, set[i].addrlen, addr, addrlen))
+            return(1);
+    }
+    return(0);
+}
 
-        /* Block and wait for SYNACK */
-        if ((bytesrec = maybe_recvfrom(sockfd, recbuf, sizeof(gbnhdr), 0, &from, &fromlen)) == -1){ 
-            fprintf(stderr, "gbn_connect: error receiving SYNACK packet\n");
-            
-            /* Handle timeout */
-            if (errno == EINTR){
-                /* windowstate.numtimeouts is incremented in the signal handler */
-                fprintf(stdout, "gbn_connect: timeout waiting for SYNACK\n");
-                /* Timed-out CONN_BROKEN times */
-                if (windowstate.numtimeouts == CONN_BROKEN){
-                    sockstate.status = BROKEN;
-                    fprintf(stderr, "gbn_connect: client has timed out %d times - connection is broken\n", CONN_BROKEN);
-                    return(-1);
-                }
-            }
-        } else {
-            /* Reset number of timeouts */
-            windowstate.numtimeouts = 0;
-            /* Turn off the alarm */
-            alarm(0);
-            break;
-        }
+/* Helper to remember a connection the listening socket sk accepted, in */
+/* place of the oldest one of its set                                   */
+void accepted_add(gbn_sock *sk, const gbn_pending *request)
+{
+    gbn_accepted *set = accepted_set(sk, request->seqnum, &request->addr, request->addrlen);
+    gbn_accepted *entry = &set[0];
+    int i;
 
+    for (i = 1; i < ACCEPTED_WAYS; i++){
+        if (set[i].when < entry->when)
+            entry = &set[i];
     }
 
-    /* Cast SYNACK packet */
-    SYNACKpacket = (gbnhdr*) recbuf;
+    memcpy(&entry->addr, &request->addr, request->addrlen);
+    entry->addrlen = request->addrlen;
+    entry->seqnum  = request->seqnum;
+    entry->when    = now_us();
+}
 
-    /* Validate checksum */
-    uint16_t recchecksum = SYNACKpacket->checksum;
-    SYNACKpacket->checksum = 0;
-    calc_checksum(SYNACKpacket, sizeof(gbnhdr));
-    if (SYNACKpacket->checksum != recchecksum){
-        fprintf(stderr, "gbn_connect: received corrupted packet - got: %d, expected: %d\n", SYNACKpacket->checksum, recchecksum);
-        return(-1);
+/* Helper to answer a packet that reached a listening socket. A SYN gets a */
+/* SYNACK with a SYN cookie, and nothing is kept for it (see               */
+/* gbn_cookie.h); once the ACK echoes a valid cookie, the connection is    */
+/* queued for gbn_accept. Resent ACKs of queued or accepted connections    */
+/* are dropped, and clients beyond the backlog are refused with a RST. A   */
+/* FIN from a connection that was already closed here (its FINACK was      */
+/* lost) is answered with a FINACK so the client can finish closing.       */
+void listen_pkt(gbn_sock *sk, int sockfd, gbnhdr *packet, struct sockaddr_storage *from, socklen_t fromlen)
+{
+    gbnhdr REPLYpacket;           /* SYNACK, RST or FINACK packet             */
+    gbn_pending *request;         /* Queued connection                        */
+    state_t *sockstate = &sk->state;
+    int mss;                      /* MSS offered by the server                */
+    int i;
+
+    memset(&REPLYpacket, 0, sizeof(gbnhdr));
+
+    if (packet->type == FIN){
+        /* Not closed yet if it waits to be accepted */
+        for (i = 0; i < sk->npending; i++){
+            if (same_addr(&sk->pending[i].addr, sk->pending[i].addrlen, from, fromlen))
+                return;
+        }
+        create_pkt(&REPLYpacket, FINACK, packet->seqnum);
+        calc_checksum(&REPLYpacket);
+        maybe_sendto(sockfd, (void *)&REPLYpacket, GBN_PKTLEN(&REPLYpacket), 0, (const struct sockaddr *)from, fromlen);
+        return;
     }
 
-    /* Validate seqnum */
-    if (sockstate.seqnum  != SYNACKpacket->seqnum) {
-        fprintf(stderr, "gbn_connect: received out of order packet - got: %d, expected: %d\n", SYNACKpacket->seqnum, sockstate.seqnum);
-        return(-1);
+    if (packet->type != SYN && packet->type != ACK){
+        LOGDEBUG("gbn_accept: ignoring packet of type %d from unknown client\n", packet->type);
+        return;
     }
 
-    fprintf(stdout, "gbn_connect: client received SYNACK\n");
-    fprintf(stdout, "gbn_connect: type: %d\n", SYNACKpacket->type);
-    fprintf(stdout, "gbn_connect: seqnum: %d\n", SYNACKpacket->seqnum);
-    fprintf(stdout, "gbn_connect: checksum: %d\n", recchecksum);
+    if (packet->type == ACK){
+        if (!cookie_check(from, fromlen, packet->seqnum, get_cookie(packet))){
+            LOGDEBUG("gbn_accept: dropping ACK with seqnum %u - invalid SYN cookie\n", packet->seqnum);
+            return;
+        }
+
+        for (i = 0; i < sk->npending; i++){
+            request = &sk->pending[i];
+            if (request->seqnum == packet->seqnum && same_addr(&request->addr, request->addrlen, from, fromlen))
+                return;
+        }
 
-    /* Update sequence number */
-    sockstate.seqnum = ((sockstate.seqnum + 1) % 256);
-    sockstate.expectedseqnum = sockstate.seqnum;
+        if (accepted_find(sk, packet->seqnum, from, fromlen))
+            return;
+    }
 
-    /* Update state */
-    sockstate.status = ESTABLISHED;
+    if (sk->npending == sk->backlog){
+        LOGWARN("gbn_accept: backlog of %d is full - refusing client\n", sk->backlog);
+        create_pkt(&REPLYpacket, RST, packet->seqnum);
+        calc_checksum(&REPLYpacket);
+        maybe_sendto(sockfd, (void *)&REPLYpacket, GBN_PKTLEN(&REPLYpacket), 0, (const struct sockaddr *)from, fromlen);
+        return;
+    }
 
-    return(0);
+    if (packet->type == ACK){
+        request = &sk->pending[sk->npending++];
+        memcpy(&request->addr, from, fromlen);
+        request->addrlen = fromlen;
+        request->seqnum  = packet->seqnum;
+        request->flags   = packet->flags;
+        request->mss     = get_mss(packet);
+        request->window  = get_window(packet);
+
+        LOGDEBUG("gbn_accept: queued connection with seqnum %u (%d pending)\n", packet->seqnum, sk->npending);
+        return;
+    }
+
+    /* Grant what the client asked for and is allowed here, offering the */
+    /* largest payload that reaches it unfragmented if asked             */
+    create_pkt(&REPLYpacket, SYNACK, packet->seqnum);
+    if (sockstate->sackok && (packet->flags & FLAG_SACK))
+        REPLYpacket.flags |= FLAG_SACK;
+    if (sockstate->crcok && (packet->flags & FLAG_CRC))
+        REPLYpacket.flags |= FLAG_CRC;
+    mss = sockstate->mss;
+    if (sockstate->pmtu)
+        mss = path_mss((struct sockaddr *)from, fromlen, mss, (REPLYpacket.flags & FLAG_CRC) ? CRC_BYTES : 0);
+    put_opts(&REPLYpacket, mss, rcv_window(sockstate), cookie_make(from, fromlen, packet->seqnum));
+    calc_checksum(&REPLYpacket);
+
+    LOGDEBUG("gbn_accept: sending SYNACK seqnum: %u\n", REPLYpacket.seqnum);
+    TRACE(TRACE_CTRL_TX, sockfd, REPLYpacket.seqnum, REPLYpacket.type);
+
+    if (maybe_sendto(sockfd, (void *)&REPLYpacket, GBN_PKTLEN(&REPLYpacket), 0, (const struct sockaddr *)from, fromlen) == -1)
+        LOGERRNO("gbn_accept");
 }
 
 /* Accept a connection from the client to the server.                                      */
-/* Server will wait to receive a SYN from the client. Once a valid SYN packet is received, */
-/* the server will send a SYNACK. Since this is only a two-way handshake, the "accept"     */
-/* function completes once the SYNACK is in flight, and the status is set to SYN_RCVD.     */
-/* The SYNACK control packet is sent unreliably.                                           */
-/* When the server receives the first DATA packet, the status is set to ESTABLISHED.       */
-/* Blocking.                                                                               */
+/* Every packet that reached the listening socket is answered (see listen_pkt): SYNs get   */
+/* a SYNACK with a SYN cookie, and clients whose ACK echoes a valid cookie are queued (up  */
+/* to its backlog). The oldest queued connection is taken; if none is pending, the server  */
+/* waits for one. The connection gets a new socket bound to the listening port and         */
+/* connected to the client, so the kernel hands it only that client's packets, and a       */
+/* DATAACK from it tells the client it may send. If that is lost, the client resends its   */
+/* ACK, which gbn_recv answers with another DATAACK.                                       */
+/* Returns the descriptor of the new connection, or -1 on error.                           */
+/* Blocking, unless the listening socket is non-blocking (O_NONBLOCK): then it fails with  */
+/* EAGAIN when no connection is pending. The new socket is always blocking.                */
 int gbn_accept(int sockfd, struct sockaddr *client, socklen_t *socklen)
 {
-    fprintf(stdout, "\n");
-    fprintf(stdout, "\n");
 
-    gbnhdr *SYNpacket;            /* Used to cast buffer received from client */
-    gbnhdr SYNACKpacket;          /* SYNACK packet                            */
+    gbnhdr *packet;               /* Used to cast buffer received from client */
 
-    int bytessent;                /* Number of bytes sent to client           */
     int bytesrec;                 /* Number of bytes received from client     */
     char recbuf[sizeof(gbnhdr)];  /* Buffer for received packets              */
 
     int clientsockfd;             /* Client socket file descriptor            */
+    int reuse = 1;                /* SO_REUSEADDR                             */
+    gbn_pending request;          /* Connection request being accepted        */
+
+    gbn_sock *sk;                 /* Listening socket                         */
+    gbn_sock *conn;               /* New connection                           */
+    state_t *sockstate;
+
+    /* Expected by recvfrom and getsockname */
+    struct sockaddr_storage from;
+    socklen_t fromlen;
+    struct sockaddr_storage local;
+    socklen_t locallen = sizeof(local);
+
+    if ((sk = sock_get(sockfd)) == NULL)
+        return(-1);
 
-    if (sockstate.status != LISTENING){
-        fprintf(stderr, "gbn_accept: server socket can only transition from LISTENING to SYN_RCVD\n");
+    if (sk->state.status != LISTENING){
+        LOGERR("gbn_accept: server socket must be LISTENING to accept connections\n");
+        errno = EINVAL;
         return(-1);
     }
 
-    fprintf(stdout, "gbn_accept: server waiting for client...\n");
+    LOGDEBUG("gbn_accept: server waiting for client...\n");
 
+    /* Answer the packets that already arrived; block only while none is pending */
     while(1) {
-        /* Block and wait for connection from the client */
-        if ((bytesrec = maybe_recvfrom(sockfd, recbuf, sizeof(gbnhdr), 0, client, socklen)) == -1){ 
-            fprintf(stderr, "gbn_accept: error receiving SYN packet from client\n");
-            continue;
+        fromlen = sizeof(from);
+
+        if ((bytesrec = maybe_recvfrom(sockfd, recbuf, sizeof(gbnhdr), (sk->npending > 0) ? MSG_DONTWAIT : 0, (struct sockaddr *)&from, &fromlen)) == -1){
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            LOGERR("gbn_accept: error receiving packet from client\n");
+            LOGERRNO("gbn_accept");
+            return(-1);
         }
 
-        /* Cast SYN packet */
-        SYNpacket = (gbnhdr*) recbuf;
+        /* Cast packet */
+        packet = (gbnhdr*) recbuf;
 
-        /* Validate checksum */
-        uint16_t recchecksum = SYNpacket->checksum;
-        SYNpacket->checksum = 0;
-        calc_checksum(SYNpacket, sizeof(gbnhdr));
-        if (SYNpacket->checksum != recchecksum){
-            fprintf(stderr, "gbn_accept: received corrupted packet - got: %d, expected: %d\n", SYNpacket->checksum, recchecksum);
-             continue;
+        /* Validate length and checksum */
+        if (check_pkt(packet, bytesrec) == -1){
+            LOGDEBUG("gbn_accept: received corrupted packet - length: %d\n", bytesrec);
+            continue;
         }
 
-        fprintf(stdout, "gbn_accept: server received SYN\n");
-        fprintf(stdout, "gbn_accept: packet type: %d\n", SYNpacket->type);
-        fprintf(stdout, "gbn_accept: packet seqnum: %d\n", SYNpacket->seqnum);
-        fprintf(stdout, "gbn_accept: packet checksum: %d\n", recchecksum);
+        listen_pkt(sk, sockfd, packet, &from, fromlen);
+    }
+
+    if (sk->npending == 0){
+        errno = EAGAIN;
+        return(-1);
+    }
 
-        break;
+    /* Take the oldest pending connection */
+    request = sk->pending[0];
+    sk->npending--;
+    memmove(sk->pending, sk->pending + 1, sk->npending * sizeof(gbn_pending));
 
+    LOGINFO("gbn_accept: server accepting connection with seqnum: %u\n", request.seqnum);
+
+    /* Create a socket for the client on the listening port */
+    if ((clientsockfd = socket(request.addr.ss_family, SOCK_DGRAM, 0)) == -1){
+        LOGERR("gbn_accept: error creating client socket\n");
+        LOGERRNO("gbn_accept");
+        return(-1);
     }
 
-    /* Store seqnum */
-    sockstate.seqnum         = SYNpacket->seqnum;
-    sockstate.expectedseqnum = ((sockstate.seqnum + 1) % 256);
+    if (setsockopt(clientsockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1 ||
+        getsockname(sockfd, (struct sockaddr *)&local, &locallen) == -1 ||
+        bind(clientsockfd, (struct sockaddr *)&local, locallen) == -1 ||
+        connect(clientsockfd, (struct sockaddr *)&request.addr, request.addrlen) == -1){
+        LOGERR("gbn_accept: error connecting client socket\n");
+        LOGERRNO("gbn_accept");
+        close(clientsockfd);
+        return(-1);
+    }
 
-    /* Create a socket with the client */
-    if ((clientsockfd = socket(client->sa_family, SOCK_DGRAM, 0)) == -1){
-        fprintf(stderr, "gbn_accept: error creating client socket\n");
+    if ((conn = sock_new(clientsockfd)) == NULL){
+        LOGERR("gbn_accept: cannot allocate the connection state\n");
+        close(clientsockfd);
+        errno = ENOMEM;
         return(-1);
     }
 
-    fprintf(stdout, "gbn_accept: server connected to client\n");
+    /* The connection inherits the options of the listening socket, */
+    /* never its buffers                                             */
+    sockstate = &conn->state;
+    sockstate->sackok         = sk->state.sackok;
+    sockstate->crcok          = sk->state.crcok;
+    sockstate->mss            = sk->state.mss;
+    sockstate->pmtu           = sk->state.pmtu;
+    sockstate->zerocopy       = sk->state.zerocopy;
+    sockstate->threaded       = sk->state.threaded;
+    sockstate->ackevery       = sk->state.ackevery;
+    sockstate->ackdelay       = sk->state.ackdelay;
+    sockstate->poolquota      = sk->state.poolquota;
+    sockstate->rcvsize        = sk->state.rcvsize;
+    conn->window.maxwindow    = sk->window.maxwindow;
+    conn->window.congestion   = sk->window.congestion;
+    conn->window.sndsize      = sk->window.sndsize;
+    conn->window.rto          = sk->window.rto;
+    if (sk->impair != NULL && (conn->impair = impair_new(&sk->impair->conf)) == NULL){
+        LOGERR("gbn_accept: cannot allocate the simulated path\n");
+        sock_free(clientsockfd);
+        close(clientsockfd);
+        errno = ENOMEM;
+        return(-1);
+    }
 
-    /* Save client info */
-    sockstate.destaddr = client;
-    sockstate.destsocklen = *socklen;
+    LOGINFO("gbn_accept: server connected to client\n");
 
-    /* Set server socket state */
-    sockstate.status = SYN_RCVD;
+    /* Grant Selective Repeat if the client asked for it and it is allowed here */
+    sockstate->sack = sockstate->sackok && (request.flags & FLAG_SACK);
+    sockstate->crc  = sockstate->crcok && (request.flags & FLAG_CRC);
 
-    /* Create SYNACK packet */
-    memset(&SYNACKpacket, 0, sizeof(gbnhdr));
-    create_pkt(&SYNACKpacket, SYNACK, sockstate.seqnum);
-    calc_checksum(&SYNACKpacket, sizeof(gbnhdr));
+    /* Both sides use the smaller MSS, capped at the path MTU if asked */
+    if (sockstate->pmtu){
+        if (set_pmtu(clientsockfd, 1) == -1)
+            LOGERRNO("gbn_accept");
+        sockstate->mss = path_mss((struct sockaddr *)&request.addr, request.addrlen, sockstate->mss, sockstate->crc ? CRC_BYTES : 0);
+    }
+    if (request.mss < sockstate->mss)
+        sockstate->mss = request.mss;
+    if (sockstate->crc && sockstate->mss > MAXDATALEN - (int)CRC_BYTES)
+        sockstate->mss = MAXDATALEN - CRC_BYTES;
+    if (sockstate->zerocopy && set_zerocopy(clientsockfd, 1) == -1)
+        LOGERRNO("gbn_accept");
+    LOGINFO("gbn_accept: MSS: %d\n", sockstate->mss);
 
-    fprintf(stdout, "gbn_accept: server sending SYNACK\n");
-    fprintf(stdout, "gbn_accept: packet type: %d\n", SYNACKpacket.type);
-    fprintf(stdout, "gbn_accept: packet seqnum: %d\n", SYNACKpacket.seqnum);
-    fprintf(stdout, "gbn_accept: packet checksum: %d\n", SYNACKpacket.checksum);
+    /* Store seqnum */
+    sockstate->sockfd         = clientsockfd;
+    sockstate->synseqnum      = request.seqnum;
+    sockstate->seqnum         = request.seqnum;
+    sockstate->expectedseqnum = sockstate->seqnum + 1;
 
-    /* Send SYNACK packet unreliably */
-    if ((bytessent = sendto(sockfd, (void *)&SYNACKpacket, sizeof(gbnhdr), 0, (const struct sockaddr *)sockstate.destaddr, sockstate.destsocklen)) == -1){
-        fprintf(stderr, "gbn_accept: error sending SYNACK packet to client\n"); 
-        perror("gbn_accept");
+    /* Save client info */
+    memcpy(&sockstate->destaddr, &request.addr, request.addrlen);
+    sockstate->destsocklen = request.addrlen;
+
+    /* The handshake is done: the connection starts at the client's window */
+    sockstate->status = ESTABLISHED;
+    init_window(conn);
+    conn->window.rwnd = request.window;
+    publish_window(conn);
+
+    /* Tell the client it may send, advertising the receive buffer */
+    if ((sockstate->sack && init_sack(conn) == -1) || init_rcvbuf(conn) == -1){
+        LOGERR("gbn_accept: cannot allocate the receive buffer\n");
+        sock_free(clientsockfd);
+        close(clientsockfd);
+        errno = ENOMEM;
+        return(-1);
+    }
+    if (send_dataack(conn, clientsockfd, 0) == -1){
+        sock_free(clientsockfd);
+        close(clientsockfd);
         return(-1);
     }
 
-    fprintf(stdout, "gbn_accept: server sent SYNACK\n");
+    LOGINFO("gbn_accept: server confirmed the connection\n");
+    accepted_add(sk, &request);
 
-    /* Send SYNACK over UDP - expect ESTABLISHED connection */
-    sockstate.status = ESTABLISHED;
+    /* Report the client's address */
+    if (client != NULL && socklen != NULL){
+        memcpy(client, &request.addr, (*socklen < request.addrlen) ? *socklen : request.addrlen);
+        *socklen = request.addrlen;
+    }
 
-    return sockfd;
+    return clientsockfd;
 }
 
-/* Simulate recvfrom functionality in an unreliable environment */
+/* recvfrom through the simulated path of the socket (see GBN_IMPAIR), */
+/* which may lose, corrupt, duplicate, delay or reorder the datagram.   */
+/* Without one this is recvfrom.                                        */
 ssize_t maybe_recvfrom(int  s, char *buf, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen)
 {
-    /*----- Packet not lost -----*/
-    if (rand() > LOSS_PROB*RAND_MAX){
+    struct mmsghdr msg;
+    struct iovec iov;
 
-        /*----- Receiving the packet -----*/
-        int retval = recvfrom(s, buf, len, flags, from, fromlen);
+    if (impaired(s, IMPAIR_RX) == NULL)
+        return recvfrom(s, buf, len, flags, from, fromlen);
 
-        /*----- Packet corrupted -----*/
-        if (rand() < CORR_PROB*RAND_MAX){
-            /*----- Selecting a random byte inside the packet -----*/
-            int index = (int)((len-1)*rand()/(RAND_MAX + 1.0));
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len  = len;
+    msg.msg_hdr.msg_iov     = &iov;
+    msg.msg_hdr.msg_iovlen  = 1;
+    msg.msg_hdr.msg_name    = from;
+    msg.msg_hdr.msg_namelen = (fromlen != NULL) ? *fromlen : 0;
 
-            /*----- Inverting a bit -----*/
-            char c = buf[index];
-            if (c & 0x01)
-                c &= 0xFE;
-            else
-                c |= 0x01;
-            buf[index] = c;
-        }
+    if (maybe_recvmmsg(s, &msg, 1, flags) == -1)
+        return(-1);
+
+    if (fromlen != NULL)
+        *fromlen = msg.msg_hdr.msg_namelen;
+    return msg.msg_len;
+}
+
+/* recvmmsg through the simulated path of the socket. Only the packets  */
+/* it has released are returned; a blocking call waits for the first.  */
+int maybe_recvmmsg(int s, struct mmsghdr *msgs, unsigned int vlen, int flags)
+{
+    gbn_impstate *im;
+    int retval;
 
-        return retval;
+    if ((im = impaired(s, IMPAIR_RX)) == NULL)
+        return recvmmsg(s, msgs, vlen, flags, NULL);
 
+    while (1){
+        if (impair_pull(im, s) == -1)
+            return(-1);
+        if ((retval = impair_recvmmsg(im, msgs, vlen)) > 0)
+            return retval;
+        if ((flags & MSG_DONTWAIT) || (fcntl(s, F_GETFL) & O_NONBLOCK)){
+            errno = EAGAIN;
+            return(-1);
+        }
+        if (wait_until(s, 0) == -1)
+            return(-1);
     }
+}
+
+/* sendto through the simulated path of the socket, which may lose, */
+/* corrupt or duplicate the datagram. Without one this is sendto.   */
+ssize_t maybe_sendto(int s, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen)
+{
+    gbn_impstate *im;
+    struct mmsghdr msg;
+    struct iovec iov;
+
+    if ((im = impaired(s, IMPAIR_TX)) == NULL)
+        return sendto(s, buf, len, flags, to, tolen);
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)buf;
+    iov.iov_len  = len;
+    msg.msg_hdr.msg_iov     = &iov;
+    msg.msg_hdr.msg_iovlen  = 1;
+    msg.msg_hdr.msg_name    = (void *)to;
+    msg.msg_hdr.msg_namelen = tolen;
+
+    if (impair_sendmmsg(im, s, &msg, 1, flags) == -1)
+        return(-1);
+    return msg.msg_len;
+}
+
+/* sendmmsg through the simulated path of the socket */
+int maybe_sendmmsg(int s, struct mmsghdr *msgs, unsigned int vlen, int flags)
+{
+    gbn_impstate *im;
 
-    /*----- Packet lost -----*/
-    return(len);  /* Simulate a success */
+    if ((im = impaired(s, IMPAIR_TX)) == NULL)
+        return sendmmsg(s, msgs, vlen, flags);
 
+    return impair_sendmmsg(im, s, msgs, vlen, flags);
 }
@@ -1,8 +1,15 @@
 #ifndef _gbn_h
 #define _gbn_h
 
+/*----- Expose POSIX/GNU interfaces when compiling with -ansi -----*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include<sys/types.h>
 #include<sys/socket.h>
+#include<sys/uio.h>
+#include<stddef.h>
 #include<sys/ioctl.h>
 #include<signal.h>
 #include<unistd.h>
@@ -11,9 +18,21 @@
 #include<stdlib.h>
 #include<string.h>
 #include<netinet/in.h>
+#include<netinet/ip.h>
 #include<errno.h>
 #include<netdb.h>
 #include<time.h>
+#include<poll.h>
+#include<pthread.h>
+#include<sys/eventfd.h>
+#include<linux/errqueue.h>
+
+#include "gbn_cc.h"
+#include "gbn_csum.h"
+#include "gbn_log.h"
+#include "gbn_impair.h"
+#include "gbn_pool.h"
+#include "gbn_cookie.h"
 
 /*----- Error variables -----*/
 extern int h_errno;
@@ -23,12 +42,23 @@ extern int errno;
 #define h_addr h_addr_list[0]
 
 /*----- Protocol parameters -----*/
-#define LOSS_PROB .09    /* Loss probability                            */
-#define CORR_PROB 1e-3    /* Corruption probability                      */
-#define DATALEN   1024    /* Length of the payload                       */
-#define N         1024    /* Max number of packets a single call to gbn_send can process */
-#define TIMEOUT      1    /* Timeout to resend packets (1 second)        */
-#define CONN_BROKEN  5    /* Number of timeouts before connection is considered broken   */
+#define DATALEN   1024    /* Default maximum segment size (payload length) */
+#define MAXDATALEN 65497  /* Largest payload: a 65507-byte UDP datagram minus the header */
+#define SNDBUF    (4 << 20) /* Default send buffer size in bytes (see GBN_SNDBUF) */
+#define RCVBUF    (4 << 20) /* Default receive buffer size in bytes (see GBN_RCVBUF) */
+#define WINDOW      64    /* Default maximum window size (in packets)    */
+#define MAXWINDOW 65536   /* Largest window that can be configured       */
+#define RTO_INIT  1000000 /* Timeout before the first RTT sample (1 s, in microseconds)   */
+#define RTO_MIN     10000 /* Lower bound for the retransmission timeout (10 ms)          */
+#define RTO_MAX  60000000 /* Upper bound for the retransmission timeout (60 s)           */
+#define CONN_BROKEN 10    /* Number of consecutive timeouts before connection is considered broken */
+#define SACK_WINDOW 1024  /* Packets buffered out of order in Selective Repeat mode (power of 2)  */
+#define MAXBACKLOG   128  /* Largest number of pending connections of a listening socket        */
+#define BATCH         64  /* Datagrams sent or received per sendmmsg/recvmmsg call             */
+#define ACK_EVERY      2  /* Default number of in-order packets covered by one ACK             */
+#define ACK_DELAY   2000  /* Default delayed ACK timeout (2 ms, in microseconds, below RTO_MIN) */
+#define ZEROCOPY_MIN 8192 /* Smallest MSS sent with MSG_ZEROCOPY when GBN_ZEROCOPY is on      */
+#define ACKRING      256  /* ACKs queued from the ACK thread to the transmit thread (power of 2) */
 
 /*----- Packet types -----*/
 #define SYN      0        /* Opens a connection                          */
@@ -38,16 +68,76 @@ extern int errno;
 #define FIN      4        /* Ends a connection                           */
 #define FINACK   5        /* Acknowledgement of a FIN packet             */
 #define RST      6        /* Reset packet used to reject new connections */
+#define ACK      7        /* Acknowledgement of a SYNACK, ends the handshake */
+
+/*----- Packet flags -----*/
+#define FLAG_SACK 0x01    /* SYN, ACK: Selective Repeat requested, SYNACK: granted */
+#define FLAG_CRC  0x02    /* SYN, ACK: CRC32C requested, SYNACK: granted,    */
+                          /* other packets: protected by a CRC32C trailer    */
+#define FLAG_RWND 0x04    /* DATAACK: the payload starts with the receive window */
 
 /*----- Go-Back-n packet format -----*/
 typedef struct {
     uint8_t  type;            /* Packet type (e.g. SYN, DATA, ACK, FIN)     */
-    uint8_t  seqnum;          /* Packet sequence number                     */
+    uint8_t  flags;           /* Packet flags (FLAG_*)                      */
+    uint32_t seqnum;          /* Packet sequence number                     */
     uint16_t checksum;        /* Packet checksum                            */
     uint16_t payloadlen;      /* Length of payload                          */
-    uint8_t data[DATALEN];    /* Pointer to payload                         */
+    uint8_t data[DATALEN];    /* Payload (DATA packets carry up to the MSS) */
 } __attribute__((packed)) gbnhdr;
 
+/*----- Wire format -----*/
+/* Only the header and the first payloadlen bytes of data are transmitted, */
+/* and the checksum covers exactly those bytes. A packet with FLAG_CRC     */
+/* (other than a SYN, SYNACK or ACK, which negotiate it) is followed by   */
+/* the CRC32C of those bytes, and its checksum field is 0.                 */
+#define CRC_BYTES       (sizeof(uint32_t))                   /* Length of the CRC32C trailer  */
+#define GBN_HDRLEN      (offsetof(gbnhdr, data))              /* Header length on the wire (10) */
+#define GBN_HASCRC(p)   (((p)->flags & FLAG_CRC) && (p)->type != SYN && (p)->type != SYNACK && (p)->type != ACK)
+#define GBN_PKTLEN(p)   (GBN_HDRLEN + (p)->payloadlen + (GBN_HASCRC(p) ? CRC_BYTES : 0)) /* Packet length on the wire */
+
+/* The payload of a DATAACK with FLAG_RWND starts with the receive window: */
+/* the number of packets past seqnum the receiver has room for, as a       */
+/* uint32_t. In Selective Repeat mode a SACK bitmap follows: bit i (least  */
+/* significant bit first) is set when packet seqnum + 2 + i, i.e. a packet */
+/* past the first hole, is buffered at the receiver.                       */
+#define RWND_BYTES      (sizeof(uint32_t))                   /* Length of the receive window  */
+#define SACK_BYTES      (SACK_WINDOW / 8)                    /* Longest SACK bitmap           */
+
+/* The payload of a SYN, SYNACK and ACK holds the handshake options: the  */
+/* largest payload (MSS) the sender of the packet accepts, as a uint16_t, */
+/* its receive window in packets, as a uint32_t, and a uint32_t cookie:   */
+/* 0 in a SYN, the listener's SYN cookie in a SYNACK, echoed by the ACK.  */
+/* Each DATA packet carries up to the smaller MSS; a peer that sends no   */
+/* MSS gets DATALEN, and one that sends no window starts at MAXWINDOW.    */
+#define MSS_BYTES       (sizeof(uint16_t))                   /* Length of the MSS option      */
+#define COOKIE_BYTES    (sizeof(uint32_t))                   /* Length of the cookie          */
+#define SYNOPT_BYTES    (MSS_BYTES + RWND_BYTES + COOKIE_BYTES) /* Length of the options      */
+
+/*----- Sequence number comparison -----*/
+/* Sequence numbers are 32 bits and wrap around, so they are compared */
+/* through the sign of their difference (as in TCP).                   */
+#define SEQ_LT(a, b)    ((int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0)
+#define SEQ_LEQ(a, b)   ((int32_t)((uint32_t)(a) - (uint32_t)(b)) <= 0)
+#define SEQ_GT(a, b)    ((int32_t)((uint32_t)(a) - (uint32_t)(b)) > 0)
+#define SEQ_GEQ(a, b)   ((int32_t)((uint32_t)(a) - (uint32_t)(b)) >= 0)
+
+/*----- Socket options (see gbn_setsockopt) -----*/
+#define GBN_WINDOW      1 /* Maximum window size in packets (int, 1..MAXWINDOW) */
+#define GBN_CONGESTION  2 /* Congestion control algorithm (int, GBN_CC_*)       */
+#define GBN_SACK        3 /* Request/grant Selective Repeat (int, 0 or 1)       */
+#define GBN_ACKEVERY    4 /* In-order packets per ACK (int, 1..MAXWINDOW)       */
+#define GBN_ACKDELAY    5 /* Delayed ACK timeout in microseconds (int, 0..RTO_MIN) */
+#define GBN_MSS         6 /* Largest payload per packet (int, 1..MAXDATALEN)     */
+#define GBN_PMTU        7 /* Cap the MSS at the path MTU, never fragment (int, 0 or 1) */
+#define GBN_ZEROCOPY    8 /* Send DATA payloads with MSG_ZEROCOPY (int, 0 or 1)  */
+#define GBN_CRC32C      9 /* Request/grant CRC32C instead of the checksum (int, 0 or 1) */
+#define GBN_SNDBUF     10 /* Send buffer size in bytes, rounded up to a power of 2 (int, >= 1) */
+#define GBN_RCVBUF     11 /* Receive buffer size in bytes, rounded up to a power of 2 (int, >= 1) */
+#define GBN_IMPAIR     12 /* Simulated path impairments (gbn_impair, see gbn_impair.h; NULL for none) */
+#define GBN_THREADS    13 /* Send through a transmit and an ACK thread (int, 0 or 1) */
+#define GBN_POOLQUOTA  14 /* Most out of order packets kept in pool buffers (int, 0..SACK_WINDOW) */
+
 /*----- State definitions -----*/
 enum states {
     CLOSED,         /* Socket is closed to connections (0)     */
@@ -65,18 +155,229 @@ enum states {
 typedef struct state_t {
     enum states status;                /* Current state of socket                   */
     int sockfd;                        /* Source socket descriptor/file handler     */
-    int seqnum;                        /* Last seqnum to be transmitted succesfully */
-    int expectedseqnum;                /* The next seqnum expected                  */
-    struct sockaddr *destaddr;         /* Destination socket address                */
+    uint32_t seqnum;                   /* Last seqnum to be transmitted succesfully */
+    uint32_t expectedseqnum;           /* The next seqnum expected                  */
+    struct sockaddr_storage destaddr;  /* Destination socket address                */
     socklen_t destsocklen;             /* Length of destination address             */
+    uint32_t synseqnum;                /* Seqnum of the SYN that opened the connection */
+    int sackok;                        /* Selective Repeat allowed by this side     */
+    int sack;                          /* Selective Repeat negotiated               */
+    int crcok;                         /* CRC32C allowed by this side               */
+    int crc;                           /* CRC32C negotiated                         */
+    uint8_t *rcvbuf;                   /* Receiver: in-order bytes not read yet (ring) */
+    size_t rcvsize;                    /* Receiver: size of the ring (a power of 2) */
+    uint64_t rcvhead;                  /* Receiver: stream offset of the next byte to read */
+    uint64_t rcvtail;                  /* Receiver: stream offset past the last byte */
+    uint32_t rcvwnd;                   /* Receiver: last receive window advertised  */
+    uint8_t *rcvpresent;               /* Receiver: which slots hold a packet       */
+    gbnhdr **rcvslot;                  /* Receiver: out of order packets (pool buffers) */
+    int poolquota;                     /* Receiver: most packets in rcvslot (GBN_POOLQUOTA) */
+    int poolheld;                      /* Receiver: packets in rcvslot              */
+    int mss;                           /* Maximum segment size: configured, then negotiated */
+    int pmtu;                          /* Cap the MSS at the path MTU               */
+    int ackevery;                      /* Receiver: in-order packets per ACK        */
+    uint64_t ackdelay;                 /* Receiver: delayed ACK timeout (us)        */
+    int unacked;                       /* Receiver: in-order packets not ACKed yet  */
+    uint64_t ackdeadline;              /* Receiver: when the delayed ACK is due (0: none) */
+    int zerocopy;                      /* Sender: MSG_ZEROCOPY allowed (GBN_ZEROCOPY) */
+    uint32_t zcsent;                   /* Sender: sends made with MSG_ZEROCOPY      */
+    uint32_t zcdone;                   /* Sender: zerocopy sends reported complete  */
+    uint32_t zcmark;                   /* Sender: zcsent when the last ACK freed    */
+                                       /* bytes of the send buffer                  */
+    int threaded;                      /* Sender: use sender threads (GBN_THREADS)  */
 } state_t;
 
+/*----- Selective Repeat states of a packet in flight -----*/
+#define SB_NONE    0      /* In flight                         */
+#define SB_SACKED  1      /* Buffered at the receiver          */
+#define SB_REXMIT  2      /* Taken as lost and already resent  */
+
+#define TXSEG_PREFETCH 4  /* Descriptors fetched ahead by the retransmit scans */
+
+/*----- Descriptor of a DATA packet in flight -----*/
+/* Filled in when the packet is first sent and reused whenever it is     */
+/* resent, so a retransmission only has to point at its payload. The    */
+/* fields read by the ACK and retransmit paths come first.              */
+typedef struct gbn_txseg {
+    uint32_t seqnum;                   /* Seqnum of the packet                      */
+    uint32_t length;                   /* Length of its payload                     */
+    uint64_t offset;                   /* Stream offset of its payload              */
+    uint64_t sent;                     /* When it was last sent (microseconds)      */
+    uint16_t rexmits;                  /* Number of times it was resent             */
+    uint8_t state;                     /* SB_* state (Selective Repeat)             */
+    uint8_t hdr[GBN_HDRLEN];           /* Header as sent, checksum included         */
+    uint8_t crc[CRC_BYTES];            /* CRC32C trailer, if negotiated             */
+} gbn_txseg;
+
 /*----- Sequence and window info -----*/
 typedef struct window {
     int window;                 /* Window size (N)              */
-    volatile int numtimeouts;   /* Number of recorded timeouts  */
+    int maxwindow;              /* Upper bound for the window   */
+    int numtimeouts;            /* Number of recorded timeouts  */
+    int congestion;             /* Selected GBN_CC_* algorithm  */
+    gbn_cc cc;                  /* Congestion control state     */
+    int dupacks;                /* Consecutive duplicate ACKs   */
+    uint32_t recover;           /* Highest seqnum sent when the last loss was detected */
+
+    uint32_t holeend;           /* Unsacked packets before this seqnum are lost (SR)    */
+
+    /* Descriptors of the packets in flight: a ring indexed by seqnum & txmask */
+    gbn_txseg *txsegs;          /* At least maxwindow entries (a power of 2)            */
+    uint32_t txmask;            /* Number of entries minus 1                            */
+
+    /* Send buffer: a ring indexed by stream offset & (sndsize - 1) */
+    uint8_t *sndbuf;            /* Allocated by the first gbn_send                      */
+    size_t sndsize;             /* Size of the ring (a power of 2)                      */
+    uint64_t sndhead;           /* Offset of the oldest unacknowledged byte             */
+    uint64_t sndnew;            /* Offset of the first byte never sent                  */
+    uint64_t sndtail;           /* Offset past the last byte queued by gbn_send         */
+    uint32_t sndmax;            /* Seqnum of the next new packet                        */
+    uint32_t rwnd;              /* Receive window last advertised by the peer (packets) */
+
+    /* Retransmission timer (RFC 6298), all times in microseconds */
+    uint64_t srtt;              /* Smoothed round-trip time (0 before the first sample) */
+    uint64_t rttvar;            /* Round-trip time variation                            */
+    uint64_t rto;               /* Retransmission timeout                               */
+    uint64_t deadline;          /* When the oldest packet in flight times out (0: off)  */
+    uint32_t rtseqnum;          /* The next RTT sample is taken from an ACK covering it */
 } window;
 
+/*----- Connection that completed the handshake, waiting to be accepted -----*/
+typedef struct gbn_pending {
+    struct sockaddr_storage addr;      /* Address of the client                     */
+    socklen_t addrlen;                 /* Length of the client address              */
+    uint32_t seqnum;                   /* Seqnum of the client's SYN and ACK        */
+    uint8_t flags;                     /* Flags of the client's ACK (as in its SYN) */
+    int mss;                           /* MSS offered by the client                 */
+    uint32_t window;                   /* Receive window of the client (packets)    */
+} gbn_pending;
+
+/*----- Connection accepted recently, remembered by its listening socket -----*/
+/* A client resends its ACK until the DATAACK that confirms the connection */
+/* arrives, and a resent ACK must not queue the connection again. Entries  */
+/* sit in a small set-associative hash keyed by the client's address and   */
+/* seqnum; they need not outlive the SYN cookie the ACK echoes.            */
+#define ACCEPTED_SETS  64         /* Sets of the hash                            */
+#define ACCEPTED_WAYS   4         /* Connections per set, the oldest replaced    */
+#define ACCEPTED_TTL   (2 * COOKIE_PERIOD * 1000000ULL) /* Life of an entry (us) */
+
+typedef struct gbn_accepted {
+    struct sockaddr_storage addr;      /* Address of the client                     */
+    socklen_t addrlen;                 /* Length of the client address              */
+    uint32_t seqnum;                   /* Seqnum of the client's SYN and ACK        */
+    uint64_t when;                     /* When it was accepted (us), 0 if unused    */
+} gbn_accepted;
+
+/*----- Batch of datagrams for sendmmsg/recvmmsg -----*/
+typedef struct gbn_batch {
+    int count;                         /* Datagrams in the batch                    */
+    size_t stride;                     /* Receiver: bytes per packet buffer         */
+    uint8_t *bufs[BATCH];              /* Receiver: packet buffers (from the pool)  */
+    struct iovec iov[3 * BATCH];       /* Receiver: one buffer per packet, sender:  */
+                                       /* a header, a slice of the send buffer      */
+                                       /* and the CRC32C trailer if negotiated      */
+    struct mmsghdr msgs[BATCH];        /* One message per packet                    */
+} gbn_batch;
+
+#define BATCH_PKT(b, i) ((gbnhdr *)(void *)(b)->bufs[i])  /* Packet i */
+
+/*----- Connection statistics (see gbn_getstats) -----*/
+/* Counters start at 0 when the connection is set up. Each has a single */
+/* writer, so an update is a relaxed load and store rather than a       */
+/* locked add; gbn_getstats reads them without locks or tearing.       */
+/* The window and RTT values are likewise published by the thread that */
+/* owns the window (see publish_window) each time it changes them.     */
+typedef struct gbn_stats {
+    /* Sender */
+    uint64_t bytessent;                /* DATA payload bytes sent, resent ones included */
+    uint64_t segssent;                 /* DATA packets sent, resent ones included   */
+    uint64_t retransmits;              /* DATA packets resent                       */
+    uint64_t bytesacked;               /* Payload bytes acknowledged                */
+    uint64_t acksrecv;                 /* New cumulative DATAACKs received          */
+    uint64_t dupacks;                  /* Duplicate DATAACKs received               */
+    uint64_t timeouts;                 /* Retransmission timeouts                   */
+    uint64_t fastretransmits;          /* Losses detected through duplicate ACKs    */
+
+    /* Receiver */
+    uint64_t bytesrecv;                /* Payload bytes added to the stream in order */
+    uint64_t segsrecv;                 /* Valid DATA packets received               */
+    uint64_t ackssent;                 /* DATAACKs sent                             */
+    uint64_t nobuf;                    /* DATA packets dropped, receive buffer full */
+
+    /* Both */
+    uint64_t corrupted;                /* Packets dropped for a bad checksum or CRC */
+    uint64_t outoforder;               /* Packets received out of order             */
+
+    /* Current values, as last published by the owner of the window */
+    uint32_t cwnd;                     /* Congestion window (packets)               */
+    uint32_t ssthresh;                 /* Slow start threshold (packets)            */
+    uint32_t rwnd;                     /* Peer's receive window (packets)           */
+    uint32_t mss;                      /* Negotiated maximum segment size           */
+    uint32_t poolbufs;                 /* Pool buffers held (see gbn_pool.h)        */
+    uint64_t srtt;                     /* Smoothed round-trip time (us)             */
+    uint64_t rttvar;                   /* Round-trip time variation (us)            */
+    uint64_t rto;                      /* Retransmission timeout (us)               */
+    uint64_t elapsed;                  /* Time since the connection was set up (us) */
+    double goodput;                    /* Bytes acknowledged plus bytes received    */
+                                       /* in order, per second of elapsed time      */
+} gbn_stats;
+
+#define STAT_ADD(sk, counter, n) \
+    __atomic_store_n(&(sk)->stats.counter, __atomic_load_n(&(sk)->stats.counter, __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define STAT_SET(sk, value, v) \
+    __atomic_store_n(&(sk)->stats.value, (v), __ATOMIC_RELAXED)
+
+/*----- Sender threads (see GBN_THREADS) -----*/
+/* The transmit thread owns the window: it sends, takes ACKs and handles */
+/* timeouts, clocking out new packets as soon as an ACK opens room. The  */
+/* ACK thread only reads datagrams into a single-producer single-        */
+/* consumer ring of ACKs. The application shares two stream offsets     */
+/* with the transmit thread: gbn_send publishes sndtail and the          */
+/* transmit thread publishes sndhead, so neither takes a lock. A thread  */
+/* with nothing to do sleeps on an eventfd, after raising its sleeping   */
+/* flag; whoever hands it work writes the eventfd only if the flag is    */
+/* up.                                                                   */
+#define ACKREC_BYTES    (GBN_HDRLEN + RWND_BYTES + SACK_BYTES + CRC_BYTES)  /* Longest ACK */
+
+typedef struct gbn_ackrec {
+    ssize_t len;                       /* Datagram length                           */
+    uint64_t pkt[(ACKREC_BYTES + 7) / 8]; /* Datagram, 8-byte aligned               */
+} gbn_ackrec;
+
+typedef struct gbn_threads {
+    pthread_t tx;                      /* Transmit thread                           */
+    pthread_t ack;                     /* ACK thread                                */
+    int txwake;                        /* eventfd waking the transmit thread        */
+    int appwake;                       /* eventfd waking gbn_send and gbn_flush     */
+    int stopfd;                        /* eventfd, readable once the threads stop   */
+    int stop;                          /* The threads must exit                     */
+    int error;                         /* errno of the failure that ended them, or 0 */
+    int txsleeping;                    /* The transmit thread waits on txwake       */
+    int appsleeping;                   /* The application waits on appwake          */
+    uint64_t sndtail;                  /* Published by gbn_send (see window)        */
+    uint64_t sndhead;                  /* Published by the transmit thread          */
+    uint32_t ackhead;                  /* Next ACK the transmit thread takes        */
+    uint32_t acktail;                  /* Next slot the ACK thread fills            */
+    gbn_ackrec acks[ACKRING];          /* ACKs read but not taken yet               */
+} gbn_threads;
+
+/*----- Socket, one per descriptor in the connection table -----*/
+typedef struct gbn_sock {
+    state_t state;                     /* Connection state                          */
+    window window;                     /* Sequence and window info                  */
+    gbn_batch *txbatch;                /* DATA packets waiting for sendmmsg         */
+    gbn_batch *rxbatch;                /* Packets read by the last recvmmsg         */
+    gbnhdr ackpkt;                     /* Receiver: last ACK packet sent            */
+    int backlog;                       /* Listening: most pending connections       */
+    int npending;                      /* Listening: number of pending connections  */
+    gbn_pending *pending;              /* Listening: handshakes done, not accepted yet, oldest first */
+    gbn_accepted *accepted;            /* Listening: recent connections (ACCEPTED_SETS * ACCEPTED_WAYS) */
+    gbn_stats stats;                   /* Counters of the connection                */
+    uint64_t starttime;                /* When the connection was set up (us)       */
+    gbn_impstate *impair;              /* Simulated path (GBN_IMPAIR), NULL if none */
+    gbn_threads *threads;              /* Sender threads, NULL unless running       */
+} gbn_sock;
+
 extern state_t s;
 
 void gbn_init();
@@ -84,12 +385,18 @@ int gbn_connect(int sockfd, const struct sockaddr *server, socklen_t socklen);
 int gbn_listen(int sockfd, int backlog);
 int gbn_bind(int sockfd, const struct sockaddr *server, socklen_t socklen);
 int gbn_socket(int domain, int type, int protocol);
+int gbn_setsockopt(int sockfd, int optname, const void *optval, socklen_t optlen);
 int gbn_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 int gbn_close(int sockfd);
 ssize_t gbn_send(int sockfd, const void *buf, size_t len, int flags);
+int gbn_flush(int sockfd);
 ssize_t gbn_recv(int sockfd, void *buf, size_t len, int flags);
+int gbn_getstats(int sockfd, struct gbn_stats *stats);
 ssize_t  maybe_recvfrom(int  s, char *buf, size_t len, int flags, \
             struct sockaddr *from, socklen_t *fromlen);
-uint16_t checksum(uint16_t *buf, int nwords);
+int maybe_recvmmsg(int s, struct mmsghdr *msgs, unsigned int vlen, int flags);
+ssize_t maybe_sendto(int s, const void *buf, size_t len, int flags, \
+            const struct sockaddr *to, socklen_t tolen);
+int maybe_sendmmsg(int s, struct mmsghdr *msgs, unsigned int vlen, int flags);
 
 #endif
@@ -0,0 +1,189 @@
+#include "gbn.h"
+#include<math.h>
+
+/*----- Shared helpers -----*/
+
+/* Seconds elapsed since ts */
+static double elapsed(const struct timespec *ts)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - ts->tv_sec) + (now.tv_nsec - ts->tv_nsec) / 1e9;
+}
+
+/* Slow start: grow cwnd by one packet per ACKed packet, up to ssthresh. */
+/* Returns the number of ACKed packets left for congestion avoidance.    */
+static uint32_t slow_start(gbn_cc *cc, uint32_t acked)
+{
+    double room = cc->ssthresh - cc->cwnd;
+
+    if (room <= 0)
+        return acked;
+    if (acked <= room){
+        cc->cwnd += acked;
+        return 0;
+    }
+    cc->cwnd = cc->ssthresh;
+    return acked - (uint32_t)room;
+}
+
+/*----- Reno: additive increase, multiplicative decrease -----*/
+
+static void reno_init(gbn_cc *cc)
+{
+}
+
+/* Above ssthresh, grow cwnd by one packet per window of ACKed packets */
+static void reno_ack(gbn_cc *cc, uint32_t acked)
+{
+    if ((acked = slow_start(cc, acked)) == 0)
+        return;
+    cc->cwnd += (double)acked / cc->cwnd;
+}
+
+/* Halve the window */
+static void reno_loss(gbn_cc *cc, uint32_t inflight)
+{
+    cc->ssthresh = inflight / 2.0;
+    if (cc->ssthresh < CC_MINSSTHRESH)
+        cc->ssthresh = CC_MINSSTHRESH;
+    cc->cwnd = cc->ssthresh;
+}
+
+static const gbn_ccops reno_ops = {
+    "reno", reno_init, reno_ack, reno_loss
+};
+
+/*----- CUBIC (RFC 8312) -----*/
+/* Above ssthresh the window follows W(t) = C (t - K)^3 + Wmax, where t is */
+/* the time since the last reduction. It is never allowed to fall behind   */
+/* the window that Reno would have reached over the same ACKs.             */
+
+static void cubic_init(gbn_cc *cc)
+{
+    cc->wmax = 0;
+    cc->k = 0;
+    cc->epochvalid = 0;
+}
+
+static void cubic_ack(gbn_cc *cc, uint32_t acked)
+{
+    double t;
+    double target;
+
+    if ((acked = slow_start(cc, acked)) == 0)
+        return;
+
+    /* First ACK of a new epoch */
+    if (!cc->epochvalid){
+        clock_gettime(CLOCK_MONOTONIC, &cc->epoch);
+        cc->epochvalid = 1;
+        if (cc->wmax < cc->cwnd){
+            cc->wmax = cc->cwnd;
+            cc->k = 0;
+        } else {
+            cc->k = cbrt(cc->wmax * (1 - CUBIC_BETA) / CUBIC_C);
+        }
+        cc->westimate = cc->cwnd;
+    }
+
+    t = elapsed(&cc->epoch) - cc->k;
+    target = CUBIC_C * t * t * t + cc->wmax;
+
+    /* Reno-friendly estimate: 3(1 - beta)/(1 + beta) packets per window */
+    cc->westimate += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * acked / cc->cwnd;
+    if (target < cc->westimate)
+        target = cc->westimate;
+
+    /* Move towards the target by at most half a packet per ACKed packet */
+    if (target > cc->cwnd){
+        double step = (target - cc->cwnd) / cc->cwnd * acked;
+        if (step > acked / 2.0)
+            step = acked / 2.0;
+        cc->cwnd += step;
+    } else {
+        /* Past both the cubic curve and the Reno-friendly estimate (the  */
+        /* TCP-friendly region of RFC 8312 bounds the window from below   */
+        /* only): keep probing for bandwidth, by CUBIC_PROBE packets per  */
+        /* window as Linux does (one packet every 100 windows)            */
+        cc->cwnd += CUBIC_PROBE * acked / cc->cwnd;
+    }
+}
+
+/* Multiplicative decrease by beta, remembering the window at the loss */
+static void cubic_loss(gbn_cc *cc, uint32_t inflight)
+{
+    cc->wmax = cc->cwnd;
+    cc->epochvalid = 0;
+    cc->ssthresh = cc->cwnd * CUBIC_BETA;
+    if (cc->ssthresh < CC_MINSSTHRESH)
+        cc->ssthresh = CC_MINSSTHRESH;
+    cc->cwnd = cc->ssthresh;
+}
+
+static const gbn_ccops cubic_ops = {
+    "cubic", cubic_init, cubic_ack, cubic_loss
+};
+
+/*----- Interface used by gbn.c -----*/
+
+/* Reset the congestion state for a new connection.   */
+/* Returns -1 if the algorithm is unknown.            */
+int cc_init(gbn_cc *cc, int algorithm, int maxwindow)
+{
+    switch(algorithm){
+        case GBN_CC_RENO:
+            cc->ops = &reno_ops;
+            break;
+        case GBN_CC_CUBIC:
+            cc->ops = &cubic_ops;
+            break;
+        default:
+            return(-1);
+    }
+
+    cc->maxwindow = maxwindow;
+    cc->cwnd      = CC_INITWINDOW;
+    cc->ssthresh  = maxwindow;
+    cc->ops->init(cc);
+
+    return(0);
+}
+
+/* acked new packets were cumulatively ACKed */
+void cc_ack(gbn_cc *cc, uint32_t acked)
+{
+    cc->ops->ack(cc, acked);
+    if (cc->cwnd > cc->maxwindow)
+        cc->cwnd = cc->maxwindow;
+}
+
+/* Loss detected through duplicate ACKs with inflight packets outstanding */
+void cc_loss(gbn_cc *cc, uint32_t inflight)
+{
+    cc->ops->loss(cc, inflight);
+}
+
+/* Retransmission timeout: back to slow start from a window of one packet */
+void cc_timeout(gbn_cc *cc, uint32_t inflight)
+{
+    cc->ssthresh = inflight / 2.0;
+    if (cc->ssthresh < CC_MINSSTHRESH)
+        cc->ssthresh = CC_MINSSTHRESH;
+    cc->wmax = cc->cwnd;
+    cc->cwnd = 1;
+    cc->epochvalid = 0;
+}
+
+/* Number of packets the window currently allows in flight */
+int cc_window(const gbn_cc *cc)
+{
+    int window = (int)cc->cwnd;
+
+    if (window < 1)
+        window = 1;
+    if (window > cc->maxwindow)
+        window = cc->maxwindow;
+    return window;
+}
@@ -0,0 +1,59 @@
+#ifndef _gbn_cc_h
+#define _gbn_cc_h
+
+/*----- struct timespec needs POSIX interfaces when compiling with -ansi -----*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include<stdint.h>
+#include<time.h>
+
+/*----- Congestion control algorithms (see GBN_CONGESTION) -----*/
+#define GBN_CC_RENO    0    /* Slow start + AIMD congestion avoidance      */
+#define GBN_CC_CUBIC   1    /* Slow start + CUBIC window growth            */
+
+/*----- Congestion control parameters -----*/
+#define CC_INITWINDOW  2    /* Initial congestion window (in packets)      */
+#define CC_MINSSTHRESH 2    /* Smallest slow start threshold (in packets)  */
+#define CC_DUPACKS     3    /* Duplicate ACKs that trigger fast retransmit */
+#define CUBIC_C      0.4    /* CUBIC scaling constant                      */
+#define CUBIC_BETA   0.7    /* CUBIC multiplicative decrease factor        */
+#define CUBIC_PROBE  0.01   /* CUBIC growth per window once cwnd is past   */
+                            /* its target (in packets), see cubic_ack      */
+
+struct gbn_cc;
+
+/*----- Congestion control algorithm -----*/
+/* Every algorithm shares slow start and the slow start threshold; they  */
+/* differ in how the window grows above ssthresh and how much it shrinks */
+/* when a loss is detected through duplicate ACKs.                       */
+typedef struct gbn_ccops {
+    const char *name;
+    void (*init)(struct gbn_cc *cc);                    /* Start of a connection      */
+    void (*ack)(struct gbn_cc *cc, uint32_t acked);     /* New packets were ACKed     */
+    void (*loss)(struct gbn_cc *cc, uint32_t inflight); /* Fast retransmit triggered  */
+} gbn_ccops;
+
+/*----- Congestion control state -----*/
+typedef struct gbn_cc {
+    const gbn_ccops *ops;       /* Selected algorithm                         */
+    double cwnd;                /* Congestion window (in packets)             */
+    double ssthresh;            /* Slow start threshold (in packets)          */
+    int maxwindow;              /* Upper bound for cwnd                       */
+
+    /* CUBIC */
+    double wmax;                /* Window before the last reduction           */
+    double k;                   /* Time to grow back to wmax (in seconds)     */
+    double westimate;           /* Reno-equivalent window (TCP friendliness)  */
+    struct timespec epoch;      /* Start of the current growth epoch          */
+    int epochvalid;             /* Whether epoch has been set                 */
+} gbn_cc;
+
+int cc_init(gbn_cc *cc, int algorithm, int maxwindow);
+void cc_ack(gbn_cc *cc, uint32_t acked);
+void cc_loss(gbn_cc *cc, uint32_t inflight);
+void cc_timeout(gbn_cc *cc, uint32_t inflight);
+int cc_window(const gbn_cc *cc);
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "gbn_cookie.h"
+#include<pthread.h>
+#include<string.h>
+#include<time.h>
+#include<unistd.h>
+#include<sys/random.h>
+
+#define COOKIE_MAXADDR 128        /* Longest address hashed (sockaddr_storage) */
+
+static uint64_t key[2];                  /* SipHash key                     */
+static pthread_once_t keyonce = PTHREAD_ONCE_INIT;
+
+/*----- SipHash-2-4 -----*/
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v0, v1, v2, v3) do {                                   \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32);           \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;                              \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;                              \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32);           \
+} while (0)
+
+/* Read a 64-bit little-endian word */
+static uint64_t load64(const uint8_t *p)
+{
+    uint64_t x = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)
+        x = (x << 8) | p[i];
+    return x;
+}
+
+/* SipHash-2-4 of the len bytes of buf under key */
+static uint64_t siphash(const uint8_t *buf, size_t len)
+{
+    uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+    uint64_t m;
+    uint8_t last[8];
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8){
+        m = load64(buf + i);
+        v3 ^= m;
+        SIPROUND(v0, v1, v2, v3);
+        SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    /* The last word holds the leftover bytes and the length */
+    memset(last, 0, sizeof(last));
+    memcpy(last, buf + i, len - i);
+    last[7] = (uint8_t)len;
+    m = load64(last);
+    v3 ^= m;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= m;
+
+    v2 ^= 0xff;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/*----- Cookies -----*/
+
+/* Draw the key. Without getrandom, the clock and pid are a weak fallback. */
+static void key_init(void)
+{
+    struct timespec ts;
+
+    if (getrandom(key, sizeof(key), 0) == (ssize_t)sizeof(key))
+        return;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    key[0] = ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec;
+    key[1] = ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)&ts;
+}
+
+/* Current epoch, counted on the monotonic clock */
+static uint32_t epoch(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec / COOKIE_PERIOD);
+}
+
+/* MAC of a client's address and seqnum in the given epoch */
+static uint32_t cookie_mac(const void *addr, size_t addrlen, uint32_t seqnum, uint32_t when)
+{
+    uint8_t buf[COOKIE_MAXADDR + 2 * sizeof(uint32_t)];
+
+    pthread_once(&keyonce, key_init);
+
+    if (addrlen > COOKIE_MAXADDR)
+        addrlen = COOKIE_MAXADDR;
+    memcpy(buf, addr, addrlen);
+    memcpy(buf + addrlen, &seqnum, sizeof(seqnum));
+    memcpy(buf + addrlen + sizeof(seqnum), &when, sizeof(when));
+
+    return (uint32_t)siphash(buf, addrlen + 2 * sizeof(uint32_t));
+}
+
+/* Make the cookie of the SYN with the given seqnum from addr. */
+/* Returns the cookie.                                        */
+uint32_t cookie_make(const void *addr, size_t addrlen, uint32_t seqnum)
+{
+    return cookie_mac(addr, addrlen, seqnum, epoch());
+}
+
+/* Check the cookie echoed by the ACK with the given seqnum from addr, */
+/* made in this epoch or the previous one.                            */
+/* Returns 1 if it is valid, 0 otherwise.                             */
+int cookie_check(const void *addr, size_t addrlen, uint32_t seqnum, uint32_t cookie)
+{
+    uint32_t now = epoch();
+
+    return cookie == cookie_mac(addr, addrlen, seqnum, now) ||
+           cookie == cookie_mac(addr, addrlen, seqnum, now - 1);
+}
@@ -0,0 +1,21 @@
+#ifndef _gbn_cookie_h
+#define _gbn_cookie_h
+
+#include<stdint.h>
+#include<stddef.h>
+
+/*----- Cookie parameters -----*/
+#define COOKIE_PERIOD  30         /* Seconds per cookie epoch: a cookie is     */
+                                  /* valid until the end of the next epoch     */
+
+/*----- SYN cookies -----*/
+/* A listening socket answers a SYN with a cookie instead of keeping any */
+/* state for it: a MAC (SipHash-2-4 under a per-process random key) of   */
+/* the client's address and initial seqnum and of the current epoch. The */
+/* client echoes it in the ACK that ends the handshake, which proves it  */
+/* received the SYNACK at that address; only then is the connection      */
+/* queued for gbn_accept.                                                */
+uint32_t cookie_make(const void *addr, size_t addrlen, uint32_t seqnum);
+int cookie_check(const void *addr, size_t addrlen, uint32_t seqnum, uint32_t cookie);
+
+#endif
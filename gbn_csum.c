@@ -0,0 +1,331 @@
+#include "gbn_csum.h"
+#include<pthread.h>
+#include<string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include<immintrin.h>
+#define CSUM_X86
+#endif
+
+#define CRC32C_POLY  0x82f63b78   /* Castagnoli polynomial, bit-reflected     */
+#define CRC32C_BLOCK 256          /* Bytes per stream in the SSE4.2 3-way loop */
+
+/*----- Shared helpers -----*/
+
+/* Fold a 64-bit sum of 16-bit words into 32 bits. 2^32 = 1 (mod 2^16 - 1), */
+/* so the end-around carry keeps the one's complement sum unchanged.        */
+static uint32_t fold64(uint64_t sum)
+{
+    sum = (sum >> 32) + (sum & 0xffffffff);
+    sum = (sum >> 32) + (sum & 0xffffffff);
+    return (uint32_t)sum;
+}
+
+/*----- Portable: 32 bits at a time into a 64-bit accumulator -----*/
+/* Adding a 32-bit word adds its two 16-bit halves, whatever the byte  */
+/* order, and the accumulator cannot overflow below 2^32 words.        */
+
+static uint64_t sum_words(const uint8_t *buf, size_t len)
+{
+    uint64_t sum = 0;
+    uint32_t word32;
+    uint16_t word16;
+
+    for (; len >= 4; len -= 4, buf += 4){
+        memcpy(&word32, buf, sizeof(word32));
+        sum += word32;
+    }
+    if (len >= 2){
+        memcpy(&word16, buf, sizeof(word16));
+        sum += word16;
+    }
+    return sum;
+}
+
+#ifdef CSUM_X86
+
+/*----- SSE2: 16 bytes at a time -----*/
+/* Each 32-bit lane adds its two 16-bit words. A lane grows by less than */
+/* 2^17 per block, so the lanes are flushed every 2^14 blocks.           */
+
+__attribute__((target("sse2")))
+static uint64_t sum_sse2(const uint8_t *buf, size_t len)
+{
+    const __m128i mask = _mm_set1_epi32(0xffff);
+    uint32_t lanes[4];
+    uint64_t sum = 0;
+    size_t blocks;
+    __m128i acc;
+    __m128i v;
+
+    while (len >= 16){
+        acc = _mm_setzero_si128();
+        for (blocks = 0; len >= 16 && blocks < 16384; blocks++, len -= 16, buf += 16){
+            v   = _mm_loadu_si128((const __m128i *)(const void *)buf);
+            acc = _mm_add_epi32(acc, _mm_and_si128(v, mask));
+            acc = _mm_add_epi32(acc, _mm_srli_epi32(v, 16));
+        }
+        _mm_storeu_si128((__m128i *)(void *)lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    return sum + sum_words(buf, len);
+}
+
+/*----- AVX2: 32 bytes at a time -----*/
+
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(const uint8_t *buf, size_t len)
+{
+    const __m256i mask = _mm256_set1_epi32(0xffff);
+    uint32_t lanes[8];
+    uint64_t sum = 0;
+    size_t blocks;
+    __m256i acc;
+    __m256i v;
+    int i;
+
+    while (len >= 32){
+        acc = _mm256_setzero_si256();
+        for (blocks = 0; len >= 32 && blocks < 16384; blocks++, len -= 32, buf += 32){
+            v   = _mm256_loadu_si256((const __m256i *)(const void *)buf);
+            acc = _mm256_add_epi32(acc, _mm256_and_si256(v, mask));
+            acc = _mm256_add_epi32(acc, _mm256_srli_epi32(v, 16));
+        }
+        _mm256_storeu_si256((__m256i *)(void *)lanes, acc);
+        for (i = 0; i < 8; i++)
+            sum += lanes[i];
+    }
+
+    return sum + sum_sse2(buf, len);
+}
+
+#endif
+
+/*----- Runtime dispatch -----*/
+
+/* Sum of the 16-bit words of buf (len rounded down to even), set once */
+/* by sum_detect before any thread uses it                             */
+static uint64_t (*sum_impl)(const uint8_t *buf, size_t len);
+static pthread_once_t sum_once = PTHREAD_ONCE_INIT;
+
+/* Pick the implementation, on first use */
+static void sum_detect(void)
+{
+    uint64_t (*impl)(const uint8_t *buf, size_t len) = sum_words;
+
+#ifdef CSUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        impl = sum_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        impl = sum_sse2;
+#endif
+    sum_impl = impl;
+}
+
+/*----- CRC32C: portable slicing-by-8 -----*/
+/* All CRC helpers work on the raw shift register: crc32c() applies the */
+/* initial and final inversion.                                          */
+
+static uint32_t crc_table[8][256];
+
+static void crc_init_table(void)
+{
+    uint32_t crc;
+    int n;
+    int k;
+
+    for (n = 0; n < 256; n++){
+        crc = n;
+        for (k = 0; k < 8; k++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc_table[0][n] = crc;
+    }
+    for (n = 0; n < 256; n++){
+        crc = crc_table[0][n];
+        for (k = 1; k < 8; k++){
+            crc = crc_table[0][crc & 0xff] ^ (crc >> 8);
+            crc_table[k][n] = crc;
+        }
+    }
+}
+
+static uint32_t crc_sw(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    for (; len >= 8; len -= 8, buf += 8){
+        crc ^= (uint32_t)buf[0] | (uint32_t)buf[1] << 8 | (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24;
+        crc = crc_table[7][crc & 0xff] ^ crc_table[6][(crc >> 8) & 0xff] ^
+              crc_table[5][(crc >> 16) & 0xff] ^ crc_table[4][crc >> 24] ^
+              crc_table[3][buf[4]] ^ crc_table[2][buf[5]] ^
+              crc_table[1][buf[6]] ^ crc_table[0][buf[7]];
+    }
+    for (; len > 0; len--, buf++)
+        crc = crc_table[0][(crc ^ *buf) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef CSUM_X86
+
+/*----- CRC32C: SSE4.2 crc32 instruction -----*/
+/* The instruction has a latency of 3 cycles but a throughput of 1, so  */
+/* three streams of CRC32C_BLOCK bytes are computed side by side. The   */
+/* register is linear, so the CRC of A followed by B is the CRC of A    */
+/* shifted through |B| zero bytes, xored with the CRC of B alone; the   */
+/* shift is looked up one byte at a time in crc_shift.                  */
+
+static uint32_t crc_shift[4][256];
+
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw_serial(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    uint32_t word32;
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    uint64_t word64;
+
+    for (; len >= 8; len -= 8, buf += 8){
+        memcpy(&word64, buf, sizeof(word64));
+        crc64 = _mm_crc32_u64(crc64, word64);
+    }
+    crc = (uint32_t)crc64;
+#endif
+
+    for (; len >= 4; len -= 4, buf += 4){
+        memcpy(&word32, buf, sizeof(word32));
+        crc = _mm_crc32_u32(crc, word32);
+    }
+    for (; len > 0; len--, buf++)
+        crc = _mm_crc32_u8(crc, *buf);
+    return crc;
+}
+
+/* CRC register shifted through CRC32C_BLOCK zero bytes */
+static uint32_t crc_shift_block(uint32_t crc)
+{
+    return crc_shift[0][crc & 0xff] ^ crc_shift[1][(crc >> 8) & 0xff] ^
+           crc_shift[2][(crc >> 16) & 0xff] ^ crc_shift[3][crc >> 24];
+}
+
+static void crc_init_shift(void)
+{
+    static const uint8_t zeros[CRC32C_BLOCK];
+    int n;
+    int k;
+
+    for (k = 0; k < 4; k++)
+        for (n = 0; n < 256; n++)
+            crc_shift[k][n] = crc_hw_serial((uint32_t)n << (8 * k), zeros, CRC32C_BLOCK);
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const uint8_t *buf, size_t len)
+{
+#ifdef __x86_64__
+    uint64_t crc0;
+    uint64_t crc1;
+    uint64_t crc2;
+    uint64_t word;
+    const uint8_t *end;
+
+    while (len >= 3 * CRC32C_BLOCK){
+        crc0 = crc;
+        crc1 = 0;
+        crc2 = 0;
+        for (end = buf + CRC32C_BLOCK; buf < end; buf += 8){
+            memcpy(&word, buf, sizeof(word));
+            crc0 = _mm_crc32_u64(crc0, word);
+            memcpy(&word, buf + CRC32C_BLOCK, sizeof(word));
+            crc1 = _mm_crc32_u64(crc1, word);
+            memcpy(&word, buf + 2 * CRC32C_BLOCK, sizeof(word));
+            crc2 = _mm_crc32_u64(crc2, word);
+        }
+        crc = crc_shift_block((uint32_t)crc0) ^ (uint32_t)crc1;
+        crc = crc_shift_block(crc) ^ (uint32_t)crc2;
+        buf += 2 * CRC32C_BLOCK;
+        len -= 3 * CRC32C_BLOCK;
+    }
+#endif
+    return crc_hw_serial(crc, buf, len);
+}
+
+#endif
+
+/*----- CRC32C runtime dispatch -----*/
+
+/* Set once by crc_detect, after the tables it needs are built */
+static uint32_t (*crc_impl)(uint32_t crc, const uint8_t *buf, size_t len);
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/* Build the tables and pick the implementation, on first use */
+static void crc_detect(void)
+{
+    crc_init_table();
+#ifdef CSUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")){
+        crc_init_shift();
+        crc_impl = crc_hw;
+        return;
+    }
+#endif
+    crc_impl = crc_sw;
+}
+
+/*----- Interface used by gbn.c -----*/
+
+/* Return checksum for buf */
+uint16_t checksum(uint16_t *buf, int nwords)
+{
+    return checksum_fold(checksum_add(0, (const uint8_t *)buf, (size_t)nwords * sizeof(uint16_t)));
+}
+
+/* Add len bytes of buf to a running one's complement sum, so that a packet */
+/* can be checksummed piece by piece. Every piece but the last must have an */
+/* even length; an odd trailing byte is padded with zero.                   */
+uint32_t checksum_add(uint32_t sum, const uint8_t *buf, size_t len)
+{
+    uint64_t total = sum;
+    uint16_t word;
+
+    pthread_once(&sum_once, sum_detect);
+    total += sum_impl(buf, len);
+    if (len % 2 != 0){
+        word = 0;
+        memcpy(&word, buf + len - 1, 1);
+        total += word;
+    }
+    return fold64(total);
+}
+
+/* Return the checksum for a running sum */
+uint16_t checksum_fold(uint32_t sum)
+{
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += (sum >> 16);
+    return ~sum;
+}
+
+/* HC' = ~(~HC + ~m + m') over each 16-bit word m of the field */
+uint16_t checksum_update(uint16_t check, const void *old, const void *new, size_t len)
+{
+    const uint8_t *o = old;
+    const uint8_t *n = new;
+    uint32_t sum = (uint16_t)~check;
+    uint16_t word;
+
+    for (; len > 1; len -= 2, o += 2, n += 2){
+        memcpy(&word, o, sizeof(word));
+        sum += (uint16_t)~word;
+        memcpy(&word, n, sizeof(word));
+        sum += word;
+    }
+    return checksum_fold(sum);
+}
+
+/* Continue the CRC32C of a byte stream with len more bytes; start with 0 */
+uint32_t crc32c(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    pthread_once(&crc_once, crc_detect);
+    return ~crc_impl(~crc, buf, len);
+}
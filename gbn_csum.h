@@ -0,0 +1,29 @@
+#ifndef _gbn_csum_h
+#define _gbn_csum_h
+
+#include<stdint.h>
+#include<stddef.h>
+
+/*----- Internet checksum (RFC 1071) -----*/
+/* The sum of the 16-bit words of a packet is built with checksum_add,   */
+/* which picks the widest implementation the CPU supports (AVX2, SSE2 or */
+/* portable 64-bit) the first time it runs, and checksum_fold turns it   */
+/* into the checksum. A packet whose checksum field is correct sums to   */
+/* a checksum of 0.                                                      */
+uint16_t checksum(uint16_t *buf, int nwords);
+uint32_t checksum_add(uint32_t sum, const uint8_t *buf, size_t len);
+uint16_t checksum_fold(uint32_t sum);
+
+/* Incremental update (RFC 1624, eqn. 3) of a checksum after the len      */
+/* bytes of a 16-bit aligned field change from old to new, e.g. the       */
+/* seqnum of a resent ACK. len must be even.                              */
+uint16_t checksum_update(uint16_t check, const void *old, const void *new, size_t len);
+
+/*----- CRC32C (Castagnoli, as in iSCSI and SCTP) -----*/
+/* Detects every burst of up to 32 bits and all errors of up to 5 bits */
+/* in a full-size packet, where the 16-bit sum misses e.g. any pair of */
+/* flips in the same bit of two words. Uses the SSE4.2 crc32           */
+/* instruction when the CPU has it, a slicing-by-8 table otherwise.    */
+uint32_t crc32c(uint32_t crc, const uint8_t *buf, size_t len);
+
+#endif
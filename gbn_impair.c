@@ -0,0 +1,504 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "gbn_impair.h"
+#include<errno.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include<unistd.h>
+
+#define IMPAIR_MAXDGRAM 65536     /* Room for any UDP datagram                */
+
+/*----- Shared helpers -----*/
+
+/* Current time of the monotonic clock in microseconds (as now_us) */
+static uint64_t clock_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Next output of the generator (splitmix64) */
+static uint64_t next_rand(gbn_impdir *d)
+{
+    uint64_t z = (d->rng += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Uniform double in [0, 1) */
+static double uniform(gbn_impdir *d)
+{
+    return (next_rand(d) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Whether an event of probability p happens. Draws nothing when p is 0, */
+/* so turning an impairment off leaves the others' sequence unchanged.   */
+static int chance(gbn_impdir *d, double p)
+{
+    return p > 0 && uniform(d) < p;
+}
+
+/* Decide whether the next packet is lost: step the Gilbert-Elliott chain, */
+/* then draw the loss of its state and the independent loss.               */
+static int lost(const gbn_impair *conf, gbn_impdir *d)
+{
+    int drop = 0;
+
+    if (conf->ge_p > 0){
+        if (d->bad ? chance(d, conf->ge_r) : chance(d, conf->ge_p))
+            d->bad = !d->bad;
+        drop = chance(d, d->bad ? conf->ge_bad : conf->ge_good);
+    }
+
+    return chance(d, conf->loss) || drop;
+}
+
+/* Flip one random bit of a packet */
+static void corrupt(gbn_impdir *d, uint8_t *buf, size_t len)
+{
+    uint64_t bit;
+
+    if (len == 0)
+        return;
+    bit = next_rand(d) % (len * 8);
+    buf[bit / 8] ^= (uint8_t)(1 << (bit % 8));
+}
+
+/*----- Queue of held packets: a binary heap on (release, order) -----*/
+
+static int held_before(const gbn_held *a, const gbn_held *b)
+{
+    return a->release < b->release || (a->release == b->release && a->order < b->order);
+}
+
+static void heap_push(gbn_impstate *im, gbn_held *h)
+{
+    int i = im->nheld++;
+
+    while (i > 0 && held_before(h, im->queue[(i - 1) / 2])){
+        im->queue[i] = im->queue[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    im->queue[i] = h;
+}
+
+static gbn_held *heap_pop(gbn_impstate *im)
+{
+    gbn_held *top = im->queue[0];
+    gbn_held *last = im->queue[--im->nheld];
+    int i = 0;
+    int child;
+
+    while ((child = 2 * i + 1) < im->nheld){
+        if (child + 1 < im->nheld && held_before(im->queue[child + 1], im->queue[child]))
+            child++;
+        if (!held_before(im->queue[child], last))
+            break;
+        im->queue[i] = im->queue[child];
+        i = child;
+    }
+    if (im->nheld > 0)
+        im->queue[i] = last;
+
+    return top;
+}
+
+/* Hold a copy of a received datagram until the simulated path delivers it. */
+/* Returns 0, or -1 if it was dropped (queue full or no memory).            */
+static int hold(gbn_impstate *im, const uint8_t *buf, size_t len, const struct sockaddr_storage *from, socklen_t fromlen, uint64_t now)
+{
+    gbn_held *h;
+    uint64_t release = now;
+    uint8_t *data;
+
+    if (im->nheld >= im->conf.limit)
+        return(-1);
+
+    /* The link sends one packet at a time at the configured rate */
+    if (im->conf.rate > 0){
+        if (im->linkfree < now)
+            im->linkfree = now;
+        im->linkfree += (uint64_t)len * 1000000 / im->conf.rate;
+        release = im->linkfree;
+    }
+
+    /* Jitter never lets a packet overtake the one before it: only */
+    /* reordered packets leave the line                            */
+    release += im->conf.delay;
+    if (im->conf.jitter > 0)
+        release += next_rand(&im->rx) % (im->conf.jitter + 1);
+    if (chance(&im->rx, im->conf.reorder))
+        release += im->conf.gap;
+    else {
+        if (release < im->lastrelease)
+            release = im->lastrelease;
+        im->lastrelease = release;
+    }
+
+    if ((h = im->free) != NULL)
+        im->free = h->next;
+    else if ((h = calloc(1, sizeof(gbn_held))) == NULL)
+        return(-1);
+
+    if (h->cap < len){
+        if ((data = realloc(h->data, len)) == NULL){
+            h->next  = im->free;
+            im->free = h;
+            return(-1);
+        }
+        h->data = data;
+        h->cap  = len;
+    }
+
+    memcpy(h->data, buf, len);
+    memcpy(&h->from, from, fromlen);
+    h->len     = len;
+    h->fromlen = fromlen;
+    h->release = release;
+    h->order   = im->arrivals++;
+    heap_push(im, h);
+
+    return(0);
+}
+
+/*----- Configuration -----*/
+
+/* Parse a number with an optional unit suffix. Times are in microseconds */
+/* ("ms" and "s" scale them), rates in bytes per second ("k", "m" and "g" */
+/* scale them by powers of 1000). Returns 0, or -1 if it is malformed.    */
+static int parse_num(const char *str, int istime, uint64_t *val)
+{
+    char *end;
+    double num;
+    double scale;
+
+    errno = 0;
+    num = strtod(str, &end);
+    if (end == str || errno != 0 || num < 0)
+        return(-1);
+
+    if (*end == '\0' || (istime && strcmp(end, "us") == 0))
+        scale = 1;
+    else if (istime && strcmp(end, "ms") == 0)
+        scale = 1e3;
+    else if (istime && strcmp(end, "s") == 0)
+        scale = 1e6;
+    else if (!istime && (*end == 'k' || *end == 'K') && end[1] == '\0')
+        scale = 1e3;
+    else if (!istime && (*end == 'm' || *end == 'M') && end[1] == '\0')
+        scale = 1e6;
+    else if (!istime && (*end == 'g' || *end == 'G') && end[1] == '\0')
+        scale = 1e9;
+    else
+        return(-1);
+
+    *val = (uint64_t)(num * scale);
+    return(0);
+}
+
+/* Parse a probability in [0, 1] */
+static int parse_prob(const char *str, double *val)
+{
+    char *end;
+
+    errno = 0;
+    *val = strtod(str, &end);
+    return (end == str || *end != '\0' || errno != 0 || *val < 0 || *val > 1) ? -1 : 0;
+}
+
+/* Fill conf from a comma-separated list of key=value settings, e.g.   */
+/* "seed=7,loss=0.01,ge=0.01:0.3,delay=20ms,jitter=2ms,rate=10m". Keys: */
+/*   seed     generator seed                                           */
+/*   loss     independent loss probability                             */
+/*   ge       Gilbert-Elliott p:r[:bad[:good]] (loss in bad state 1,   */
+/*            in good state 0 unless given)                            */
+/*   corrupt  bit flip probability                                     */
+/*   dup      duplication probability                                  */
+/*   reorder  reordering probability, gap  its extra delay             */
+/*   delay    fixed delay, jitter  largest random extra delay          */
+/*   rate     link rate in bytes per second                            */
+/*   limit    most packets held at once                                */
+/*   dir      rx, tx or both                                           */
+/* Settings not given are off; dir defaults to rx.                     */
+/* Returns 0, or -1 with errno set to EINVAL if the spec is malformed. */
+int gbn_impair_parse(const char *spec, gbn_impair *conf)
+{
+    char *copy;
+    char *item;
+    char *save;
+    char *val;
+    double ge[4];
+    int n;
+    int ret = 0;
+
+    memset(conf, 0, sizeof(gbn_impair));
+    conf->dir    = IMPAIR_RX;
+    conf->ge_bad = 1;
+    conf->gap    = IMPAIR_GAP;
+    conf->limit  = IMPAIR_LIMIT;
+
+    if ((copy = strdup(spec)) == NULL)
+        return(-1);
+
+    for (item = strtok_r(copy, ",", &save); item != NULL && ret == 0; item = strtok_r(NULL, ",", &save)){
+        if ((val = strchr(item, '=')) == NULL){
+            ret = -1;
+            break;
+        }
+        *val++ = '\0';
+
+        if (strcmp(item, "seed") == 0)
+            conf->seed = strtoull(val, NULL, 0);
+        else if (strcmp(item, "loss") == 0)
+            ret = parse_prob(val, &conf->loss);
+        else if (strcmp(item, "corrupt") == 0)
+            ret = parse_prob(val, &conf->corrupt);
+        else if (strcmp(item, "dup") == 0)
+            ret = parse_prob(val, &conf->duplicate);
+        else if (strcmp(item, "reorder") == 0)
+            ret = parse_prob(val, &conf->reorder);
+        else if (strcmp(item, "ge") == 0){
+            ge[2] = 1;
+            ge[3] = 0;
+            n = sscanf(val, "%lf:%lf:%lf:%lf", &ge[0], &ge[1], &ge[2], &ge[3]);
+            if (n < 2 || ge[0] <= 0 || ge[0] > 1 || ge[1] < 0 || ge[1] > 1 ||
+                ge[2] < 0 || ge[2] > 1 || ge[3] < 0 || ge[3] > 1)
+                ret = -1;
+            conf->ge_p    = ge[0];
+            conf->ge_r    = ge[1];
+            conf->ge_bad  = ge[2];
+            conf->ge_good = ge[3];
+        }
+        else if (strcmp(item, "gap") == 0)
+            ret = parse_num(val, 1, &conf->gap);
+        else if (strcmp(item, "delay") == 0)
+            ret = parse_num(val, 1, &conf->delay);
+        else if (strcmp(item, "jitter") == 0)
+            ret = parse_num(val, 1, &conf->jitter);
+        else if (strcmp(item, "rate") == 0)
+            ret = parse_num(val, 0, &conf->rate);
+        else if (strcmp(item, "limit") == 0)
+            ret = ((conf->limit = atoi(val)) > 0) ? 0 : -1;
+        else if (strcmp(item, "dir") == 0){
+            if (strcmp(val, "rx") == 0)
+                conf->dir = IMPAIR_RX;
+            else if (strcmp(val, "tx") == 0)
+                conf->dir = IMPAIR_TX;
+            else if (strcmp(val, "both") == 0)
+                conf->dir = IMPAIR_RX | IMPAIR_TX;
+            else
+                ret = -1;
+        }
+        else
+            ret = -1;
+    }
+
+    free(copy);
+    if (ret == -1)
+        errno = EINVAL;
+    return ret;
+}
+
+/*----- Impairment state -----*/
+
+/* Set up the state of a socket for conf, which is copied.     */
+/* Returns NULL with errno set if conf is invalid or memory is */
+/* exhausted.                                                  */
+gbn_impstate *impair_new(const gbn_impair *conf)
+{
+    gbn_impstate *im;
+    struct timespec ts;
+
+    if (conf->limit <= 0 || (conf->dir & ~(IMPAIR_RX | IMPAIR_TX)) != 0){
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ((im = calloc(1, sizeof(gbn_impstate))) == NULL)
+        return NULL;
+    im->conf    = *conf;
+    im->maxheld = conf->limit;
+    if ((im->queue = malloc(im->maxheld * sizeof(gbn_held *))) == NULL ||
+        (im->rx.scratch = malloc(IMPAIR_MAXDGRAM)) == NULL ||
+        (im->tx.scratch = malloc(IMPAIR_MAXDGRAM)) == NULL){
+        impair_free(im);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* Without a seed every socket gets its own sequence */
+    im->rx.rng = conf->seed;
+    if (im->rx.rng == 0){
+        clock_gettime(CLOCK_REALTIME, &ts);
+        im->rx.rng = ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) ^ ((uint64_t)getpid() << 32) ^ (uint64_t)(size_t)im;
+    }
+    im->tx.rng = next_rand(&im->rx);
+
+    return im;
+}
+
+/* Release the state and every packet still held */
+void impair_free(gbn_impstate *im)
+{
+    gbn_held *h;
+
+    if (im == NULL)
+        return;
+
+    while (im->nheld > 0){
+        h = heap_pop(im);
+        h->next  = im->free;
+        im->free = h;
+    }
+    while ((h = im->free) != NULL){
+        im->free = h->next;
+        free(h->data);
+        free(h);
+    }
+    free(im->queue);
+    free(im->rx.scratch);
+    free(im->tx.scratch);
+    free(im);
+}
+
+/* When the next held packet is due (us), or 0 if none is held */
+uint64_t impair_next(const gbn_impstate *im)
+{
+    return (im->nheld > 0) ? im->queue[0]->release : 0;
+}
+
+/* Move every datagram waiting in the kernel onto the simulated path,     */
+/* which loses, corrupts, duplicates and holds them back.                 */
+/* Returns the number read, or -1 with errno set on a socket error other  */
+/* than EAGAIN.                                                           */
+int impair_pull(gbn_impstate *im, int fd)
+{
+    struct sockaddr_storage from;
+    socklen_t fromlen;
+    ssize_t len;
+    uint64_t now = clock_us();
+    int n = 0;
+
+    while (1){
+        fromlen = sizeof(from);
+        if ((len = recvfrom(fd, im->rx.scratch, IMPAIR_MAXDGRAM, MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen)) == -1){
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return n;
+            if (errno == EINTR)
+                continue;
+            return (n > 0) ? n : -1;
+        }
+        n++;
+
+        if (lost(&im->conf, &im->rx))
+            continue;
+        if (chance(&im->rx, im->conf.corrupt))
+            corrupt(&im->rx, im->rx.scratch, len);
+        hold(im, im->rx.scratch, len, &from, fromlen, now);
+        if (chance(&im->rx, im->conf.duplicate))
+            hold(im, im->rx.scratch, len, &from, fromlen, now);
+    }
+}
+
+/* Deliver up to vlen held packets that are due into msgs, as recvmmsg    */
+/* would. Returns the number delivered, 0 if none is due yet.             */
+int impair_recvmmsg(gbn_impstate *im, struct mmsghdr *msgs, unsigned int vlen)
+{
+    struct msghdr *hdr;
+    gbn_held *h;
+    uint64_t now = clock_us();
+    size_t off;
+    size_t n;
+    unsigned int i;
+    unsigned int count = 0;
+
+    while (count < vlen && im->nheld > 0 && im->queue[0]->release <= now){
+        h   = heap_pop(im);
+        hdr = &msgs[count].msg_hdr;
+
+        /* Scatter the datagram over the iovecs */
+        for (i = 0, off = 0; i < hdr->msg_iovlen && off < h->len; i++){
+            n = h->len - off;
+            if (n > hdr->msg_iov[i].iov_len)
+                n = hdr->msg_iov[i].iov_len;
+            memcpy(hdr->msg_iov[i].iov_base, h->data + off, n);
+            off += n;
+        }
+        hdr->msg_flags = (off < h->len) ? MSG_TRUNC : 0;
+        if (hdr->msg_name != NULL){
+            memcpy(hdr->msg_name, &h->from, (hdr->msg_namelen < h->fromlen) ? hdr->msg_namelen : h->fromlen);
+            hdr->msg_namelen = h->fromlen;
+        }
+        hdr->msg_controllen = 0;
+        msgs[count++].msg_len = off;
+
+        h->next  = im->free;
+        im->free = h;
+    }
+
+    return count;
+}
+
+/* Send a message through the simulated path, which may lose, corrupt or */
+/* duplicate it. A corrupted packet is a copy: the caller's buffers,     */
+/* e.g. the send ring, stay intact. Returns as sendmsg.                  */
+static ssize_t send_one(gbn_impstate *im, int fd, struct msghdr *hdr, int flags)
+{
+    struct msghdr copy;
+    struct iovec iov;
+    size_t len = 0;
+    size_t i;
+    ssize_t ret;
+
+    for (i = 0; i < hdr->msg_iovlen; i++)
+        len += hdr->msg_iov[i].iov_len;
+    if (lost(&im->conf, &im->tx))
+        return len;
+
+    if (chance(&im->tx, im->conf.corrupt) && len <= IMPAIR_MAXDGRAM){
+        for (i = 0, len = 0; i < hdr->msg_iovlen; i++){
+            memcpy(im->tx.scratch + len, hdr->msg_iov[i].iov_base, hdr->msg_iov[i].iov_len);
+            len += hdr->msg_iov[i].iov_len;
+        }
+        corrupt(&im->tx, im->tx.scratch, len);
+        copy = *hdr;
+        iov.iov_base = im->tx.scratch;
+        iov.iov_len  = len;
+        copy.msg_iov    = &iov;
+        copy.msg_iovlen = 1;
+        hdr = &copy;
+    }
+
+    if ((ret = sendmsg(fd, hdr, flags)) != -1 && chance(&im->tx, im->conf.duplicate))
+        sendmsg(fd, hdr, flags);
+
+    return ret;
+}
+
+/* Send vlen messages through the simulated path, as sendmmsg would.   */
+/* Without loss, corruption or duplication they go out in one call;    */
+/* otherwise one by one. Lost messages count as sent.                  */
+int impair_sendmmsg(gbn_impstate *im, int fd, struct mmsghdr *msgs, unsigned int vlen, int flags)
+{
+    unsigned int i;
+    ssize_t ret;
+
+    if (im->conf.loss == 0 && im->conf.ge_p == 0 && im->conf.corrupt == 0 && im->conf.duplicate == 0)
+        return sendmmsg(fd, msgs, vlen, flags);
+
+    for (i = 0; i < vlen; i++){
+        if ((ret = send_one(im, fd, &msgs[i].msg_hdr, flags)) == -1)
+            return (i > 0) ? (int)i : -1;
+        msgs[i].msg_len = ret;
+    }
+
+    return vlen;
+}
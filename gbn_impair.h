@@ -0,0 +1,91 @@
+#ifndef _gbn_impair_h
+#define _gbn_impair_h
+
+#include<stdint.h>
+#include<sys/types.h>
+#include<sys/socket.h>
+
+/*----- Impairment directions -----*/
+#define IMPAIR_RX      0x01 /* Packets the socket receives                   */
+#define IMPAIR_TX      0x02 /* Packets it sends (loss, corruption and        */
+                            /* duplication only: nothing is held back)       */
+
+/*----- Impairment parameters -----*/
+#define IMPAIR_LIMIT   1000 /* Default most packets held back at once        */
+#define IMPAIR_GAP     1000 /* Default extra delay of a reordered packet (us) */
+
+/*----- Simulated path (see GBN_IMPAIR) -----*/
+/* Every decision comes from a per-socket generator started from seed, so */
+/* a run can be repeated exactly. A packet is first lost (independently   */
+/* with probability loss, and through the Gilbert-Elliott chain if ge_p   */
+/* is set), then possibly corrupted (one bit flipped) and duplicated. A   */
+/* received packet then waits for the link, which carries rate bytes per  */
+/* second, and for delay plus a uniform 0..jitter microseconds, but never */
+/* leaves before the packet ahead of it; with probability reorder it      */
+/* waits gap more instead, letting later packets pass it. Packets beyond  */
+/* limit held at once are dropped (tail drop).                            */
+/* Packets held back are not visible to poll or epoll on the descriptor:  */
+/* gbn_recv only releases them when called or blocking.                   */
+typedef struct gbn_impair {
+    uint64_t seed;              /* Generator seed (0: from the time and pid)   */
+    int dir;                    /* IMPAIR_RX and/or IMPAIR_TX                  */
+    double loss;                /* Independent loss probability                */
+    double ge_p;                /* Gilbert-Elliott: P(good -> bad) per packet  */
+    double ge_r;                /* Gilbert-Elliott: P(bad -> good) per packet  */
+    double ge_bad;              /* Loss probability in the bad state           */
+    double ge_good;             /* Loss probability in the good state          */
+    double corrupt;             /* Probability of flipping one bit             */
+    double duplicate;           /* Probability of delivering a packet twice    */
+    double reorder;             /* Probability of holding a packet back by gap */
+    uint64_t gap;               /* Extra delay of a reordered packet (us)      */
+    uint64_t delay;             /* Fixed one-way delay (us)                    */
+    uint64_t jitter;            /* Largest random extra delay (us)             */
+    uint64_t rate;              /* Link rate in bytes per second (0: no limit) */
+    int limit;                  /* Most packets held back at once              */
+} gbn_impair;
+
+/*----- Packet held back by the simulated path -----*/
+typedef struct gbn_held {
+    uint64_t release;           /* When it is delivered (us)                   */
+    uint64_t order;             /* Arrival order, to break ties                */
+    size_t len;                 /* Datagram length                             */
+    size_t cap;                 /* Size of data                                */
+    uint8_t *data;              /* Datagram                                    */
+    struct sockaddr_storage from;
+    socklen_t fromlen;
+    struct gbn_held *next;      /* Free list                                   */
+} gbn_held;
+
+/*----- Random decisions of one direction -----*/
+/* Each direction has its own generator, chain and scratch buffer, so the */
+/* receive and send paths may run in different threads.                   */
+typedef struct gbn_impdir {
+    uint64_t rng;               /* Generator state (splitmix64)                */
+    int bad;                    /* Gilbert-Elliott chain in the bad state      */
+    uint8_t *scratch;           /* Room for one datagram                       */
+} gbn_impdir;
+
+/*----- Impairment state of a socket -----*/
+typedef struct gbn_impstate {
+    gbn_impair conf;            /* Parameters                                  */
+    gbn_impdir rx;              /* Receive path                                */
+    gbn_impdir tx;              /* Send path                                   */
+    uint64_t linkfree;          /* When the link finishes its last packet (us) */
+    uint64_t lastrelease;       /* Release of the last packet kept in order    */
+    uint64_t arrivals;          /* Packets queued so far                       */
+    gbn_held **queue;           /* Held packets, by release time (a heap)      */
+    int nheld;                  /* Number of held packets                      */
+    int maxheld;                /* Size of queue                               */
+    gbn_held *free;             /* Entries ready for reuse                     */
+} gbn_impstate;
+
+int gbn_impair_parse(const char *spec, gbn_impair *conf);
+
+gbn_impstate *impair_new(const gbn_impair *conf);
+void impair_free(gbn_impstate *im);
+uint64_t impair_next(const gbn_impstate *im);
+int impair_pull(gbn_impstate *im, int fd);
+int impair_recvmmsg(gbn_impstate *im, struct mmsghdr *msgs, unsigned int vlen);
+int impair_sendmmsg(gbn_impstate *im, int fd, struct mmsghdr *msgs, unsigned int vlen, int flags);
+
+#endif
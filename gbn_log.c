@@ -0,0 +1,65 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "gbn_log.h"
+#include<stdarg.h>
+#include<time.h>
+
+int gbn_loglevel = GBN_LOG_WARN;
+
+/* Print a message of the given level */
+void gbn_log(int level, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(level <= GBN_LOG_WARN ? stderr : stdout, fmt, ap);
+    va_end(ap);
+}
+
+/* Set the runtime log level (GBN_LOG_*); levels above GBN_LOG_MAX */
+/* were compiled out and stay silent.                               */
+void gbn_setloglevel(int level)
+{
+    gbn_loglevel = level;
+}
+
+/*----- Packet trace -----*/
+
+static const char *trace_names[TRACE_NEVENTS] = {
+    "DATA_TX", "DATA_RX", "ACK_TX", "ACK_RX", "CTRL_TX", "CTRL_RX",
+    "DUPACK", "FASTREXMIT", "TIMEOUT", "CORRUPT", "OUTOFORDER", "FULL"
+};
+
+static gbn_trace_rec trace_ring[TRACE_SIZE];
+static uint64_t trace_next;     /* Number of records ever written */
+
+/* Append a record, overwriting the oldest one once the ring is full */
+void gbn_trace(int event, int fd, uint32_t seqnum, uint32_t arg)
+{
+    struct timespec ts;
+    gbn_trace_rec *rec;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec = &trace_ring[__sync_fetch_and_add(&trace_next, 1) & (TRACE_SIZE - 1)];
+    rec->time   = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    rec->seqnum = seqnum;
+    rec->arg    = arg;
+    rec->fd     = fd;
+    rec->event  = event;
+}
+
+/* Print the records in the ring, oldest first, one per line */
+void gbn_trace_dump(FILE *out)
+{
+    uint64_t i = (trace_next > TRACE_SIZE) ? trace_next - TRACE_SIZE : 0;
+    gbn_trace_rec *rec;
+
+    for (; i < trace_next; i++){
+        rec = &trace_ring[i & (TRACE_SIZE - 1)];
+        fprintf(out, "%llu.%06llu fd %d %-10s seqnum %u arg %u\n",
+                (unsigned long long)(rec->time / 1000000), (unsigned long long)(rec->time % 1000000),
+                rec->fd, rec->event < TRACE_NEVENTS ? trace_names[rec->event] : "?", rec->seqnum, rec->arg);
+    }
+}
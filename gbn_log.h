@@ -0,0 +1,78 @@
+#ifndef _gbn_log_h
+#define _gbn_log_h
+
+#include<stdint.h>
+#include<stdio.h>
+
+/*----- Log levels (see gbn_setloglevel) -----*/
+#define GBN_LOG_NONE    0   /* Nothing                                      */
+#define GBN_LOG_ERROR   1   /* Failed calls and broken connections          */
+#define GBN_LOG_WARN    2   /* Refused clients                              */
+#define GBN_LOG_INFO    3   /* Connection events and options                */
+#define GBN_LOG_DEBUG   4   /* Every packet, ACK, timeout and retransmission */
+
+/* Messages above GBN_LOG_MAX are compiled out (make LOGLEVEL=4 keeps   */
+/* them all); the others are printed up to the runtime level, which is */
+/* GBN_LOG_WARN unless changed. Errors and warnings go to stderr, the   */
+/* rest to stdout. Arguments are not evaluated for a disabled level.    */
+#ifndef GBN_LOG_MAX
+#define GBN_LOG_MAX     GBN_LOG_INFO
+#endif
+
+extern int gbn_loglevel;
+
+#define GBN_LOG(level, ...) \
+    do { if ((level) <= GBN_LOG_MAX && (level) <= gbn_loglevel) gbn_log(level, __VA_ARGS__); } while (0)
+
+#define LOGERR(...)     GBN_LOG(GBN_LOG_ERROR, __VA_ARGS__)
+#define LOGWARN(...)    GBN_LOG(GBN_LOG_WARN, __VA_ARGS__)
+#define LOGINFO(...)    GBN_LOG(GBN_LOG_INFO, __VA_ARGS__)
+#define LOGDEBUG(...)   GBN_LOG(GBN_LOG_DEBUG, __VA_ARGS__)
+#define LOGERRNO(fn)    LOGERR("%s: %s\n", fn, strerror(errno))
+
+void gbn_log(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void gbn_setloglevel(int level);
+
+/*----- Packet trace -----*/
+/* With GBN_TRACE defined (make TRACE=1), every packet event is written  */
+/* as a fixed-size binary record to an in-memory ring of TRACE_SIZE      */
+/* records, which costs no formatting on the hot path. gbn_trace_dump   */
+/* prints the records still in the ring, oldest first. Without          */
+/* GBN_TRACE, TRACE() compiles to nothing and the ring stays empty.     */
+#define TRACE_SIZE      65536   /* Records kept (a power of 2)          */
+
+/* Events, with the meaning of the seqnum and arg of their record */
+enum gbn_trace_event {
+    TRACE_DATA_TX,      /* DATA sent: seqnum, payload length            */
+    TRACE_DATA_RX,      /* DATA received: seqnum, payload length        */
+    TRACE_ACK_TX,       /* DATAACK sent: seqnum, receive window         */
+    TRACE_ACK_RX,       /* New DATAACK received: seqnum, receive window */
+    TRACE_CTRL_TX,      /* Other packet sent: seqnum, type              */
+    TRACE_CTRL_RX,      /* Other packet received: seqnum, type          */
+    TRACE_DUPACK,       /* Duplicate DATAACK: seqnum, count             */
+    TRACE_FASTREXMIT,   /* Fast retransmit: oldest seqnum, new window   */
+    TRACE_TIMEOUT,      /* Retransmission timeout: oldest seqnum, RTO   */
+    TRACE_CORRUPT,      /* Corrupted packet dropped: 0, length          */
+    TRACE_OUTOFORDER,   /* Out of order packet: seqnum, expected seqnum */
+    TRACE_FULL,         /* DATA dropped, no room: seqnum, window        */
+    TRACE_NEVENTS
+};
+
+typedef struct gbn_trace_rec {
+    uint64_t time;      /* Microseconds since an arbitrary point        */
+    uint32_t seqnum;
+    uint32_t arg;
+    int32_t fd;         /* Socket of the event                          */
+    uint32_t event;     /* enum gbn_trace_event                         */
+} gbn_trace_rec;
+
+#ifdef GBN_TRACE
+#define TRACE(event, fd, seqnum, arg)   gbn_trace(event, fd, seqnum, arg)
+#else
+#define TRACE(event, fd, seqnum, arg)   do { } while (0)
+#endif
+
+void gbn_trace(int event, int fd, uint32_t seqnum, uint32_t arg);
+void gbn_trace_dump(FILE *out);
+
+#endif
@@ -0,0 +1,217 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "gbn_pool.h"
+#include<errno.h>
+#include<pthread.h>
+#include<string.h>
+#include<sys/mman.h>
+
+#define POOL_HUGEPAGE  (2 << 20)  /* Huge page size the reserve is rounded to  */
+
+static gbn_poolclass classes[POOL_CLASSES];
+static size_t reserve = POOL_RESERVE;   /* Address space per class (bytes)  */
+static int poolflags;                   /* GBN_POOL_* flags                 */
+static uint64_t quotadrops;             /* See pool_quotadrop               */
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;  /* Setup only */
+
+/*----- Regions -----*/
+
+/* Reserve the region of a class on its first use. Huge pages are mapped */
+/* up front (MAP_HUGETLB cannot fault in pages it did not reserve); if   */
+/* too few are free, the region asks for transparent huge pages instead. */
+/* Returns 0, or -1 with errno set.                                      */
+static int class_init(gbn_poolclass *c, size_t size)
+{
+    void *base = MAP_FAILED;
+
+    pthread_mutex_lock(&poollock);
+    if (c->base != NULL){
+        pthread_mutex_unlock(&poollock);
+        return(0);
+    }
+
+    c->size  = size;
+    c->nbufs = (reserve / size > UINT32_MAX - 1) ? UINT32_MAX - 1 : (uint32_t)(reserve / size);
+#ifdef MAP_HUGETLB
+    if (poolflags & GBN_POOL_HUGEPAGES){
+        base = mmap(NULL, reserve, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        c->hugepages = (base != MAP_FAILED);
+    }
+#endif
+    if (base == MAP_FAILED)
+        base = mmap(NULL, reserve, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED){
+        pthread_mutex_unlock(&poollock);
+        return(-1);
+    }
+#ifdef MADV_HUGEPAGE
+    if ((poolflags & GBN_POOL_HUGEPAGES) && !c->hugepages)
+        madvise(base, reserve, MADV_HUGEPAGE);
+#endif
+
+    __atomic_store_n(&c->base, (uint8_t *)base, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&poollock);
+    return(0);
+}
+
+/*----- Buffers -----*/
+
+/* Take a cache-line aligned buffer of at least size bytes from the pool. */
+/* Lock-free, except the first time its size class is used.               */
+/* Returns NULL with errno set to ENOMEM if its class is full (or size is */
+/* beyond the largest class).                                             */
+void *pool_get(size_t size)
+{
+    gbn_poolclass *c;
+    uint8_t *base;
+    uint64_t head;
+    uint64_t next;
+    uint32_t link;
+    uint32_t index;
+    uint32_t inuse;
+    uint32_t peak;
+    int shift = POOL_MINSHIFT;
+
+    while (shift <= POOL_MAXSHIFT && ((size_t)1 << shift) < size)
+        shift++;
+    if (shift > POOL_MAXSHIFT){
+        errno = ENOMEM;
+        return NULL;
+    }
+    c = &classes[shift - POOL_MINSHIFT];
+
+    if ((base = __atomic_load_n(&c->base, __ATOMIC_ACQUIRE)) == NULL){
+        if (class_init(c, (size_t)1 << shift) == -1)
+            return NULL;
+        base = c->base;
+    }
+
+    /* Pop the free list. A stale link read from a buffer that another */
+    /* thread just took is harmless: the tag makes the exchange fail.  */
+    head = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+    while ((uint32_t)head != 0){
+        index = (uint32_t)head - 1;
+        memcpy(&link, base + (size_t)index * c->size, sizeof(link));
+        next = (((head >> 32) + 1) << 32) | link;
+        if (__atomic_compare_exchange_n(&c->head, &head, next, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            goto taken;
+    }
+
+    /* Otherwise carve a buffer the region never handed out */
+    index = __atomic_load_n(&c->carved, __ATOMIC_RELAXED);
+    do {
+        if (index >= c->nbufs){
+            __atomic_fetch_add(&c->fails, 1, __ATOMIC_RELAXED);
+            errno = ENOMEM;
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&c->carved, &index, index + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+taken:
+    __atomic_fetch_add(&c->allocs, 1, __ATOMIC_RELAXED);
+    inuse = __atomic_add_fetch(&c->inuse, 1, __ATOMIC_RELAXED);
+    peak  = __atomic_load_n(&c->peak, __ATOMIC_RELAXED);
+    while (inuse > peak && !__atomic_compare_exchange_n(&c->peak, &peak, inuse, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    return base + (size_t)index * c->size;
+}
+
+/* Return a buffer taken with pool_get (NULL is ignored). Lock-free. */
+void pool_put(void *buf)
+{
+    gbn_poolclass *c;
+    uint8_t *base;
+    uint64_t head;
+    uint64_t next;
+    uint32_t link;
+    uint32_t index;
+    int i;
+
+    if (buf == NULL)
+        return;
+
+    for (i = 0; i < POOL_CLASSES; i++){
+        c = &classes[i];
+        base = __atomic_load_n(&c->base, __ATOMIC_ACQUIRE);
+        if (base != NULL && (uint8_t *)buf >= base && (uint8_t *)buf < base + (size_t)c->nbufs * c->size)
+            break;
+    }
+    if (i == POOL_CLASSES)
+        return;
+    index = (uint32_t)(((uint8_t *)buf - base) / c->size);
+
+    /* Push it, the old head becoming its link */
+    head = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+    do {
+        link = (uint32_t)head;
+        memcpy(buf, &link, sizeof(link));
+        next = (((head >> 32) + 1) << 32) | (index + 1);
+    } while (!__atomic_compare_exchange_n(&c->head, &head, next, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    __atomic_sub_fetch(&c->inuse, 1, __ATOMIC_RELAXED);
+}
+
+/* Count a packet a connection dropped rather than exceed its quota */
+void pool_quotadrop(void)
+{
+    __atomic_fetch_add(&quotadrops, 1, __ATOMIC_RELAXED);
+}
+
+/*----- Interface -----*/
+
+/* Set the address space each size class reserves (rounded up to a huge */
+/* page) and the GBN_POOL_* flags. Only before the pool is first used.  */
+/* Returns 0, or -1 with errno set (EBUSY once the pool is in use).     */
+int gbn_pool_config(size_t size, int flags)
+{
+    int i;
+
+    if (size < ((size_t)1 << POOL_MAXSHIFT) || (flags & ~GBN_POOL_HUGEPAGES) != 0){
+        errno = EINVAL;
+        return(-1);
+    }
+
+    pthread_mutex_lock(&poollock);
+    for (i = 0; i < POOL_CLASSES; i++){
+        if (classes[i].base != NULL){
+            pthread_mutex_unlock(&poollock);
+            errno = EBUSY;
+            return(-1);
+        }
+    }
+    reserve   = (size + POOL_HUGEPAGE - 1) / POOL_HUGEPAGE * POOL_HUGEPAGE;
+    poolflags = flags;
+    pthread_mutex_unlock(&poollock);
+
+    return(0);
+}
+
+/* Get the occupancy of the pool, summed over its size classes. Can be */
+/* called at any time from any thread.                                 */
+/* Returns 0.                                                          */
+int gbn_getpoolstats(struct gbn_poolstats *stats)
+{
+    gbn_poolclass *c;
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < POOL_CLASSES; i++){
+        c = &classes[i];
+        if (__atomic_load_n(&c->base, __ATOMIC_ACQUIRE) == NULL)
+            continue;
+        stats->reserved  += reserve;
+        stats->backed    += (uint64_t)__atomic_load_n(&c->carved, __ATOMIC_RELAXED) * c->size;
+        stats->inuse     += (uint64_t)__atomic_load_n(&c->inuse, __ATOMIC_RELAXED) * c->size;
+        stats->peak      += (uint64_t)__atomic_load_n(&c->peak, __ATOMIC_RELAXED) * c->size;
+        stats->buffers   += __atomic_load_n(&c->inuse, __ATOMIC_RELAXED);
+        stats->allocs    += __atomic_load_n(&c->allocs, __ATOMIC_RELAXED);
+        stats->fails     += __atomic_load_n(&c->fails, __ATOMIC_RELAXED);
+        stats->hugepages += c->hugepages;
+    }
+    stats->quotadrops = __atomic_load_n(&quotadrops, __ATOMIC_RELAXED);
+
+    return(0);
+}
@@ -0,0 +1,57 @@
+#ifndef _gbn_pool_h
+#define _gbn_pool_h
+
+#include<stdint.h>
+#include<stddef.h>
+
+/*----- Pool parameters -----*/
+#define POOL_MINSHIFT  11         /* Smallest buffer: 2 KB                      */
+#define POOL_MAXSHIFT  17         /* Largest buffer: 128 KB, any datagram       */
+#define POOL_CLASSES   (POOL_MAXSHIFT - POOL_MINSHIFT + 1)
+#define POOL_RESERVE   (256 << 20) /* Default address space per class (bytes)   */
+#define POOL_ALIGN     64         /* Every buffer starts on a cache line        */
+
+/*----- Pool flags (see gbn_pool_config) -----*/
+#define GBN_POOL_HUGEPAGES 0x01   /* Back the pool with huge pages if possible  */
+
+/*----- Packet buffer pool -----*/
+/* One pool per process serves every connection. Buffers come in power   */
+/* of 2 size classes, each carved from its own region of address space,  */
+/* which is reserved on first use but only backed by memory as buffers   */
+/* are touched. Buffers that are freed go on a lock-free free list (a     */
+/* stack whose head carries a tag against ABA), so any thread can take   */
+/* or return one without a lock; the link is kept in the free buffer.    */
+typedef struct gbn_poolclass {
+    size_t size;                /* Bytes per buffer (a power of 2)             */
+    uint32_t nbufs;             /* Buffers the region can hold                 */
+    uint8_t *base;              /* Region, NULL until the class is first used  */
+    int hugepages;              /* Region is MAP_HUGETLB memory                */
+    uint64_t head;              /* Free list: tag << 32 | index + 1 (0: empty) */
+    uint32_t carved;            /* Buffers handed out from the region so far   */
+    uint32_t inuse;             /* Buffers taken and not returned              */
+    uint32_t peak;              /* Most buffers in use at once                 */
+    uint64_t allocs;            /* Buffers taken                               */
+    uint64_t fails;             /* Requests refused, the class being full      */
+} gbn_poolclass;
+
+/*----- Pool occupancy (see gbn_getpoolstats) -----*/
+typedef struct gbn_poolstats {
+    uint64_t reserved;          /* Address space reserved (bytes)              */
+    uint64_t backed;            /* Memory buffers have touched so far (bytes)  */
+    uint64_t inuse;             /* Bytes of the buffers in use                 */
+    uint64_t peak;              /* Sum of each class's peak (bytes)            */
+    uint64_t buffers;           /* Buffers in use                              */
+    uint64_t allocs;            /* Buffers taken                               */
+    uint64_t fails;             /* Requests refused, a class being full        */
+    uint64_t quotadrops;        /* Packets dropped for a connection's quota    */
+    int hugepages;              /* Classes backed by huge pages                */
+} gbn_poolstats;
+
+int gbn_pool_config(size_t reserve, int flags);
+int gbn_getpoolstats(struct gbn_poolstats *stats);
+
+void *pool_get(size_t size);
+void pool_put(void *buf);
+void pool_quotadrop(void);
+
+#endif
@@ -1,23 +1,373 @@
 #include "gbn.h"
+#include "stripe.h"
+#include<sys/mman.h>
+#include<sys/epoll.h>
+#include<sys/resource.h>
+
+static const char *traceName;	/* File for the packet trace (-t) 					 */
+
+/*----- Writing the packet trace on exit (empty unless built with make TRACE=1) -----*/
+static void dumpTrace(void){
+	FILE *traceFile;
+
+	if ((traceFile = fopen(traceName, "w")) == NULL){
+		perror("fopen");
+		return;
+	}
+	gbn_trace_dump(traceFile);
+	fclose(traceFile);
+}
+
+#define MAXEVENTS 256			/* Events handled per call to epoll_wait 			 */
+
+/*----- Server mode: serve any number of senders on one port -----*/
+/* Every connection is a non-blocking gbn socket registered with epoll and */
+/* writes to its own file, <prefix>.<n>. The server runs until killed.     */
+static int serve(int sockfd, const char *prefix){
+	int epfd;					/* epoll instance 									 */
+	int numEvents;				/* Number of ready descriptors 						 */
+	int newSockfd;				/* Socket file descriptor of a new client 		     */
+	int fd;						/* Ready descriptor 								 */
+	int numRead;				/* Number of bytes read 							 */
+	int i;
+	static char buf[1 << 20];	/* Buffer for received data (1 MB) 				 */
+	char name[4096];			/* Name of an output file 							 */
+	unsigned long numConns = 0;	/* Number of connections accepted so far 			 */
+	FILE **outputFiles = NULL;	/* Output file of each connection, by descriptor 	 */
+	int numFiles = 0;			/* Length of outputFiles 							 */
+	FILE **files;
+	struct epoll_event ev;
+	struct epoll_event events[MAXEVENTS];
+	struct rlimit rl;
+
+	/*----- Every connection takes a descriptor: allow as many as possible -----*/
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max){
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if ((epfd = epoll_create1(0)) == -1){
+		perror("epoll_create1");
+		return(-1);
+	}
+
+	/*----- The listening socket reports new connections -----*/
+	if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK) == -1){
+		perror("fcntl");
+		return(-1);
+	}
+	ev.events  = EPOLLIN;
+	ev.data.fd = sockfd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1){
+		perror("epoll_ctl");
+		return(-1);
+	}
+
+	while(1){
+		if ((numEvents = epoll_wait(epfd, events, MAXEVENTS, -1)) == -1){
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return(-1);
+		}
+
+		for (i = 0; i < numEvents; i++){
+			fd = events[i].data.fd;
+
+			/*----- Accepting every pending connection -----*/
+			if (fd == sockfd){
+				while ((newSockfd = gbn_accept(sockfd, NULL, NULL)) != -1){
+					if (newSockfd >= numFiles){
+						if ((files = realloc(outputFiles, (newSockfd + 1) * 2 * sizeof(FILE *))) == NULL){
+							perror("realloc");
+							gbn_close(newSockfd);
+							break;
+						}
+						memset(files + numFiles, 0, ((newSockfd + 1) * 2 - numFiles) * sizeof(FILE *));
+						outputFiles = files;
+						numFiles = (newSockfd + 1) * 2;
+					}
+
+					sprintf(name, "%.4000s.%lu", prefix, numConns++);
+					if ((outputFiles[newSockfd] = fopen(name, "wb")) == NULL){
+						perror("fopen");
+						gbn_close(newSockfd);
+						continue;
+					}
+
+					fcntl(newSockfd, F_SETFL, fcntl(newSockfd, F_GETFL) | O_NONBLOCK);
+					ev.events  = EPOLLIN;
+					ev.data.fd = newSockfd;
+					if (epoll_ctl(epfd, EPOLL_CTL_ADD, newSockfd, &ev) == -1){
+						perror("epoll_ctl");
+						fclose(outputFiles[newSockfd]);
+						outputFiles[newSockfd] = NULL;
+						gbn_close(newSockfd);
+						continue;
+					}
+					fprintf(stderr, "receiver: connection %lu writing to %s\n", numConns - 1, name);
+				}
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					perror("gbn_accept");
+				continue;
+			}
+
+			/*----- Reading everything that arrived on a connection -----*/
+			while ((numRead = gbn_recv(fd, buf, sizeof(buf), 0)) > 0)
+				fwrite(buf, 1, numRead, outputFiles[fd]);
+			if (numRead == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				continue;
+			if (numRead == -1)
+				perror("gbn_recv");
+
+			/*----- Transfer done (or failed): closing the connection -----*/
+			epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+			if (fclose(outputFiles[fd]) == EOF)
+				perror("fclose");
+			outputFiles[fd] = NULL;
+			if (gbn_close(fd) == -1)
+				perror("gbn_close");
+		}
+	}
+}
+
+/*----- One stream of a striped transfer (-P) -----*/
+typedef struct stream {
+	int sockfd;					/* Its gbn socket 									 */
+	int fileFd;					/* Output file, shared by every stream 			 */
+	char *map;					/* Mapping of the output file, or NULL 			 */
+	uint64_t offset;			/* Start of its range in the file 					 */
+	uint64_t length;			/* Bytes in its range 								 */
+	int ok;						/* Whether the whole range was written 			 */
+} stream;
+
+/*----- Reading exactly len bytes, for the manifest: returns 0, or -1 -----*/
+static int recvAll(int sockfd, void *buf, size_t len){
+	size_t got = 0;
+	ssize_t numRead;
+
+	while (got < len){
+		if ((numRead = gbn_recv(sockfd, (char *)buf + got, len - got, 0)) <= 0)
+			return(-1);
+		got += numRead;
+	}
+	return(0);
+}
+
+/*----- Stream thread: writes its range in place as it arrives, received -----*/
+/*----- straight into the mapping or else written with pwrite           -----*/
+static void *recvStream(void *arg){
+	stream *st = arg;
+	char *buf;					/* Buffer for received data 						 */
+	uint64_t got = 0;			/* Bytes of the range written so far 				 */
+	ssize_t numRead = 1;
+	ssize_t numWritten;
+	ssize_t done;
+
+	if ((buf = malloc(STRIPE_CHUNK)) == NULL){
+		perror("malloc");
+		return NULL;
+	}
+
+	while (st->map != NULL && got < st->length &&
+		   (numRead = gbn_recv(st->sockfd, st->map + st->offset + got, st->length - got, 0)) > 0)
+		got += numRead;
+
+	/*----- Past the mapped range, only the end of the stream may follow -----*/
+	while (numRead > 0 && (numRead = gbn_recv(st->sockfd, buf, STRIPE_CHUNK, 0)) > 0){
+		if (got + numRead > st->length){
+			fprintf(stderr, "receiver: stream sent past its range\n");
+			break;
+		}
+		for (done = 0; done < numRead; done += numWritten){
+			if ((numWritten = pwrite(st->fileFd, buf + done, numRead - done, (off_t)(st->offset + got + done))) == -1){
+				perror("pwrite");
+				break;
+			}
+		}
+		if (done < numRead)
+			break;
+		got += numRead;
+	}
+	if (numRead == -1)
+		perror("gbn_recv");
+	free(buf);
+
+	if (gbn_close(st->sockfd) == -1)
+		perror("gbn_close");
+	else
+		st->ok = (numRead == 0 && got == st->length);
+	return NULL;
+}
+
+/*----- Striped mode: one sender, several streams, one file -----*/
+/* The first connection's manifest tells how many streams there are and */
+/* the file size, which sets up the mapping; every stream then gets its */
+/* thread as soon as it is accepted, while the next ones are accepted.  */
+static int striped(int sockfd, const char *name){
+	stream stripes[MAXSTREAMS];
+	pthread_t workers[MAXSTREAMS];
+	stripe_manifest manifest;
+	int seen[MAXSTREAMS];		/* Whether a stream index has its thread 		 */
+	uint32_t streams = 1;		/* Number of streams, from the first manifest 	 */
+	uint64_t size = 0;			/* File size, from the first manifest 			 */
+	char *map = NULL;			/* Mapping of the output file 					 */
+	uint64_t offset, length;
+	uint32_t index;
+	uint32_t started = 0;		/* Number of stream threads started 				 */
+	int newSockfd;
+	int fileFd;
+	int failed = 0;
+	uint32_t i;
+
+	if ((fileFd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1){
+		perror("open");
+		return(-1);
+	}
+
+	memset(seen, 0, sizeof(seen));
+	for (i = 0; i < streams; i++){
+		if ((newSockfd = gbn_accept(sockfd, NULL, NULL)) == -1){
+			perror("gbn_accept");
+			break;
+		}
+		if (recvAll(newSockfd, &manifest, sizeof(manifest)) == -1){
+			fprintf(stderr, "receiver: connection closed before its manifest\n");
+			gbn_close(newSockfd);
+			break;
+		}
+
+		index  = ntohl(manifest.index);
+		offset = be64toh(manifest.offset);
+		length = be64toh(manifest.length);
+		if (i == 0){
+			streams = ntohl(manifest.streams);
+			size    = be64toh(manifest.size);
+		}
+		if (ntohl(manifest.magic) != STRIPE_MAGIC || streams < 1 || streams > MAXSTREAMS ||
+			ntohl(manifest.streams) != streams || be64toh(manifest.size) != size ||
+			index >= streams || seen[index] || offset > size || length > size - offset){
+			fprintf(stderr, "receiver: invalid stream manifest\n");
+			gbn_close(newSockfd);
+			break;
+		}
+
+		/* Reserve the blocks up front, then map the file to receive into it */
+		if (i == 0){
+			if (size > 0 && fallocate(fileFd, 0, 0, (off_t)size) == -1 && ftruncate(fileFd, (off_t)size) == -1){
+				perror("ftruncate");
+				gbn_close(newSockfd);
+				break;
+			}
+			if (size > 0 && (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileFd, 0)) == MAP_FAILED)
+				map = NULL;
+			fprintf(stderr, "receiver: %u streams writing %llu bytes to %s\n", streams, (unsigned long long)size, name);
+		}
+
+		memset(&stripes[index], 0, sizeof(stream));
+		stripes[index].sockfd = newSockfd;
+		stripes[index].fileFd = fileFd;
+		stripes[index].map    = map;
+		stripes[index].offset = offset;
+		stripes[index].length = length;
+		if ((errno = pthread_create(&workers[index], NULL, recvStream, &stripes[index])) != 0){
+			perror("pthread_create");
+			gbn_close(newSockfd);
+			break;
+		}
+		seen[index] = 1;
+		started++;
+	}
+
+	/* Streams that never started count as failed */
+	failed = streams - started;
+	for (i = 0; i < MAXSTREAMS; i++){
+		if (!seen[i])
+			continue;
+		pthread_join(workers[i], NULL);
+		failed += !stripes[i].ok;
+	}
+
+	if (map != NULL)
+		munmap(map, size);
+	if (close(fileFd) == -1){
+		perror("close");
+		return(-1);
+	}
+	if (failed){
+		fprintf(stderr, "receiver: %d of %u streams failed\n", failed, streams);
+		return(-1);
+	}
+	return(0);
+}
 
 int main(int argc, char *argv[]){
 	int sockfd; 				/* Socket file descriptor of the server     		 */
 	int newSockfd;				/* Socket file descriptor of the client		 	     */
 	int numRead;				/* Number of packets read 				        	 */
-	char buf[DATALEN];			/* Buffer for received packets (1024) 		         */
+	static char buf[1 << 20];	/* Buffer for received data (1 MB) 				 */
 	struct sockaddr_in server;
 	struct sockaddr_in client;
 	FILE *outputFile;
 	socklen_t socklen;
+	int opt;					/* Command line option 								 */
+	int sack = 0;				/* Allow Selective Repeat (-s) 						 */
+	int serverMode = 0;			/* Serve many senders, one file each (-d) 			 */
+	int mss = 0;				/* Maximum segment size (-m), 0 for the default 	 */
+	int pmtu = 0;				/* Cap the MSS at the path MTU (-p) 				 */
+	int crc = 0;				/* Allow CRC32C instead of the checksum (-c) 		 */
+	gbn_impair impair;			/* Simulated path (-i) 							 */
+	int impaired = 0;			/* Whether -i was given 						 */
+	int stripeMode = 0;			/* Take a striped transfer (-P) 					 */
 	
 	/*----- Checking arguments -----*/
-	if (argc != 3){
-		fprintf(stderr, "usage: receiver <port> <filename>\n");
+	while ((opt = getopt(argc, argv, "sdPm:pci:v:t:")) != -1){
+		switch (opt){
+			case 's':
+				sack = 1;
+				break;
+			case 'm':
+				mss = atoi(optarg);
+				break;
+			case 'p':
+				pmtu = 1;
+				break;
+			case 'c':
+				crc = 1;
+				break;
+			case 'i':
+				if (gbn_impair_parse(optarg, &impair) == -1){
+					fprintf(stderr, "%s: invalid impairments: %s\n", argv[0], optarg);
+					exit(-1);
+				}
+				impaired = 1;
+				break;
+			case 'v':
+				gbn_setloglevel(atoi(optarg));
+				break;
+			case 't':
+				traceName = optarg;
+				atexit(dumpTrace);
+				break;
+			case 'd':
+				serverMode = 1;
+				break;
+			case 'P':
+				stripeMode = 1;
+				break;
+			default:
+				fprintf(stderr, "usage: receiver [-s] [-d] [-P] [-m mss] [-p] [-c] [-i impairments] [-v level] [-t tracefile] <port> <filename>\n");
+				exit(-1);
+		}
+	}
+	if (argc - optind != 2 || (serverMode && stripeMode)){
+		fprintf(stderr, "usage: receiver [-s] [-d] [-P] [-m mss] [-p] [-c] [-i impairments] [-v level] [-t tracefile] <port> <filename>\n");
 		exit(-1);
 	}
+	argv += optind - 1;
 
 	/*----- Opening the output file -----*/
-	if ((outputFile = fopen(argv[2], "wb")) == NULL){
+	if (!serverMode && !stripeMode && (outputFile = fopen(argv[2], "wb")) == NULL){
 		perror("fopen");
 		exit(-1);
 	}
@@ -30,6 +380,16 @@ int main(int argc, char *argv[]){
 		perror("gbn_socket");
 		exit(-1);
 	}
+
+	/*----- Setting the protocol options -----*/
+	if ((sack && gbn_setsockopt(sockfd, GBN_SACK, &sack, sizeof(sack)) == -1) ||
+		(mss && gbn_setsockopt(sockfd, GBN_MSS, &mss, sizeof(mss)) == -1) ||
+		(pmtu && gbn_setsockopt(sockfd, GBN_PMTU, &pmtu, sizeof(pmtu)) == -1) ||
+		(crc && gbn_setsockopt(sockfd, GBN_CRC32C, &crc, sizeof(crc)) == -1) ||
+		(impaired && gbn_setsockopt(sockfd, GBN_IMPAIR, &impair, sizeof(impair)) == -1)){
+		perror("gbn_setsockopt");
+		exit(-1);
+	}
 	
 	/*--- Setting the server's parameters -----*/
 	memset(&server, 0, sizeof(struct sockaddr_in));
@@ -44,11 +404,24 @@ int main(int argc, char *argv[]){
 	}
 	
 	/*----- Listening to new connections -----*/
-	if (gbn_listen(sockfd, 1) == -1){
+	if (gbn_listen(sockfd, (serverMode || stripeMode) ? MAXBACKLOG : 1) == -1){
 		perror("gbn_listen");
 		exit(-1);
 	}
 
+	/*----- Server mode never returns unless something fails -----*/
+	if (serverMode){
+		serve(sockfd, argv[2]);
+		exit(-1);
+	}
+
+	/*----- Striped mode writes every stream in place, then returns -----*/
+	if (stripeMode){
+		if (striped(sockfd, argv[2]) == -1 || gbn_close(sockfd) == -1)
+			exit(-1);
+		return (0);
+	}
+
 	/*----- Waiting for the client to connect -----*/
 	socklen = sizeof(struct sockaddr_in);
 	newSockfd = gbn_accept(sockfd, (struct sockaddr *)&client, &socklen);
@@ -59,7 +432,7 @@ int main(int argc, char *argv[]){
 	
 	/*----- Reading from the socket and dumping it to the file -----*/
 	while(1){
-		if ((numRead = gbn_recv(newSockfd, buf, DATALEN, 0)) == -1){
+		if ((numRead = gbn_recv(newSockfd, buf, sizeof(buf), 0)) == -1){
 			perror("gbn_recv");
 			exit(-1);
 		}
@@ -68,8 +441,8 @@ int main(int argc, char *argv[]){
 		fwrite(buf, 1, numRead, outputFile);
 	}
 
-	/*----- Closing the socket -----*/
-	if (gbn_close(sockfd) == -1){
+	/*----- Closing the connection and the listening socket -----*/
+	if (gbn_close(newSockfd) == -1 || gbn_close(sockfd) == -1){
 		perror("gbn_close");
 		exit(-1);
 	}
@@ -1,25 +1,186 @@
 #include "gbn.h"
+#include "stripe.h"
+#include<sys/stat.h>
+#include<sys/mman.h>
+
+static const char *traceName;	/* File for the packet trace (-t) 					 */
+
+/*----- Writing the packet trace on exit (empty unless built with make TRACE=1) -----*/
+static void dumpTrace(void){
+	FILE *traceFile;
+
+	if ((traceFile = fopen(traceName, "w")) == NULL){
+		perror("fopen");
+		return;
+	}
+	gbn_trace_dump(traceFile);
+	fclose(traceFile);
+}
+
+/*----- One stream of a striped transfer (-P) -----*/
+typedef struct stream {
+	int sockfd;					/* Its gbn socket 								*/
+	int fileFd;					/* Input file, shared by every stream 			*/
+	const char *map;			/* Mapping of the input file, or NULL 			*/
+	const struct sockaddr_in *server;
+	stripe_manifest manifest;	/* Sent first, in network byte order 			*/
+	uint64_t offset;			/* Start of its range in the file 				*/
+	uint64_t length;			/* Bytes in its range 							*/
+	int ok;						/* Whether the whole range was sent 			*/
+} stream;
+
+/*----- Stream thread: connects, sends the manifest, then its range, -----*/
+/*----- straight from the mapping or else read with pread            -----*/
+static void *sendStream(void *arg){
+	stream *st = arg;
+	char *buf = NULL;			/* Buffer for file data handed to gbn_send 		*/
+	uint64_t sent = 0;			/* Bytes of the range sent so far 				*/
+	int failed = 0;				/* Whether a call failed before the whole range */
+	ssize_t numRead;
+	size_t len;
+
+	if ((buf = malloc(STRIPE_CHUNK)) == NULL){
+		perror("malloc");
+		failed = 1;
+	} else if (gbn_connect(st->sockfd, (const struct sockaddr *)st->server, sizeof(*st->server)) == -1){
+		perror("gbn_connect");
+		failed = 1;
+	} else if (gbn_send(st->sockfd, &st->manifest, sizeof(st->manifest), 0) == -1){
+		perror("gbn_send");
+		failed = 1;
+	} else if (st->map != NULL){
+		if (gbn_send(st->sockfd, st->map + st->offset, st->length, 0) == -1){
+			perror("gbn_send");
+			failed = 1;
+		} else
+			sent = st->length;
+	}
+
+	while (!failed && sent < st->length){
+		len = (st->length - sent < STRIPE_CHUNK) ? (size_t)(st->length - sent) : STRIPE_CHUNK;
+		if ((numRead = pread(st->fileFd, buf, len, (off_t)(st->offset + sent))) <= 0){
+			if (numRead == 0)
+				fprintf(stderr, "sender: input file shrank\n");
+			else
+				perror("pread");
+			failed = 1;
+			break;
+		}
+		if (gbn_send(st->sockfd, buf, numRead, 0) == -1){
+			perror("gbn_send");
+			failed = 1;
+			break;
+		}
+		sent += numRead;
+	}
+	free(buf);
+
+	/*----- Closing the socket on every path; its last ACK ends the stream -----*/
+	if (gbn_close(st->sockfd) == -1){
+		perror("gbn_close");
+		failed = 1;
+	}
+	st->ok = !failed && sent == st->length;
+	return NULL;
+}
 
 int main(int argc, char *argv[]){
 	int sockfd;              /* Socket file descriptor of the client        	*/
 	int numRead;			 /* Number of packets read 							*/
 	socklen_t socklen;	     /* Length of the socket structure sockaddr     	*/
-	char buf[DATALEN * N];   /* Buffer for sending packets (1024 * 1024) 	    */
+	char buf[1 << 20];       /* Buffer for file data handed to gbn_send (1 MB)  */
 	struct hostent *he;	 	 /* Structure for resolving names into IP addresses */
-	FILE *inputFile;     	 /* Input file pointer                              */
+	const char *map = NULL;	 /* Mapping of the input file, if it is regular 	*/
 	struct sockaddr_in server;
+	int opt;				 /* Command line option 							*/
+	int sack = 0;			 /* Request Selective Repeat (-s) 					*/
+	int mss = 0;			 /* Maximum segment size (-m), 0 for the default 	*/
+	int pmtu = 0;			 /* Cap the MSS at the path MTU (-p) 				*/
+	int zerocopy = 0;		 /* Send with MSG_ZEROCOPY (-z) 					*/
+	int crc = 0;			 /* Request CRC32C instead of the checksum (-c) 	*/
+	gbn_impair impair;		 /* Simulated path (-i) 							*/
+	int impaired = 0;		 /* Whether -i was given 						*/
+	int threaded = 0;		 /* Send through the sender threads (-T) 		*/
+	int streams = 0;		 /* Striped transfer over this many streams (-P) */
+	int sockfds[MAXSTREAMS]; /* Socket of each stream 						*/
+	stream stripes[MAXSTREAMS];
+	pthread_t workers[MAXSTREAMS];
+	int fileFd;				 /* Input file 									*/
+	struct stat fileStat;
+	int failed = 0;			 /* Number of streams that failed 				*/
+	int i;
 
 	socklen = sizeof(struct sockaddr);
 
 	/*----- Checking arguments -----*/
-	if (argc != 4){
-		fprintf(stderr, "usage: sender <hostname> <port> <filename>\n");
+	while ((opt = getopt(argc, argv, "sm:pzci:TP:v:t:")) != -1){
+		switch (opt){
+			case 's':
+				sack = 1;
+				break;
+			case 'm':
+				mss = atoi(optarg);
+				break;
+			case 'p':
+				pmtu = 1;
+				break;
+			case 'c':
+				crc = 1;
+				break;
+			case 'i':
+				if (gbn_impair_parse(optarg, &impair) == -1){
+					fprintf(stderr, "%s: invalid impairments: %s\n", argv[0], optarg);
+					exit(-1);
+				}
+				impaired = 1;
+				break;
+			case 'v':
+				gbn_setloglevel(atoi(optarg));
+				break;
+			case 't':
+				traceName = optarg;
+				atexit(dumpTrace);
+				break;
+			case 'z':
+				zerocopy = 1;
+				break;
+			case 'T':
+				threaded = 1;
+				break;
+			case 'P':
+				streams = atoi(optarg);
+				if (streams < 1 || streams > MAXSTREAMS){
+					fprintf(stderr, "%s: streams must be between 1 and %d\n", argv[0], MAXSTREAMS);
+					exit(-1);
+				}
+				break;
+			default:
+				fprintf(stderr, "usage: sender [-s] [-m mss] [-p] [-z] [-c] [-i impairments] [-T] [-P streams] [-v level] [-t tracefile] <hostname> <port> <filename>\n");
+				exit(-1);
+		}
+	}
+	if (argc - optind != 3){
+		fprintf(stderr, "usage: sender [-s] [-m mss] [-p] [-z] [-c] [-i impairments] [-T] [-P streams] [-v level] [-t tracefile] <hostname> <port> <filename>\n");
 		exit(-1);
 	}
+	argv += optind - 1;
 
 	/*----- Opening the input file -----*/
-	if ((inputFile = fopen(argv[3], "rb")) == NULL){
-		perror("fopen");
+	if ((fileFd = open(argv[3], O_RDONLY)) == -1 || fstat(fileFd, &fileStat) == -1){
+		perror("open");
+		exit(-1);
+	}
+
+	/*----- Mapping it, so gbn_send segments it without another copy -----*/
+	/* Anything but a non-empty regular file is read instead */
+	if (S_ISREG(fileStat.st_mode) && fileStat.st_size > 0){
+		if ((map = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fileFd, 0)) == MAP_FAILED)
+			map = NULL;
+		else
+			madvise((void *)map, fileStat.st_size, MADV_SEQUENTIAL);
+	}
+	if (streams && !S_ISREG(fileStat.st_mode)){
+		fprintf(stderr, "%s: striping needs a regular file\n", argv[0]);
 		exit(-1);
 	}
 
@@ -29,14 +190,31 @@ int main(int argc, char *argv[]){
 		exit(-1);
 	}
 
-	/*----- Opening the socket -----*/
+	/*----- Opening the socket of every stream, before any thread uses one -----*/
 	/* Family: AF_INET       */
 	/* Type: SOCK_DGRAM      */
 	/* Protocal: IPPROTO_UDP */
-	if ((sockfd = gbn_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1){
-		perror("gbn_socket");
-		exit(-1);
+	for (i = 0; i < (streams ? streams : 1); i++){
+		if ((sockfd = sockfds[i] = gbn_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1){
+			perror("gbn_socket");
+			exit(-1);
+		}
+
+		/*----- Setting the protocol options (a different impairment seed per stream) -----*/
+		if (impaired && i > 0 && impair.seed != 0)
+			impair.seed++;
+		if ((sack && gbn_setsockopt(sockfd, GBN_SACK, &sack, sizeof(sack)) == -1) ||
+			(mss && gbn_setsockopt(sockfd, GBN_MSS, &mss, sizeof(mss)) == -1) ||
+			(pmtu && gbn_setsockopt(sockfd, GBN_PMTU, &pmtu, sizeof(pmtu)) == -1) ||
+			(zerocopy && gbn_setsockopt(sockfd, GBN_ZEROCOPY, &zerocopy, sizeof(zerocopy)) == -1) ||
+			(crc && gbn_setsockopt(sockfd, GBN_CRC32C, &crc, sizeof(crc)) == -1) ||
+			(impaired && gbn_setsockopt(sockfd, GBN_IMPAIR, &impair, sizeof(impair)) == -1) ||
+			(threaded && gbn_setsockopt(sockfd, GBN_THREADS, &threaded, sizeof(threaded)) == -1)){
+			perror("gbn_setsockopt");
+			exit(-1);
+		}
 	}
+	sockfd = sockfds[0];
 
 	/*--- Setting the server's parameters -----*/
 	memset(&server, 0, sizeof(struct sockaddr_in));
@@ -44,19 +222,62 @@ int main(int argc, char *argv[]){
 	server.sin_addr   = *(struct in_addr *)he->h_addr;
 	server.sin_port   = htons(atoi(argv[2]));
 
+	/*----- Striped transfer: one thread per stream, each with its range -----*/
+	if (streams){
+		for (i = 0; i < streams; i++){
+			memset(&stripes[i], 0, sizeof(stream));
+			stripes[i].sockfd = sockfds[i];
+			stripes[i].fileFd = fileFd;
+			stripes[i].map    = map;
+			stripes[i].server = &server;
+			stripes[i].offset = (uint64_t)fileStat.st_size * i / streams;
+			stripes[i].length = (uint64_t)fileStat.st_size * (i + 1) / streams - stripes[i].offset;
+			stripes[i].manifest.magic   = htonl(STRIPE_MAGIC);
+			stripes[i].manifest.index   = htonl(i);
+			stripes[i].manifest.streams = htonl(streams);
+			stripes[i].manifest.offset  = htobe64(stripes[i].offset);
+			stripes[i].manifest.length  = htobe64(stripes[i].length);
+			stripes[i].manifest.size    = htobe64(fileStat.st_size);
+			if ((errno = pthread_create(&workers[i], NULL, sendStream, &stripes[i])) != 0){
+				perror("pthread_create");
+				exit(-1);
+			}
+		}
+		for (i = 0; i < streams; i++){
+			pthread_join(workers[i], NULL);
+			failed += !stripes[i].ok;
+		}
+		if (failed){
+			fprintf(stderr, "sender: %d of %d streams failed\n", failed, streams);
+			exit(-1);
+		}
+		if (map != NULL)
+			munmap((void *)map, fileStat.st_size);
+		close(fileFd);
+		return(0);
+	}
+
 	/*----- Connecting to the server -----*/
 	if (gbn_connect(sockfd, (struct sockaddr *)&server, socklen) == -1){
 		perror("gbn_connect");
 		exit(-1);
 	}
 
-	/*----- Reading from the file and sending it through the socket -----*/
-	while ((numRead = fread(buf, 1, DATALEN * N, inputFile)) > 0){
+	/*----- Sending the mapped file, or reading it and sending each part -----*/
+	if (map != NULL && gbn_send(sockfd, map, fileStat.st_size, 0) == -1){
+		perror("gbn_send");
+		exit(-1);
+	}
+	while (map == NULL && (numRead = read(fileFd, buf, sizeof(buf))) > 0){
 		if (gbn_send(sockfd, buf, numRead, 0) == -1){
 			perror("gbn_send");
 			exit(-1);
 		}
 	}
+	if (map == NULL && numRead == -1){
+		perror("read");
+		exit(-1);
+	}
 
 	/*----- Closing the socket -----*/
 	if (gbn_close(sockfd) == -1){
@@ -65,8 +286,10 @@ int main(int argc, char *argv[]){
 	}
 
 	/*----- Closing the file -----*/
-	if (fclose(inputFile) == EOF){
-		perror("fclose");
+	if (map != NULL)
+		munmap((void *)map, fileStat.st_size);
+	if (close(fileFd) == -1){
+		perror("close");
 		exit(-1);
 	}
 
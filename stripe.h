@@ -0,0 +1,27 @@
+#ifndef _stripe_h
+#define _stripe_h
+
+#include<stdint.h>
+#include<endian.h>
+
+/*----- Striped transfer (sender -P, receiver -P) -----*/
+/* The file is split into one contiguous range per stream, each sent over */
+/* its own gbn connection by its own thread. Every stream starts with a   */
+/* manifest naming its range, so the receiver can write it in place      */
+/* (pwrite) whatever order the connections arrive in.                    */
+#define STRIPE_MAGIC   0x47424e53 /* "GBNS"                                     */
+#define MAXSTREAMS     64         /* Most streams of one transfer               */
+#define STRIPE_CHUNK   (1 << 20)  /* Bytes read or written per call (1 MB)      */
+
+/*----- First bytes of every stream, all fields in network byte order -----*/
+typedef struct stripe_manifest {
+    uint32_t magic;             /* STRIPE_MAGIC                                */
+    uint32_t index;             /* This stream, 0 to streams - 1               */
+    uint32_t streams;           /* Number of streams of the transfer           */
+    uint32_t reserved;          /* Zero                                        */
+    uint64_t offset;            /* Start of the range in the file              */
+    uint64_t length;            /* Bytes in the range                          */
+    uint64_t size;              /* Size of the whole file                      */
+} stripe_manifest;
+
+#endif